@@ -1,6 +1,7 @@
 from ctypes import *
 
 MAGIC = 0x30303635
+BLOCK_SIZE = 4096
 
 class dirent(Structure):
     _fields_ = [("valid", c_uint, 1),
@@ -10,31 +11,124 @@ class dirent(Structure):
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("csum_start", c_uint),
+                ("csum_blocks", c_uint),
+                ("itab_start", c_uint),     # 0: one inode per block
+                ("itab_blocks", c_uint),
+                ("imap_start", c_uint),
+                ("imap_blocks", c_uint),
+                ("free_blocks", c_uint),    # as of the last unmount
+                ("free_inodes", c_uint),
+                ("journal_start", c_uint),  # 0: no journal
+                ("journal_blocks", c_uint),
+                ("_pad", c_char * 4048)]
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
                 ("gid", c_ushort),
-                ("mode", c_uint),
+                ("mode", c_uint),           # flags in the top 16 bits
                 ("ctime", c_uint),
                 ("mtime", c_uint),
                 ("size", c_int),
                 ("ptrs", c_uint * 1019)]
 
-class bitmap(Structure):
-    _fields_ = [("vals", c_uint * 1024)]
+    # no room for a flags field: they are kept above the mode bits
+    @property
+    def flags(self):
+        return self.mode >> FLAGS_SHIFT
+
+DIR_HASHED = 1                  # inode.flags: directory blocks are hash buckets
+EXTENTS = 2                     # compact inode maps extents (below)
+INDIRECT = 4                    # original inode: ptrs[NDIRECT_ORIG], [+1] are
+                                # its indirect and double-indirect blocks
+INLINE = 8                      # file data is in the inode's map area
+NDIRECT_ORIG = 1017
+PTRS_PER_BLOCK = 1024
+INLINE_ORIG = 4076
+FLAGS_SHIFT = 16
+
+# compact format: 128-byte inodes in an inode table, inode N in slot N
+NDIRECT = 24
+INODES_PER_BLOCK = 32
+INLINE_COMPACT = 104
+
+# with EXTENTS set the pointers are a header and up to NEXTENT extents;
+# at depth 1 each of those points to an extent block (header and up to
+# EXTENTS_PER_BLOCK extents) instead, with its extent count in 'len'
+NEXTENT = 8
+EXTENTS_PER_BLOCK = 340
+
+class extent(Structure):
+    _fields_ = [("lblk", c_uint),
+                ("pblk", c_uint),
+                ("len", c_uint)]
+
+class extent_hdr(Structure):
+    _fields_ = [("count", c_ushort),
+                ("depth", c_ushort)]
+
+class extent_block(Structure):
+    _fields_ = [("eh", extent_hdr),
+                ("ext", extent * EXTENTS_PER_BLOCK),
+                ("_pad", c_char * 12)]
+
+class _ptrmap(Structure):
+    _fields_ = [("ptrs", c_uint * NDIRECT),
+                ("indirect", c_uint),
+                ("dindirect", c_uint)]
+
+class _extmap(Structure):
+    _fields_ = [("eh", extent_hdr),
+                ("ext", extent * NEXTENT),
+                ("_pad", c_char * 4)]
+
+class _map(Union):
+    _anonymous_ = ("p", "e")
+    _fields_ = [("p", _ptrmap),
+                ("e", _extmap),
+                ("data", c_ubyte * INLINE_COMPACT)]
+
+class cinode(Structure):
+    _anonymous_ = ("m",)
+    _fields_ = [("uid", c_ushort),
+                ("gid", c_ushort),
+                ("mode", c_uint),
+                ("ctime", c_uint),
+                ("mtime", c_uint),
+                ("size", c_int),
+                ("flags", c_uint),
+                ("m", _map)]
+
+def extents(blocks):
+    # a block list as [lblk, pblk, len] runs
+    runs = []
+    for i, b in enumerate(blocks):
+        if runs and runs[-1][1] + runs[-1][2] == b:
+            runs[-1][2] += 1
+        else:
+            runs.append([i, b, 1])
+    return runs
+
+def itable_size(nblocks):
+    # one inode per two blocks, in whole table blocks (same as fs_mkfs)
+    n = nblocks // 2
+    return (n + INODES_PER_BLOCK - 1) // INODES_PER_BLOCK * INODES_PER_BLOCK
+
+def bitmap_blocks(nblocks):
+    # the block bitmap: blocks 1.. (same as FS_BITMAP_BLOCKS)
+    return (nblocks + BLOCK_SIZE * 8 - 1) // (BLOCK_SIZE * 8)
+
+# a bit per block (or inode), in 'n' blocks or over 'data'
+class bitmap(bytearray):
+    def __init__(self, n=1, data=None):
+        bytearray.__init__(self, data if data is not None else BLOCK_SIZE * n)
     def get(self, i):
-        n = self.vals[i // 32]
-        mask = 1 << (i % 32)
-        return (n & mask) != 0
+        return (self[i // 8] >> (i % 8)) & 1 != 0
     def set(self, i, val):
-        mask = 1 << (i % 32)
-        n = self.vals[i // 32]
         if val:
-            n = n | mask
+            self[i // 8] |= 1 << (i % 8)
         else:
-            n = n & (mask ^ 0xffffffff)
-        self.vals[i // 32] = n
+            self[i // 8] &= ~(1 << (i % 8)) & 0xff
 
 S_IFMT  = 0o0170000  # bit mask for the file type bit field
 S_IFREG = 0o0100000  # regular file
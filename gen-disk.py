@@ -1,33 +1,75 @@
 #!/usr/bin/python
 #
-# usage: gen-disk.py input output.img
+# usage: gen-disk.py [-q] [-c] input output.img
 #
 # see comments in disk1.in for file format
+#
+# -c writes the compact format: the inodes go in an inode table (see
+# fs.h) instead of the blocks the input puts them in. The root stays
+# inode 2 and the others are numbered from 3 in input order. Files map
+# their blocks as extents there, like the ones the file system creates,
+# and files of up to INLINE_COMPACT bytes keep their data in the inode
+# instead (their blocks in the input are left free).
 
 import sys
 import diskfmt as fs
 import random as rnd
 
 quiet = False
-if sys.argv[1] == '-q':
-    quiet = True
+compact = False
+while sys.argv[1] in ('-q', '-c'):
+    if sys.argv[1] == '-q':
+        quiet = True
+    else:
+        compact = True
     sys.argv.pop(1)
 
 chars = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
 
+def fill(i, item):
+    i.uid, i.gid, i.mode = item.uid, item.gid, item.mode
+    i.ctime, i.mtime, i.size = item.ctime, item.mtime, item.size
+
+def cinode(item):
+    i = fs.cinode()
+    fill(i, item)
+    if item.inline:
+        i.flags |= fs.INLINE | fs.EXTENTS
+        i.data[:item.size] = item.block(0)[:item.size]
+        return i
+    if item.runs is None:
+        for j in range(min(len(item.blocks), fs.NDIRECT)):
+            i.ptrs[j] = item.blocks[j]
+        i.indirect = item.indirect
+        return i
+    i.flags |= fs.EXTENTS
+    if not item.leaves:
+        i.eh.count = len(item.runs)
+        for j, r in enumerate(item.runs):
+            i.ext[j].lblk, i.ext[j].pblk, i.ext[j].len = r
+        return i
+    i.eh.count, i.eh.depth = len(item.leaves), 1
+    for j, lba in enumerate(item.leaves):
+        runs = leaf_runs(item, j)
+        i.ext[j].lblk, i.ext[j].pblk, i.ext[j].len = runs[0][0], lba, len(runs)
+    return i
+
+def leaf_runs(item, j):
+    return item.runs[j * fs.EXTENTS_PER_BLOCK:(j + 1) * fs.EXTENTS_PER_BLOCK]
+
 class file(object):
     def __init__(self, fields):
         inum,self.name,self.uid,self.gid,self.mode,self.ctime,self.mtime,size,blocks = fields
         self.inum = int(inum)
         self.size = int(size)
         self.blocks = list(map(int, blocks.split(',')))
+        self.indirect = 0
+        self.runs, self.leaves = None, []
+        self.inline = compact and self.size <= fs.INLINE_COMPACT
 
     def inode(self):
         i = fs.inode()
-        i.uid, i.gid, i.mode = self.uid, self.gid, self.mode
-        i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
-
-
+        fill(i, self)
         for j in range(len(self.blocks)):
             i.ptrs[j] = self.blocks[j]
         return bytearray(i)
@@ -42,7 +84,7 @@ class file(object):
             n = rnd.randint(0,50)
             val = val + chars[n]
         return bytearray(val, 'ascii')
-        
+
 class dir(object):
     def __init__(self, fields):
         self.inum = 0
@@ -50,6 +92,9 @@ class dir(object):
         self.inum = int(inum)
         self.size = int(size)
         self.blocks = list(map(int, blocks.split(',')))
+        self.indirect = 0
+        self.runs, self.leaves = None, []
+        self.inline = False
         entries = fields[9:]
         self.entries = []
         for e in fields[9:]:
@@ -63,8 +108,7 @@ class dir(object):
 
     def inode(self):
         i = fs.inode()
-        i.uid, i.gid, i.mode = self.uid, self.gid, self.mode
-        i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
+        fill(i, self)
         for j in range(len(self.blocks)):
             i.ptrs[j] = self.blocks[j]
         return bytearray(i)
@@ -80,8 +124,8 @@ class dir(object):
             data[j:j+32] = bytearray(de)
             j += 32
         return data
-        
-        
+
+
 syms = dict()
 files = []
 dirs = []
@@ -101,7 +145,7 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'size':
         nblocks = int(fields[1])
         continue
-    
+
     for i in range(len(fields)):
         if fields[i][0] == '$':
             fields[i] = syms[fields[i]]
@@ -110,17 +154,19 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'dir':
         dirs.append(dir(fields[1:]))
 
-blockmap = fs.bitmap()
-blockmap.set(0,True)                      # superblock
-blockmap.set(1,True)                      # bitmap
+nmap = fs.bitmap_blocks(nblocks)
+blockmap = fs.bitmap(nmap)
+for b in range(1 + nmap):
+    blockmap.set(b,True)                  # superblock and bitmap
 
-blocks = [None] * 400
+blocks = [None] * nblocks
 
 for f in files + dirs:
-    blocks[f.inum] = [f]
-    blockmap.set(f.inum, True)
+    if not compact:
+        blocks[f.inum] = [f]
+        blockmap.set(f.inum, True)
     i = 0
-    for b in f.blocks:
+    for b in ([] if f.inline else f.blocks):
         if blockmap.get(b):
             print('ERROR: double counted', b)
         blockmap.set(b, True)
@@ -131,11 +177,79 @@ sb = fs.super()
 sb.magic, sb.disk_sz = magic, nblocks
 zeros = bytearray(4096)
 
+if compact:
+    # the first free run that holds the inode table and its bitmap
+    ninodes = fs.itable_size(nblocks)
+    sb.imap_blocks = (ninodes + 32767) // 32768
+    sb.itab_blocks = ninodes // fs.INODES_PER_BLOCK
+    need = sb.imap_blocks + sb.itab_blocks
+    start = 1 + nmap
+    while any(blockmap.get(b) for b in range(start, start + need)):
+        start += 1
+        if start + need > nblocks:
+            print('ERROR: no room for the inode table')
+            sys.exit(1)
+    sb.imap_start, sb.itab_start = start, start + sb.imap_blocks
+    for b in range(start, start + need):
+        blockmap.set(b, True)
+
+    # renumber: the root stays inode 2
+    items = sorted(files + dirs, key=lambda f: f.inum != 2)
+    inums = dict((f.inum, 2 + n) for n, f in enumerate(items))
+    for d in dirs:
+        for e in d.entries:
+            if e[0]:
+                e[2] = inums[e[2]]
+
+    imap = fs.bitmap(sb.imap_blocks)
+    for i in range(2 + len(items)):
+        imap.set(i, True)                 # 0 and 1 are never used
+    table = [fs.cinode() for _ in range(ninodes)]
+    mapblocks = dict()                    # indirect and extent blocks
+    def mapblock():
+        b = next(b for b in range(1 + nmap, nblocks) if not blockmap.get(b))
+        blockmap.set(b, True)
+        return b
+    for f in items:
+        if f.inline:
+            pass
+        elif isinstance(f, file):
+            f.runs = fs.extents(f.blocks)
+            if len(f.runs) > fs.NEXTENT:
+                nleaf = (len(f.runs) + fs.EXTENTS_PER_BLOCK - 1) // fs.EXTENTS_PER_BLOCK
+                for j in range(nleaf):
+                    f.leaves.append(mapblock())
+                    eb = fs.extent_block()
+                    runs = leaf_runs(f, j)
+                    eb.eh.count = len(runs)
+                    for k, r in enumerate(runs):
+                        eb.ext[k].lblk, eb.ext[k].pblk, eb.ext[k].len = r
+                    mapblocks[f.leaves[-1]] = bytearray(eb)
+        elif len(f.blocks) > fs.NDIRECT:
+            f.indirect = mapblock()
+            ptrs = (fs.c_uint * 1024)(*f.blocks[fs.NDIRECT:])
+            mapblocks[f.indirect] = bytearray(ptrs)
+        table[inums[f.inum]] = cinode(f)
+
+# what the file system counts as free (it never allocates block 1+nmap)
+sb.free_blocks = sum(not blockmap.get(b) for b in range(2 + nmap, nblocks))
+if compact:
+    sb.free_inodes = ninodes - 2 - len(items)
+
 fp = open(sys.argv[2], 'wb')
 fp.write(bytearray(sb))
 fp.write(bytearray(blockmap))
-for i in range(2,nblocks):
-    if not blocks[i]:
+for i in range(1 + nmap,nblocks):
+    if compact and sb.imap_start <= i < sb.itab_start:
+        j = (i - sb.imap_start) * 4096
+        fp.write(imap[j:j + 4096])
+    elif compact and sb.itab_start <= i < sb.itab_start + sb.itab_blocks:
+        first = (i - sb.itab_start) * fs.INODES_PER_BLOCK
+        for j in range(first, first + fs.INODES_PER_BLOCK):
+            fp.write(bytearray(table[j]))
+    elif compact and i in mapblocks:
+        fp.write(mapblocks[i])
+    elif not blocks[i]:
         fp.write(zeros)
     elif len(blocks[i]) == 1:
         filedir = blocks[i][0]
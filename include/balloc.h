@@ -0,0 +1,63 @@
+/*
+ * file:        balloc.h
+ * description: block allocator over the free block bitmap, in
+ *              allocation groups with an index of their free extents
+ */
+
+#ifndef __BALLOC_H__
+#define __BALLOC_H__
+
+#include "fs.h"
+
+/* blocks per allocation group: those one bitmap block records */
+#define BALLOC_GROUP (FS_BLOCK_SIZE * 8)
+
+/* a run of contiguous blocks */
+struct brun {
+    int lba;
+    int len;
+};
+
+/* allocate from bitmap 'map' (a set bit is a block in use) for a
+ * device of 'nblocks' blocks; blocks below 'first' are never handed
+ * out. Called at mount time, and builds the free extent index from
+ * 'map'. Returns 0 or -ENOMEM
+ */
+int balloc_init(unsigned char *map, int nblocks, int first);
+
+/* how many allocation groups there are, and the one block 'lba' is in */
+int balloc_groups(void);
+int balloc_group(int lba);
+
+/* a free block, now marked in use: in 'group' if it has one, else in
+ * the next group round that does. Returns it or -ENOSPC (-ENOMEM if
+ * the index can't grow, for this and the calls below)
+ */
+int balloc(int group);
+
+/* 'n' contiguous free blocks, now marked in use - the first such run
+ * on the device, which may go across groups. Returns the first, or
+ * -ENOSPC if there is no free run that long
+ */
+int balloc_run(int n);
+
+/* 'n' free blocks in as few runs as it takes - one if there is a free
+ * run that long - now marked in use. The runs go in 'runs' (room for
+ * 'n'). 'goal' is the block a file's new blocks would best start at
+ * (the one after its last), or -1; they start there if that many are
+ * free there, else in a run with room to grow, in goal's group or the
+ * next one round with room. With no goal they go in 'group' (or the
+ * next one round). Returns how many runs, or -ENOSPC (and allocates
+ * nothing) if fewer than 'n' blocks are free
+ */
+int balloc_bulk(int n, int goal, int group, struct brun *runs);
+
+/* blocks 'lba'..'lba'+'n'-1 are free again (any already free in the
+ * range are left alone)
+ */
+void balloc_free(int lba, int n);
+
+/* how many blocks are free: the groups' counts added up */
+int balloc_count(void);
+
+#endif
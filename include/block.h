@@ -0,0 +1,181 @@
+/*
+ * file:        block.h
+ * description: block device interface used by the file system.
+ *              All access is in terms of FS_BLOCK_SIZE blocks.
+ */
+
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+#include <stddef.h>
+
+/* one run of consecutive blocks for the vectored calls below. Runs
+ * may be passed in any order; runs whose LBAs happen to be adjacent
+ * are merged into a single positional transfer.
+ */
+struct block_iov {
+    int   lba;                  /* first block of the run */
+    void *buf;                  /* nblks * FS_BLOCK_SIZE bytes */
+    int   nblks;
+};
+
+/* read/write a list of runs. Returns -EIO if error, 0 otherwise
+ */
+int block_preadv(const struct block_iov *iov, int iovcnt);
+int block_pwritev(const struct block_iov *iov, int iovcnt);
+
+/* block_preadv that also reads the blocks listed in 'ahead' into the
+ * block cache, in the same device request. Readahead is best effort
+ * and needs the cache.
+ */
+int block_preadv_ahead(const struct block_iov *iov, int iovcnt,
+                       const int *ahead, int nahead);
+
+/* single-run wrappers around block_preadv / block_pwritev
+ */
+int block_read(void *buf, int lba, int nblks);
+int block_write(void *buf, int lba, int nblks);
+
+/* update the superblock (block 0), which block_write refuses to
+ * touch. Returns -EIO if error, 0 otherwise
+ */
+int block_write_super(void *buf);
+
+/* open an image file as the block device */
+void block_init(char *file);
+
+/* hold the image in memory instead (-ram): load 'file', or create an
+ * empty 'nblks' block device if it doesn't exist. With 'checkpoint',
+ * block_flush(1) writes changed blocks back to 'file'. Returns 1 if
+ * the device was created and needs formatting, 0 otherwise
+ */
+int block_init_ram(char *file, int nblks, int checkpoint);
+
+/* device size in blocks */
+long block_size(void);
+
+/* contents of these blocks are no longer needed; afterwards they
+ * read as zeroes. Returns 0, -EOPNOTSUPP if the device can't discard,
+ * or -EIO
+ */
+int block_discard(int lba, int nblks);
+
+/* the file system freed these blocks (any order; sorted in place).
+ * Drops cached copies and, with online discard on, discards them in
+ * merged ranges. Returns 0 or -EIO
+ */
+int block_release(int *lbas, int n);
+void block_set_discard(int on);
+
+/* submit through io_uring from now on; falls back to preadv/pwritev
+ * (and returns -errno) if the kernel doesn't support it
+ */
+int block_uring_init(int depth);
+
+/* map the whole image (-mmap). Returns 0, or -errno and keeps using
+ * read/write
+ */
+int block_mmap_init(void);
+
+/* images opened from now on (block_init) use read/write again, not
+ * io_uring or mmap
+ */
+void block_io_reset(void);
+
+/* pointer to block 'lba' if the device is memory (mapped image or
+ * RAM disk), NULL otherwise. Only for reading - writes must go
+ * through block_pwritev so backends can track them.
+ */
+void *block_map(int lba);
+
+/* block_map, to read block 'lba' in place instead of with
+ * block_preadv: also NULL when checksums are on, as a block read
+ * through the mapping isn't verified
+ */
+const void *block_map_read(int lba);
+
+/* size the block cache in bytes (0 = no caching). Returns 0 or -1
+ */
+int block_cache_init(size_t bytes);
+
+/* durability modes (-durability): write every block through to the
+ * image, or keep dirty blocks in the cache and write them back from a
+ * background thread every 'interval' seconds (periodic) or only under
+ * memory pressure and on flush/fsync (lazy)
+ */
+#define BLOCK_SYNC     0
+#define BLOCK_PERIODIC 1
+#define BLOCK_LAZY     2
+
+int block_durability(int mode, int interval);
+
+/* write back dirty blocks; 'sync' also fsyncs the image. Returns -EIO
+ * if error, 0 otherwise
+ */
+int block_flush(int sync);
+
+/* 'fn' is called by every flush (and the background flusher) before
+ * the cache is cleaned, so a layer above that keeps dirty metadata in
+ * memory can write it out first. It returns 0 or -EIO.
+ */
+void block_set_flush_hook(int (*fn)(void));
+
+/* nonzero if block writes are currently deferred (write-back mode)
+ */
+int block_writeback(void);
+
+/* stop background writeback and flush everything (unmount)
+ */
+void block_exit(void);
+
+/* metadata journal (-journal) in the region [start, start + nblocks):
+ * replays what a crash left in it, or sets up an empty one if 'fresh'.
+ * Not used on memory devices or in write-back mode. Returns the
+ * number of records replayed, or -EIO
+ */
+int block_journal_init(int start, int nblocks, int fresh);
+
+/* an operation's metadata writes go between block_op_begin and
+ * block_op_end through block_commit. With the journal on they reach
+ * the image as one atomic transaction (shared with whatever other
+ * operations were running) and block_op_end returns once it is in the
+ * log, 0 or -EIO; otherwise block_commit is block_pwritev
+ */
+int block_commit(const struct block_iov *iov, int iovcnt);
+void block_op_begin(void);
+int block_op_end(void);
+
+/* per-block CRC32C checksums kept in the region [start, start +
+ * nblocks): verified on every device read, updated on every write.
+ * 'fresh' checksums the whole device and writes the region out.
+ * Returns 0 or -EIO
+ */
+int block_csum_init(int start, int nblocks, int fresh);
+
+/* read the device in the background at up to 'rate' bytes/second and
+ * check every block (0 stops it). Starts when checksums are set up.
+ * Returns 0 or -1
+ */
+int block_scrub(long rate);
+
+/* I/O counters, for benchmarks
+ */
+struct block_stats {
+    unsigned long reads;        /* blocks read from the image */
+    unsigned long writes;       /* blocks written to the image */
+    unsigned long syscalls;     /* preadv/pwritev/io_uring_enter calls */
+    unsigned long cache_hits;   /* blocks served from the cache */
+    unsigned long cache_misses;
+    unsigned long cache_evictions;
+    unsigned long cache_writebacks; /* dirty blocks written back */
+    unsigned long readahead;    /* blocks brought in by readahead */
+    unsigned long readahead_hits; /* ... that were later read */
+    unsigned long csum_errors;  /* blocks that failed verification */
+    unsigned long scrubbed;     /* blocks checked by the scrubber */
+    unsigned long discards;     /* blocks discarded */
+};
+
+void block_get_stats(struct block_stats *st);
+void block_reset_stats(void);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * file:        blockdev.h
+ * description: block device backends under the block layer (misc.c).
+ *              A backend moves whole blocks between memory and
+ *              wherever the image lives; caching, write-back and
+ *              statistics stay in the block layer.
+ */
+
+#ifndef __BLOCKDEV_H__
+#define __BLOCKDEV_H__
+
+#include <stddef.h>
+
+struct block_iov;
+struct blockdev;
+
+struct blockdev_ops {
+    const char *name;
+
+    /* transfer a list of runs. Return -EIO if error, 0 otherwise */
+    int   (*read)(struct blockdev *dev, const struct block_iov *iov, int iovcnt);
+    int   (*write)(struct blockdev *dev, const struct block_iov *iov, int iovcnt);
+
+    /* make everything written so far durable */
+    int   (*flush)(struct blockdev *dev);
+
+    /* the contents of these blocks are no longer needed; they read
+     * back as zeroes afterwards. -EOPNOTSUPP if the backend can't.
+     */
+    int   (*discard)(struct blockdev *dev, int lba, int nblks);
+
+    /* device size in blocks */
+    long  (*size)(struct blockdev *dev);
+
+    /* pointer to block 'lba' if the device is directly addressable
+     * memory, NULL otherwise (may be left NULL)
+     */
+    void *(*map)(struct blockdev *dev, int lba);
+
+    void  (*close)(struct blockdev *dev);
+};
+
+/* every backend's private struct starts with this
+ */
+struct blockdev {
+    const struct blockdev_ops *ops;
+    unsigned long syscalls;     /* I/O system calls made so far */
+};
+
+/* POSIX file backend: preadv/pwritev, optionally through io_uring or
+ * an mmap of the whole image. Returns NULL (with errno set) on error.
+ */
+struct blockdev *filedev_open(const char *file);
+int filedev_uring(struct blockdev *dev, int depth);
+int filedev_mmap(struct blockdev *dev);
+
+/* RAM backend: the image lives in memory. 'file' is loaded if it
+ * exists; otherwise (or if file is NULL) a zeroed device of 'nblks'
+ * blocks is created and *created is set. With 'checkpoint', flush
+ * writes blocks changed since the last flush back to 'file'.
+ */
+struct blockdev *ramdev_open(const char *file, int nblks, int checkpoint,
+                             int *created);
+
+#endif
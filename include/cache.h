@@ -0,0 +1,80 @@
+/*
+ * file:        cache.h
+ * description: block buffer cache used by the block layer (misc.c)
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+
+struct block_iov;
+
+/* (re)size the cache to 'bytes' worth of blocks, dropping everything
+ * currently cached. 0 disables caching.
+ */
+int cache_init(size_t bytes);
+
+/* non-zero if the cache holds at least one buffer */
+int cache_enabled(void);
+
+/* copy block 'lba' into 'buf' if cached. Returns 1 on a hit, 0 on a
+ * miss.
+ */
+int cache_read(int lba, void *buf);
+
+/* sequence number to pass to cache_fill() for data that is about to
+ * be read from the device
+ */
+unsigned long cache_seq(void);
+
+/* insert a block just read from the device. Skipped if the block is
+ * already cached or was written since 'seq' was taken, so a slow
+ * reader can never install stale data over a newer write. 'ahead'
+ * marks a block nobody asked for yet (readahead); the first
+ * cache_read of it counts as a readahead hit.
+ */
+void cache_fill(int lba, const void *buf, unsigned long seq, int ahead);
+
+/* non-zero if block 'lba' is cached (not counted as a hit or miss) */
+int cache_contains(int lba);
+
+/* a block was written: insert it or update the cached copy */
+void cache_update(int lba, const void *buf);
+
+/* write-back: insert or update the cached copy and mark it dirty.
+ * Nothing reaches the device until cache_flush() or eviction.
+ */
+void cache_write(int lba, const void *buf);
+
+/* device write function used to clean dirty buffers */
+void cache_set_writeback(int (*fn)(const struct block_iov *iov, int iovcnt));
+
+/* write every dirty buffer back in LBA order, adjacent blocks in one
+ * vectored call. Returns 0 or -EIO.
+ */
+int cache_flush(void);
+
+/* number of dirty buffers */
+int cache_dirty(void);
+
+/* forget block 'lba' (it was freed), dirty or not */
+void cache_discard(int lba);
+
+/* drop every cached block (e.g. a different image was opened) */
+void cache_invalidate(void);
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;   /* dirty blocks written to the device */
+    unsigned long ra_fills;     /* blocks brought in by readahead */
+    unsigned long ra_hits;      /* ... and later read */
+    int           nbufs;        /* capacity in blocks */
+};
+
+void cache_get_stats(struct cache_stats *st);
+void cache_reset_stats(void);
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * file:        crc32c.h
+ * description: CRC32C (Castagnoli) for block checksums
+ */
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* continue 'crc' (0 to start) over 'len' bytes of 'buf'. Uses the
+ * SSE4.2 or ARMv8 CRC instructions when the CPU has them.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* name of the implementation in use, for diagnostics */
+const char *crc32c_impl(void);
+
+#endif
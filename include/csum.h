@@ -0,0 +1,43 @@
+/*
+ * file:        csum.h
+ * description: per-block checksum table used by the block layer
+ *              (misc.c). One CRC32C per device block, stored on disk
+ *              in a region recorded in the superblock.
+ */
+
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+#include <stdint.h>
+
+/* checksums per region block */
+#define CSUM_PER_BLOCK (FS_BLOCK_SIZE / sizeof(uint32_t))
+
+/* start checksumming with the region at [start, start + nblocks).
+ * The table starts out zeroed; load it with csum_load_block() or
+ * fill it with csum_update(). Returns 0 or -1 (no memory)
+ */
+int csum_init(int start, int nblocks);
+void csum_exit(void);
+int csum_active(void);
+
+/* region geometry */
+int csum_start(void);
+int csum_nblocks(void);
+
+/* 1 if 'lba' is one of the region's own blocks (not checksummed) */
+int csum_in_region(int lba);
+
+/* 0 if the block matches its checksum (or isn't covered), -1 if not */
+int csum_verify(int lba, const void *buf);
+
+/* record the checksum of a block about to be written. Returns the
+ * index of the region block holding it, or -1 if not covered
+ */
+int csum_update(int lba, const void *buf);
+
+/* copy region block 'idx' out of / into the in-memory table */
+void csum_save_block(int idx, void *buf);
+void csum_load_block(int idx, const void *buf);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * file:        dcache.h
+ * description: directory entry cache for path translation
+ */
+
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+struct dcache_stats {
+    unsigned long path_hits;    /* whole path found at once */
+    unsigned long hits;         /* (directory, name) found cached */
+    unsigned long neg_hits;     /* name cached as absent */
+    unsigned long misses;       /* directory had to be scanned */
+};
+
+/* the inode named 'name' in directory 'dir', -ENOENT if the name is
+ * known not to exist, or 0 if not cached
+ */
+int dcache_lookup(int dir, const char *name);
+
+/* record 'name' in 'dir' as inode 'inum', or as absent if 'inum' is 0 */
+void dcache_add(int dir, const char *name, int inum);
+
+/* the inode a whole path resolved to, or 0 if not cached. 'inums'
+ * holds the inode of each component, so the path can be dropped when
+ * any of them goes away. 'gen' is dcache_generation() from before the
+ * path was resolved: if anything was removed since, the path may be
+ * stale and isn't cached
+ */
+int dcache_path(int pathc, char **pathv);
+void dcache_add_path(int pathc, char **pathv, const int *inums,
+                     unsigned long gen);
+
+/* counts dcache_remove calls */
+unsigned long dcache_generation(void);
+
+/* 'name' (inode 'inum') was removed from 'dir' or renamed: the name is
+ * now absent, and every cached path that goes through 'inum' is dropped
+ */
+void dcache_remove(int dir, const char *name, int inum);
+
+void dcache_reset(void);
+void dcache_get_stats(struct dcache_stats *st);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * file:        dirscan.h
+ * description: directory block search, vectorized where the CPU
+ *              allows it
+ */
+
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+#include <stdint.h>
+#include "fs.h"
+
+/* index of the valid entry named 'name' among the 'n' entries at 'd',
+ * or -1. Names longer than 27 bytes never match.
+ */
+int dirent_find(const struct fs_dirent *d, int n, const char *name);
+
+/* name of the implementation in use ("avx2", "sse2", "neon" or
+ * "scalar"), and a way to force one for tests and benchmarks. Returns
+ * 0, or -1 if 'impl' isn't available on this machine.
+ */
+const char *dirent_impl(void);
+int dirent_set_impl(const char *impl);
+
+#endif
@@ -14,7 +14,12 @@
  */
 #define DIV_ROUND_UP(N, M) ((N) + (M) - 1) / (M)
 
-/* Entry in a directory
+/* Entry in a directory. A directory's blocks hold 128 entries each.
+ * In the original format an entry may be in any of them; a directory
+ * with FS_DIR_HASHED set (or just one block) keeps each name in block
+ * 'b' of its n blocks, where for h = FNV-1a(name) and m the largest
+ * power of two <= n, b = h mod 2m, or h mod m if that is >= n (linear
+ * hashing).
  */
 struct fs_dirent {
     uint32_t valid : 1;
@@ -22,24 +27,125 @@ struct fs_dirent {
     char name[28];              /* with trailing NUL */
 };
 
-/* Superblock - holds file system parameters. 
+/* Superblock - holds file system parameters. It is block 0; the block
+ * bitmap (a bit per block, set if in use) follows it in blocks 1 to
+ * FS_BITMAP_BLOCKS(disk_size). The free counts are as of the last
+ * unmount (or mkfs): the bitmaps are recounted at mount time and the
+ * counts kept in memory from then on, so they are only for tools
+ * looking at an image that isn't mounted.
  */
+#define FS_BITMAP_BLOCKS(n) DIV_ROUND_UP(n, FS_BLOCK_SIZE * 8)
+
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
+    uint32_t csum_start;        /* block checksum region, 0 if none */
+    uint32_t csum_blocks;
+    uint32_t itab_start;        /* inode table, 0 = one inode per block */
+    uint32_t itab_blocks;
+    uint32_t imap_start;        /* inode table allocation bitmap */
+    uint32_t imap_blocks;
+    uint32_t free_blocks;
+    uint32_t free_inodes;       /* in the inode table */
+    uint32_t journal_start;     /* metadata journal region, 0 if none */
+    uint32_t journal_blocks;
     
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 12 * sizeof(uint32_t)]; 
 };
 
 struct fs_inode {
     uint16_t uid;
     uint16_t gid;
-    uint32_t mode;
+    uint32_t mode;              /* and flags, see FS_FLAGS_SHIFT */
     uint32_t ctime;
     uint32_t mtime;
     int32_t  size;
     uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
 };
 
+/* The original inode has no room for a flags field - every pointer
+ * may be in use - so its flags are kept in the top half of 'mode',
+ * which mode bits never reach. An image from before there were flags
+ * reads as having none.
+ */
+#define FS_FLAGS_SHIFT 16
+
+#define FS_DIR_HASHED 1         /* inode flags */
+#define FS_EXTENTS    2
+#define FS_INDIRECT   4
+#define FS_INLINE     8
+
+/* A file with FS_INLINE set has no blocks: its 'size' bytes of data
+ * are kept in the inode, where the block map would be - the 'ptrs' of
+ * an original-format inode, the map area of a compact one - with the
+ * rest of that space zero. The other map flags say how blocks are
+ * mapped once the file outgrows it.
+ */
+#define FS_INLINE_ORIG    ((FS_BLOCK_SIZE / 4 - 5) * 4)
+#define FS_INLINE_COMPACT ((FS_NDIRECT + 2) * 4)
+
+/* An original-format inode with FS_INDIRECT set (a file that has
+ * outgrown its block pointers) keeps its last two pointers for an
+ * indirect and a double-indirect block, as in the compact format
+ * below, and maps its first FS_NDIRECT_ORIG blocks directly.
+ */
+#define FS_NDIRECT_ORIG (FS_BLOCK_SIZE / 4 - 7)
+
+/* Compact format (itab_start != 0): inodes are 128-byte slots in an
+ * inode table, 32 per block, and inode N is slot N of the table. The
+ * next FS_PTRS_PER_BLOCK block pointers after the first FS_NDIRECT are
+ * in the block 'indirect' points to, and the rest in the blocks listed
+ * in 'dindirect'. Slots 0 and 1 are never used, and the root directory
+ * is inode 2 in both formats.
+ */
+#define FS_NDIRECT 24
+#define FS_PTRS_PER_BLOCK (FS_BLOCK_SIZE / 4)
+#define FS_INODES_PER_BLOCK (FS_BLOCK_SIZE / sizeof(struct fs_cinode))
+
+/* A compact inode with FS_EXTENTS set maps its blocks as extents
+ * instead: 'len' blocks from logical block 'lblk' on are at disk
+ * blocks 'pblk'.., and the list is in order. Up to FS_NEXTENT of them
+ * are in the inode (depth 0); a longer list is kept in extent blocks
+ * - a header and FS_EXTENTS_PER_BLOCK extents each - and the inode
+ * holds one entry per block (depth 1), with the first logical block
+ * it maps in 'lblk', the block in 'pblk' and its extent count in 'len'.
+ */
+#define FS_NEXTENT 8
+#define FS_EXTENTS_PER_BLOCK \
+    ((FS_BLOCK_SIZE - sizeof(struct fs_extent_hdr)) / sizeof(struct fs_extent))
+
+struct fs_extent {
+    uint32_t lblk;
+    uint32_t pblk;
+    uint32_t len;
+};
+
+struct fs_extent_hdr {
+    uint16_t count;
+    uint16_t depth;
+};
+
+struct fs_cinode {
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t mode;
+    uint32_t ctime;
+    uint32_t mtime;
+    int32_t  size;
+    uint32_t flags;
+    union {
+        struct {
+            uint32_t ptrs[FS_NDIRECT];
+            uint32_t indirect;
+            uint32_t dindirect;
+        };
+        struct {                /* FS_EXTENTS */
+            struct fs_extent_hdr eh;
+            struct fs_extent ext[FS_NEXTENT];
+        };
+        char data[FS_INLINE_COMPACT];   /* FS_INLINE */
+    };                          /* inode = 128 bytes */
+};
+
 #endif
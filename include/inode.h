@@ -0,0 +1,151 @@
+/*
+ * file:        inode.h
+ * description: in-memory inode cache. Inodes are read from disk the
+ *              first time they are used and stay resident; changes
+ *              are made to the cached copy and written back lazily.
+ */
+
+#ifndef __INODE_H__
+#define __INODE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "fs.h"
+
+/* the number of block pointers an inode holds in the original format
+ * (see FS_INDIRECT for the ones past that)
+ */
+#define INODE_NPTRS 1019
+
+struct fs_super;
+struct block_iov;
+struct txn;
+
+struct inode {
+    int       inum;
+    uint16_t  uid;
+    uint16_t  gid;
+    uint32_t  mode;
+    uint32_t  ctime;
+    uint32_t  mtime;
+    int32_t   size;
+    uint32_t  flags;            /* FS_DIR_HASHED, FS_EXTENTS, FS_INDIRECT,
+                                   FS_INLINE */
+    int       nblocks;          /* blocks in the map (see bmap) */
+    uint32_t *ptrs;             /* direct block pointers */
+    int       nptrs;            /* entries allocated in 'ptrs' */
+    uint32_t  indirect;         /* the pointers after those */
+    uint32_t  dindirect;        /* and the indirect blocks after that */
+    struct fs_extent *ext;      /* FS_EXTENTS: the map, in order */
+    int       next;
+    int       ext_cap;
+    uint32_t  leaf[FS_NEXTENT]; /* extent blocks, if more than FS_NEXTENT */
+    int       nleaf;
+    char     *data;             /* FS_INLINE: the contents, inline_max() bytes */
+    int       dirty;
+    int       ref;              /* see iget */
+    int       gone;             /* freed (read with it locked) */
+    pthread_rwlock_t rwlock;    /* see ilock */
+    struct inode *hnext;
+};
+
+/* the cached inode 'inum', read from disk on first use, with a
+ * reference to it that iput drops. Returns NULL on I/O error. It may
+ * have been freed by the time the caller locks it: then 'gone' is set
+ */
+struct inode *iget(int inum);
+void iput(struct inode *ip);
+
+/* cache a freshly allocated inode without reading it, with a reference
+ * as iget. The caller writes it out (see iupdate). Returns NULL if out
+ * of memory
+ */
+struct inode *inew(int inum, uint32_t mode);
+
+/* lock 'ip' exclusively (to change it) or shared (to read it). An
+ * operation that locks more than one takes a directory before the
+ * inodes in it
+ */
+void ilock(struct inode *ip);
+void ilock_shared(struct inode *ip);
+void iunlock(struct inode *ip);
+
+/* Block map, either form. The disk block holding block 'lblk' of 'ip',
+ * or 0 past the end of the map. If 'run' isn't NULL it holds the
+ * number of blocks wanted from there on (at least 1), and is cut down
+ * to the number of those that are contiguous on disk
+ */
+uint32_t bmap(const struct inode *ip, int lblk, int *run);
+
+/* add the 'n' disk blocks from 'pblk' on to the end of 'ip's map,
+ * with any blocks the map needs for them outside the inode (indirect
+ * or extent blocks) from 'alloc', which is passed 'arg' and returns a
+ * free block for 'ip', -ENOSPC or -ENOMEM.
+ * Returns 0, -EFBIG if the map can't hold them, -ENOSPC, -ENOMEM or
+ * -EIO; on error the map may hold some of them (see bmap_truncate)
+ */
+int bmap_append(struct inode *ip, uint32_t pblk, int n,
+                int (*alloc)(const struct inode *ip, void *arg), void *arg);
+
+/* cut 'ip's map down to its first 'n' blocks. Every block that leaves
+ * it, and any map block no longer needed, is passed to 'free_block'
+ */
+void bmap_truncate(struct inode *ip, int n,
+                   void (*free_block)(uint32_t lba, void *arg), void *arg);
+
+/* Inline data (FS_INLINE): how many bytes of a file can be kept in
+ * its inode on this image
+ */
+int inline_max(void);
+
+/* keep the data of 'ip', which has no blocks, in the inode from now
+ * on. Returns 0 or -ENOMEM
+ */
+int inline_begin(struct inode *ip);
+
+/* 'ip's data has been moved out to blocks */
+void inline_end(struct inode *ip);
+
+/* the cached copy of 'ip' has changed: write it through, or leave it
+ * for the next flush when the block layer is in write-back mode.
+ * Returns 0 or -EIO
+ */
+int iupdate(struct inode *ip);
+
+/* iupdate for the 'n' inodes 'ips', in one block_commit with the
+ * blocks in 'iov' (which must not be ones of the inodes). Returns 0
+ * or -EIO
+ */
+int icommit(struct inode **ips, int n, const struct block_iov *iov, int iovcnt);
+
+/* write back every dirty inode. Returns 0 or -EIO */
+int isync(void);
+
+/* drop a freed inode (see iget) */
+void iforget(int inum);
+
+/* compact format: allocate a slot in the inode table, or free one
+ * (and drop it from the cache), as part of operation 'tx' (see
+ * txn_bits). ialloc returns the inode number, -ENOSPC or -ENOMEM. The
+ * table is taken as 'nparts' equal parts - inode n is in part
+ * n * nparts / (table size) - and the slot is in part 'part' if that
+ * has a free one, else in the next part round that does
+ */
+int ialloc(struct txn *tx, int part, int nparts);
+void ifree(struct txn *tx, int inum);
+
+/* inodes in the inode table (0 in the original format), and how many
+ * are free - a count kept as inodes are allocated and freed, taken
+ * from the bitmap at mount time
+ */
+int itable_size(int *nfree);
+
+/* empty the cache for the image described by 'sb', reading the inode
+ * table bitmap if it has one. Returns 0 or -EIO
+ */
+int icache_init(const struct fs_super *sb);
+
+/* number of cached inodes */
+int icache_count(void);
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * file:        journal.h
+ * description: metadata journal used by the block layer (misc.c). A
+ *              region recorded in the superblock: a head block saying
+ *              where the live records start, then records written one
+ *              after another round the rest of the region, each a
+ *              descriptor block listing the home LBAs of the blocks
+ *              that follow it.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+
+struct block_iov;
+
+#define JOURNAL_MAGIC 0x4c4e524a    /* "JRNL" */
+
+/* blocks one record can carry */
+#define JOURNAL_MAX ((FS_BLOCK_SIZE - 4 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+/* block 0 of the region. Records before 'start' have all reached their
+ * home blocks; the one at 'start' (if valid) has sequence number 'seq'
+ */
+struct journal_head {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t start;             /* 1.. (block 0 is this one) */
+    char pad[FS_BLOCK_SIZE - 3 * sizeof(uint32_t)];
+};
+
+/* first block of a record; its 'n' blocks follow, in the order of
+ * 'lba'. A record that doesn't fit before the end of the region goes
+ * at block 1 instead. It is valid if its sequence number is the one
+ * expected and 'crc' matches
+ */
+struct journal_desc {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t n;
+    uint32_t crc;               /* CRC32C of this block (crc = 0), then the n */
+    uint32_t lba[JOURNAL_MAX];
+};
+
+/* device access for the journal: 'read' and 'write' go straight to
+ * the device ('write' keeping cached copies up to date), 'sync' makes
+ * what was written durable. Each returns 0 or -EIO
+ */
+void journal_set_io(int (*read)(const struct block_iov *iov, int iovcnt),
+                    int (*write)(const struct block_iov *iov, int iovcnt),
+                    int (*sync)(void));
+
+/* the journal is the region [start, start + nblocks). Writes the
+ * records still in it to their home blocks and empties it, or with
+ * 'fresh' (a new region) just sets it up empty. Returns how many
+ * records were replayed, or -EIO
+ */
+int journal_replay(int start, int nblocks, int fresh);
+
+/* start journaling in the region journal_replay() set up: a
+ * background thread checkpoints as the log fills. Returns 0 or -ENOMEM
+ */
+int journal_open(void);
+
+/* commit what is left, checkpoint and stop (unmount, new device) */
+void journal_close(void);
+int journal_active(void);
+
+/* an operation: blocks added between begin and end belong to the
+ * running transaction, which every operation open at the time shares.
+ * end returns once the transaction is in the log - written by the
+ * last of them to end, as one record - 0, or -EIO if it couldn't be
+ */
+void journal_begin(void);
+int journal_end(void);
+int journal_add(const struct block_iov *iov, int iovcnt);
+
+/* blocks about to be written around the journal (blocks freed since
+ * it last had them, now holding data): they leave the running
+ * transaction, and anything logged for them is checkpointed first, so
+ * the journal never puts old contents back over the new ones.
+ * Returns 0 or -EIO
+ */
+int journal_forget(const struct block_iov *iov, int iovcnt);
+
+/* reads see the newest contents of blocks the journal holds: a read
+ * goes between read_lock and read_unlock, with journal_overlay copying
+ * them over what came from the device, so a checkpoint can't drop a
+ * block in between
+ */
+void journal_read_lock(void);
+void journal_read_unlock(void);
+void journal_overlay(const struct block_iov *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,23 @@
+/*
+ * file:        readahead.h
+ * description: per-inode sequential read detection for fs_read
+ */
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+/* smallest and largest readahead window, in blocks */
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 64
+
+/* note a read of file blocks [first, first + nblks) of inode 'inum'
+ * (a file of 'file_blks' blocks). Returns the number of file blocks to
+ * read ahead, starting at *start; 0 if none.
+ */
+int ra_update(int inum, int first, int nblks, int file_blks, int *start);
+
+/* drop the state for one inode (freed or truncated), or for all */
+void ra_forget(int inum);
+void ra_reset(void);
+
+#endif
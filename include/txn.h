@@ -0,0 +1,123 @@
+/*
+ * file:        txn.h
+ * description: per-operation metadata transactions. A write operation
+ *              collects the metadata blocks it changes in a 'struct
+ *              txn' instead of writing each one as it goes: a block
+ *              changed several times (the bitmap while a file grows,
+ *              an inode, a directory block) is written once, when the
+ *              operation ends, with the rest of its blocks in one
+ *              write, so that blocks adjacent on disk go out as one
+ *              transfer.
+ *
+ *              Only the journal makes that write atomic: without it a
+ *              crash part way through can leave any of its blocks
+ *              unwritten.
+ */
+
+#ifndef __TXN_H__
+#define __TXN_H__
+
+struct inode;
+struct block_iov;
+
+struct txn_block {
+    int   lba;
+    char *data;                 /* a copy */
+};
+
+/* a bitmap on disk that is allocated from (see txn_bits) */
+struct txn_map {
+    int lba, nblks;             /* where it is */
+    unsigned char *bits;        /* as committed, a copy of its own */
+    void (*release)(int i, int n);  /* bits to hand out again */
+    struct txn_map *next;
+};
+
+/* a change to one */
+struct txn_bits {
+    struct txn_map *map;
+    int i, n;
+    int set;
+};
+
+struct txn {
+    struct txn_block *blk;
+    int nblk, blk_cap;
+    struct inode **inodes;      /* see txn_inode */
+    int ninodes, inodes_cap;
+    int *freed;                 /* given to block_release by txn_end */
+    int nfreed, freed_cap;
+    struct txn_bits *bits;      /* see txn_bits */
+    int nbits, bits_cap;
+    struct inode **locked;      /* see txn_lock */
+    int nlocked, locked_cap;
+    int committed;              /* txn_commit wrote everything */
+};
+
+void txn_begin(struct txn *tx);
+
+/* 'map' holds the bitmap 'bits' at blocks 'lba'..'lba'+'nblks'-1,
+ * read at mount time ('nblks' 0: there is none on this image);
+ * 'release' is called for bits a transaction cleared, by txn_end.
+ * Returns 0 or -ENOMEM
+ */
+int txn_map_init(struct txn_map *map, int lba, int nblks,
+                 const unsigned char *bits, void (*release)(int i, int n));
+
+/* copy the blocks in 'iov' into the transaction, replacing earlier
+ * copies of them. Returns 0, -ENOMEM, or -EINVAL for a block of a
+ * bitmap (those only change through txn_bits)
+ */
+int txn_add(struct txn *tx, const struct block_iov *iov, int iovcnt);
+
+/* the operation has allocated ('set') or freed bits 'i'..'i'+'n'-1 of
+ * 'map' in its allocator. Freed ones aren't handed out again until
+ * txn_end (see txn_map_init). At commit its
+ * changes, and only its own, are made to the committed copy of the
+ * bitmap and the blocks of that they are in written, one transaction
+ * at a time, so a newer copy of a block never goes out before an
+ * older one. Returns 0 or -ENOMEM
+ */
+int txn_bits(struct txn *tx, struct txn_map *map, int i, int n, int set);
+
+/* block_preadv, seeing the transaction's own changes. Returns 0 or
+ * -EIO
+ */
+int txn_preadv(struct txn *tx, const struct block_iov *iov, int iovcnt);
+int txn_read(struct txn *tx, void *buf, int lba);
+
+/* 'ip' has changed: it is written once (see icommit), at commit,
+ * with its map blocks. Returns 0 or -ENOMEM
+ */
+int txn_inode(struct txn *tx, struct inode *ip);
+
+/* lock 'ip' (from iget or inew) exclusively for the rest of the
+ * operation: it is unlocked, and the reference given up, once the
+ * transaction has committed. An inode the transaction holds already
+ * just loses the extra reference. Returns 0, -ENOENT if it was freed
+ * before the lock was got (it is held all the same), or -ENOMEM (it
+ * isn't, and the reference is dropped)
+ */
+int txn_lock(struct txn *tx, struct inode *ip);
+
+/* blocks freed by the operation, released (see block_release) by
+ * txn_end. Returns 0 or -ENOMEM
+ */
+int txn_release(struct txn *tx, const int *lbas, int n);
+
+/* write everything, in one block_commit, and unlock the inodes.
+ * Returns 0 or -EIO
+ */
+int txn_commit(struct txn *tx);
+
+/* free the transaction, after txn_commit. If 'durable' the bits and
+ * blocks it freed are handed back to be allocated again: with the
+ * journal that must wait until the record saying they are free is on
+ * disk (journal_end), or another operation could write a block over
+ * while a crash would still bring back what pointed at it. Not
+ * 'durable' (the journal failed), they stay allocated until the next
+ * mount
+ */
+void txn_end(struct txn *tx, int durable);
+
+#endif
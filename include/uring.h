@@ -0,0 +1,41 @@
+/*
+ * file:        uring.h
+ * description: io_uring submission path for the block layer
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* one positional transfer: 'cnt' buffers that are contiguous on disk
+ * starting at byte 'off'. 'res' is filled in with the number of bytes
+ * transferred, or -errno.
+ */
+struct uring_seg {
+    struct iovec *iov;
+    int           cnt;
+    off_t         off;
+    ssize_t       res;
+};
+
+/* set up a ring of 'depth' entries for I/O on 'fd'. Returns 0, or
+ * -errno if io_uring is not available (the caller keeps using
+ * preadv/pwritev in that case)
+ */
+int uring_init(int fd, unsigned depth);
+
+/* tear down the ring, if any */
+void uring_exit(void);
+
+/* non-zero if uring_init() succeeded */
+int uring_active(void);
+
+/* queue all segments and submit them together, waiting for every
+ * completion. Returns the number of io_uring_enter calls made, or
+ * -EIO if the ring itself failed.
+ */
+int uring_submit(int write, struct uring_seg *seg, int nseg);
+
+#endif
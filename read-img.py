@@ -16,9 +16,22 @@ print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
 print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
+if sb.csum_start:
+    print ('            checksums: blocks %d-%d' %
+               (sb.csum_start, sb.csum_start + sb.csum_blocks - 1))
+if sb.journal_start:
+    print ('            journal: blocks %d-%d' %
+               (sb.journal_start, sb.journal_start + sb.journal_blocks - 1))
+if sb.itab_start:
+    print ('            inode table: blocks %d-%d, bitmap %d-%d' %
+               (sb.itab_start, sb.itab_start + sb.itab_blocks - 1,
+                sb.imap_start, sb.imap_start + sb.imap_blocks - 1))
+print ('            free: %d blocks, %d inodes (at last unmount)' %
+           (sb.free_blocks, sb.free_inodes))
 print
 
-blkmap = fs.bitmap.from_buffer_copy(blks[1])
+nmap = fs.bitmap_blocks(sb.disk_sz)
+blkmap = fs.bitmap(data=b''.join(blks[1:1 + nmap]))
 inodes = dict()
 
 print("blocks used:"),
@@ -36,34 +49,76 @@ print ('\n')
 names = dict()
 names[2] = ''
 
+if sb.itab_start:
+    imap = fs.bitmap(data=b''.join(blks[sb.imap_start:sb.imap_start + sb.imap_blocks]))
+
+# the block pointers in an indirect and a double-indirect block
+def indirect(ind, dind):
+    ptrblk = lambda b: list((fs.c_uint * fs.PTRS_PER_BLOCK).from_buffer_copy(blks[b]))
+    ptrs = ptrblk(ind) if ind else []
+    for b in (ptrblk(dind) if dind else []):
+        ptrs += ptrblk(b) if b else [0] * fs.PTRS_PER_BLOCK
+    return ptrs
+
+# the inode, its block list, and what holds it (the inode's block, or
+# its slot in the inode table)
+def load(inum):
+    if not sb.itab_start:
+        _in = fs.inode.from_buffer_copy(blks[inum])
+        if _in.flags & fs.INLINE:
+            return _in, [], blkmap.get(inum)
+        if not _in.flags & fs.INDIRECT:
+            return _in, list(_in.ptrs), blkmap.get(inum)
+        ptrs = list(_in.ptrs[:fs.NDIRECT_ORIG])
+        ind, dind = _in.ptrs[fs.NDIRECT_ORIG], _in.ptrs[fs.NDIRECT_ORIG + 1]
+        return _in, ptrs + indirect(ind, dind), blkmap.get(inum)
+    ipb = fs.INODES_PER_BLOCK
+    blk = blks[sb.itab_start + inum // ipb]
+    off = (inum % ipb) * 128
+    _in = fs.cinode.from_buffer_copy(blk[off:off+128])
+    if _in.flags & fs.INLINE:
+        return _in, [], imap.get(inum)
+    if _in.flags & fs.EXTENTS:
+        exts = list(_in.ext[:_in.eh.count])
+        if _in.eh.depth:
+            exts = [x for e in exts for x in
+                    fs.extent_block.from_buffer_copy(blks[e.pblk]).ext[:e.len]]
+        ptrs = [e.pblk + j for e in exts for j in range(e.len)]
+        return _in, ptrs, imap.get(inum)
+    ptrs = list(_in.ptrs)
+    return _in, ptrs + indirect(_in.indirect, _in.dindirect), imap.get(inum)
+
 def iter(name, inum, v):
     assert inum < nblks
     children = []
     inodes[inum] = 1
-    _in = fs.inode.from_buffer_copy(blks[inum])
-    alloc = '' if blkmap.get(inum) else 'NOT MARKED IN BITMAP '
+    _in, ptrs, used = load(inum)
+    alloc = '' if used else 'NOT MARKED IN BITMAP '
     s = '/' if name == '' else name
 
     if v:
         print ('inode %d:' % inum)
-        print ('  "%s" (%d,%d) %03o %d %s' % (s, _in.uid, _in.gid, _in.mode,
+        print ('  "%s" (%d,%d) %03o %d %s' % (s, _in.uid, _in.gid, _in.mode & 0xffff,
                                                  _in.size, alloc))
     
     xblks = (_in.size + 4095) // 4096
-    if fs.S_ISREG(_in.mode):
+    if _in.flags & fs.INLINE:
+        if v:
+            print ('  data in the inode')
+    elif fs.S_ISREG(_in.mode):
         if v:
             print ('  blocks: ', end='')
         for i in range(xblks):
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+            alloc = '' if blkmap.get(ptrs[i]) else '(NOT ALLOCATED)'
             if v:
-                print (str(_in.ptrs[i]) + alloc, end=' '),
+                print (str(ptrs[i]) + alloc, end=' '),
         print("\n")
         if v:
             print
     elif fs.S_ISDIR(_in.mode):
         for i in range(xblks):
-            dblk = _in.ptrs[i]
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+            dblk = ptrs[i]
+            alloc = '' if blkmap.get(ptrs[i]) else '(NOT ALLOCATED)'
             if v:
                 print ('  block', dblk, alloc)
             _blk = blks[dblk]
@@ -0,0 +1,555 @@
+/*
+ * file:        balloc.c
+ * description: block allocator. The device is split into allocation
+ *              groups of BALLOC_GROUP blocks - the ones a bitmap block
+ *              records - each with its own lock, free count and index
+ *              of its free extents (start, length, sorted), so threads
+ *              allocating in different groups don't wait on each
+ *              other. The indexes are built from the bitmap at mount
+ *              time and kept up to date as blocks are allocated and
+ *              freed. The bitmap is what goes to disk, written by the
+ *              caller from its own copy (see txn_bits).
+ *
+ *              Bitmap scans (building the index, freeing) go a 64-bit
+ *              word at a time, finding the next free or used block in
+ *              a word with count-trailing-zeros. Over that each group
+ *              keeps a summary in memory: a bit per bitmap word saying
+ *              whether it has a free block, and another whether it has
+ *              a used one, each with levels above it (a bit per word of
+ *              the level below) until one word covers the group; above
+ *              those, a group with no free blocks is passed over on its
+ *              count alone. Words with nothing to find are skipped a
+ *              level at a time, so on a multi-terabyte image a scan
+ *              across full (or empty) space costs a few word reads,
+ *              not one per 64 blocks.
+ *
+ *              A request for N blocks near block X (a file's last
+ *              block) takes them right after X when that much is
+ *              free there, so a file that is appended to stays
+ *              contiguous. Otherwise the file starts a new run, in a
+ *              free extent with room for it to keep growing, and the
+ *              next-fit cursor that other allocations in the group
+ *              start from is moved past that room - so files appended
+ *              to in turn don't end up interleaved block by block.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../include/fs.h"
+#include "../include/balloc.h"
+
+#define GROW_ROOM 64            /* blocks left after a file's new run */
+#define MAXLEVEL  3             /* enough for BALLOC_GROUP / 64 bits */
+
+/* a bit per bitmap word of the group (level 0), or per word of the
+ * level below, set if that word has what the summary is for
+ */
+struct summary {
+    int nlevel;
+    int nwords[MAXLEVEL];
+    uint64_t *level[MAXLEVEL];
+};
+
+/* a run of free blocks */
+struct fext {
+    int start;
+    int len;
+};
+
+struct group {
+    pthread_mutex_t lock;
+    int base;                   /* its first block */
+    int start, end;             /* the blocks it hands out */
+    int cursor;                 /* where the next search starts */
+    struct fext *ext;           /* its free extents, sorted */
+    int next, ext_cap;
+    int nfree;                  /* read without the lock */
+    struct summary has_free, has_used;
+};
+
+static unsigned char *map;
+static int nblocks;
+static struct group *groups;
+static int ngroups;
+
+/* bits 'i'..'i'+63 of the map ('i' a multiple of 64), bit k of the
+ * result being block i+k; blocks past the end count as used
+ */
+static uint64_t word(int i)
+{
+    uint64_t w;
+
+    memcpy(&w, map + i / 8, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    if (nblocks - i < 64)
+        w |= ~0ULL << (nblocks - i);
+    return w;
+}
+
+static void sum_free(struct summary *s)
+{
+    for (int l = 0; l < s->nlevel; l++)
+        free(s->level[l]);
+    memset(s, 0, sizeof(*s));
+}
+
+/* room for a summary of 'nbits' bits at level 0, all clear */
+static int sum_init(struct summary *s, int nbits)
+{
+    sum_free(s);
+    do {
+        int n = (nbits + 63) / 64;
+        if ((s->level[s->nlevel] = calloc(n, sizeof(uint64_t))) == NULL)
+            return -ENOMEM;
+        s->nwords[s->nlevel++] = n;
+        nbits = n;
+    } while (nbits > 1 && s->nlevel < MAXLEVEL);
+    return 0;
+}
+
+/* set bit 'i' of level 0 to 'on', and the levels above to match */
+static void sum_set(struct summary *s, int i, int on)
+{
+    for (int l = 0; l < s->nlevel; l++, i /= 64) {
+        uint64_t *w = &s->level[l][i / 64], old = *w;
+        if (on)
+            *w |= 1ULL << (i % 64);
+        else
+            *w &= ~(1ULL << (i % 64));
+        if ((old != 0) == (*w != 0))
+            break;              /* no change for the level above */
+    }
+}
+
+/* the first set bit at level 0 from 'i' on, or -1 */
+static int sum_next(const struct summary *s, int i)
+{
+    int l = 0;
+
+    for (;;) {
+        if (i / 64 >= s->nwords[l])
+            return -1;
+        uint64_t w = s->level[l][i / 64] & (~0ULL << (i % 64));
+        if (w != 0) {
+            i = (i & ~63) + __builtin_ctzll(w);
+            break;
+        }
+        if (l == s->nlevel - 1)
+            return -1;
+        i = i / 64 + 1;         /* the rest of this word is clear */
+        l++;
+    }
+    while (l > 0) {
+        l--;
+        i = i * 64 + __builtin_ctzll(s->level[l][i]);
+    }
+    return i;
+}
+
+/* bring group 'g's summaries for the bitmap word holding block 'lba'
+ * up to date
+ */
+static void sum_update(struct group *g, int lba)
+{
+    uint64_t w = word(lba & ~63);
+    int i = (lba - g->base) / 64;
+
+    sum_set(&g->has_free, i, ~w != 0);
+    sum_set(&g->has_used, i, w != 0);
+}
+
+/* the first block in 'from'..'to'-1 (all in group 'g') that is free
+ * ('set' 0) or used ('set' 1), or 'to' if there is none
+ */
+static int scan(const struct group *g, int from, int to, int set)
+{
+    const struct summary *s = set ? &g->has_used : &g->has_free;
+
+    for (int i = from; i < to;) {
+        int base = i & ~63;
+        uint64_t w = set ? word(base) : ~word(base);
+        w &= ~0ULL << (i - base);
+        if (w != 0) {
+            int b = base + __builtin_ctzll(w);
+            return b < to ? b : to;
+        }
+        int k = sum_next(s, (base - g->base) / 64 + 1);
+        if (k < 0)
+            break;
+        i = g->base + k * 64;
+    }
+    return to;
+}
+
+static int nfree(const struct group *g)
+{
+    return __atomic_load_n(&g->nfree, __ATOMIC_RELAXED);
+}
+
+static void mark(struct group *g, int lba, int n, int used)
+{
+    for (int i = lba; i < lba + n; i++) {
+        if (used)
+            map[i / 8] |= 1 << (i % 8);
+        else
+            map[i / 8] &= ~(1 << (i % 8));
+    }
+    for (int i = lba & ~63; i < lba + n; i += 64)
+        sum_update(g, i);
+    __atomic_add_fetch(&g->nfree, used ? -n : n, __ATOMIC_RELAXED);
+}
+
+static int ext_reserve(struct group *g, int n)
+{
+    if (n <= g->ext_cap)
+        return 0;
+
+    int cap = g->ext_cap > 0 ? g->ext_cap * 2 : 16;
+    while (cap < n)
+        cap *= 2;
+    struct fext *e = realloc(g->ext, cap * sizeof(*e));
+    if (e == NULL)
+        return -ENOMEM;
+    g->ext = e;
+    g->ext_cap = cap;
+    return 0;
+}
+
+/* the first extent that ends after block 'lba' - the one holding it,
+ * if it is free - or 'next' if there is none
+ */
+static int ext_find(const struct group *g, int lba)
+{
+    int lo = 0, hi = g->next;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (g->ext[mid].start + g->ext[mid].len <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* the first 'n' free blocks in a row at or after block 'from', wrapping
+ * around the group: the extent they are in goes in '*i'. Returns the
+ * first, or -1 if there is no such run
+ */
+static int ext_fit(const struct group *g, int from, int n, int *i)
+{
+    if (g->next == 0)
+        return -1;
+
+    int k = ext_find(g, from);
+    for (int j = 0; j <= g->next; j++) {
+        *i = (k + j) % g->next;
+        const struct fext *e = &g->ext[*i];
+        if (j == 0 && e->start < from) {
+            /* the extent 'from' is in: only from there on */
+            if (e->start + e->len - from >= n)
+                return from;
+        } else if (e->len >= n) {
+            return e->start;
+        }
+    }
+    return -1;
+}
+
+/* mark blocks 'lba'..'lba'+'n'-1, which are all in extent 'i', used.
+ * Needs a free entry in the array (see ext_reserve)
+ */
+static void take(struct group *g, int i, int lba, int n)
+{
+    struct fext *e = &g->ext[i];
+    int end = e->start + e->len;
+
+    mark(g, lba, n, 1);
+    if (lba == e->start) {
+        e->start += n;
+        e->len -= n;
+        if (e->len == 0) {
+            memmove(e, e + 1, (g->next - i - 1) * sizeof(*e));
+            g->next--;
+        }
+    } else if (lba + n == end) {
+        e->len -= n;
+    } else {
+        memmove(e + 2, e + 1, (g->next - i - 1) * sizeof(*e));
+        g->next++;
+        e->len = lba - e->start;
+        e[1] = (struct fext){.start = lba + n, .len = end - lba - n};
+    }
+}
+
+/* blocks 'lba'..'lba'+'n'-1, which were in use, are free. If the index
+ * can't grow they are only marked free in the bitmap, and can't be
+ * allocated again until the next mount
+ */
+static void give(struct group *g, int lba, int n)
+{
+    int i = ext_find(g, lba);
+    int left = i > 0 && g->ext[i - 1].start + g->ext[i - 1].len == lba;
+    int right = i < g->next && g->ext[i].start == lba + n;
+
+    mark(g, lba, n, 0);
+    if (left && right) {
+        g->ext[i - 1].len += n + g->ext[i].len;
+        memmove(&g->ext[i], &g->ext[i + 1], (g->next - i - 1) * sizeof(*g->ext));
+        g->next--;
+    } else if (left) {
+        g->ext[i - 1].len += n;
+    } else if (right) {
+        g->ext[i].start = lba;
+        g->ext[i].len += n;
+    } else if (ext_reserve(g, g->next + 1) == 0) {
+        memmove(&g->ext[i + 1], &g->ext[i], (g->next - i) * sizeof(*g->ext));
+        g->ext[i] = (struct fext){.start = lba, .len = n};
+        g->next++;
+    }
+}
+
+static void advance(struct group *g, int lba)
+{
+    g->cursor = lba < g->end ? lba : g->start;
+}
+
+/* 'n' blocks in a row in group 'g', with its lock held: right at
+ * 'goal' if that is in the group and there is room there, else the
+ * first run with room for 'room' more blocks after it, else the first
+ * run at all, both in next-fit order. Returns the first, -ENOSPC or
+ * -ENOMEM
+ */
+static int group_run(struct group *g, int n, int goal, int room)
+{
+    int i, lba;
+
+    if (ext_reserve(g, g->next + 1) < 0)
+        return -ENOMEM;
+    if (goal >= g->start && goal < g->end && (i = ext_find(g, goal)) < g->next &&
+        g->ext[i].start <= goal && g->ext[i].start + g->ext[i].len - goal >= n) {
+        take(g, i, goal, n);    /* straight after what the file has */
+        return goal;
+    }
+    if (room > 0 && (lba = ext_fit(g, g->cursor, n + room, &i)) >= 0) {
+        take(g, i, lba, n);     /* a new run, with room after it */
+        advance(g, lba + n + room);
+        return lba;
+    }
+    if ((lba = ext_fit(g, g->cursor, n, &i)) < 0)
+        return -ENOSPC;
+    take(g, i, lba, n);
+    advance(g, lba + n);
+    return lba;
+}
+
+static void group_release(struct group *g)
+{
+    pthread_mutex_destroy(&g->lock);
+    free(g->ext);
+    sum_free(&g->has_free);
+    sum_free(&g->has_used);
+}
+
+/* group 'g' (zeroed), and its index and summaries from the bitmap */
+static int group_init(struct group *g, int base, int first)
+{
+    pthread_mutex_init(&g->lock, NULL);
+    g->base = base;
+    g->start = g->cursor = base > first ? base : first;
+    g->end = base + BALLOC_GROUP < nblocks ? base + BALLOC_GROUP : nblocks;
+
+    int nwords = (g->end - base + 63) / 64;
+    if (sum_init(&g->has_free, nwords) < 0 || sum_init(&g->has_used, nwords) < 0)
+        return -ENOMEM;
+    for (int i = base; i < g->end; i += 64)
+        sum_update(g, i);
+
+    /* the free count is the group's clear bits (popcount, a word at a
+     * time), less any below 'first'
+     */
+    g->nfree = 0;
+    for (int i = base; i < g->end; i += 64)
+        g->nfree += 64 - __builtin_popcountll(word(i));
+    for (int i = base; i < g->start; i++)
+        g->nfree -= !(map[i / 8] & (1 << (i % 8)));
+
+    for (int i = scan(g, g->start, g->end, 0); i < g->end; i = scan(g, i, g->end, 0)) {
+        int end = scan(g, i, g->end, 1);
+        if (ext_reserve(g, g->next + 1) < 0)
+            return -ENOMEM;
+        g->ext[g->next++] = (struct fext){.start = i, .len = end - i};
+        i = end;
+    }
+    return 0;
+}
+
+int balloc_init(unsigned char *bitmap, int n, int first)
+{
+    for (int k = 0; k < ngroups; k++)
+        group_release(&groups[k]);
+    free(groups);
+    ngroups = 0;
+
+    map = bitmap;
+    nblocks = n;
+    int count = (nblocks + BALLOC_GROUP - 1) / BALLOC_GROUP;
+    if ((groups = calloc(count, sizeof(*groups))) == NULL)
+        return -ENOMEM;
+    while (ngroups < count) {
+        struct group *g = &groups[ngroups++];
+        if (group_init(g, (g - groups) * BALLOC_GROUP, first) < 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+int balloc_groups(void)
+{
+    return ngroups;
+}
+
+int balloc_group(int lba)
+{
+    return lba / BALLOC_GROUP;
+}
+
+int balloc(int group)
+{
+    for (int k = 0; k < ngroups; k++) {
+        struct group *g = &groups[(group + k) % ngroups];
+        if (nfree(g) == 0)
+            continue;           /* passed over without the lock */
+        pthread_mutex_lock(&g->lock);
+        int lba = group_run(g, 1, -1, 0);
+        pthread_mutex_unlock(&g->lock);
+        if (lba != -ENOSPC)
+            return lba;
+    }
+    return -ENOSPC;
+}
+
+int balloc_run(int n)
+{
+    int start = -1, len = 0, lba = -ENOSPC;
+
+    /* a run may go across groups: all of them are locked, in order */
+    for (int k = 0; k < ngroups; k++)
+        pthread_mutex_lock(&groups[k].lock);
+    for (int k = 0; k < ngroups && len < n; k++) {
+        struct group *g = &groups[k];
+        if (ext_reserve(g, g->next + 1) < 0) {
+            lba = -ENOMEM;
+            break;
+        }
+        for (int i = 0; i < g->next && len < n; i++) {
+            if (g->ext[i].start != start + len) {
+                start = g->ext[i].start;
+                len = 0;
+            }
+            len += g->ext[i].len;
+        }
+    }
+    if (len >= n) {
+        lba = start;
+        for (int b = start; b < start + n;) {
+            struct group *g = &groups[balloc_group(b)];
+            int m = (g->end < start + n ? g->end : start + n) - b;
+            take(g, ext_find(g, b), b, m);
+            advance(g, b + m);
+            b += m;
+        }
+    }
+    for (int k = ngroups - 1; k >= 0; k--)
+        pthread_mutex_unlock(&groups[k].lock);
+    return lba;
+}
+
+int balloc_bulk(int n, int goal, int group, struct brun *runs)
+{
+    int nruns = 0, got = 0;
+
+    if (goal >= 0 && goal < nblocks)
+        group = balloc_group(goal);
+
+    /* one run, in the first group from 'group' on with room for it */
+    for (int k = 0; k < ngroups; k++) {
+        struct group *g = &groups[(group + k) % ngroups];
+        if (nfree(g) < n)
+            continue;
+        pthread_mutex_lock(&g->lock);
+        int lba = group_run(g, n, goal, goal >= 0 ? GROW_ROOM : 0);
+        pthread_mutex_unlock(&g->lock);
+        if (lba >= 0) {
+            runs[0] = (struct brun){.lba = lba, .len = n};
+            return 1;
+        }
+        if (lba == -ENOMEM)
+            return lba;
+    }
+
+    /* no free run that long: whole free extents, in next-fit order in
+     * each group in turn
+     */
+    for (int k = 0; k < ngroups && got < n; k++) {
+        struct group *g = &groups[(group + k) % ngroups];
+        if (nfree(g) == 0)
+            continue;
+        pthread_mutex_lock(&g->lock);
+        while (got < n && g->next > 0) {
+            int i = ext_find(g, g->cursor);
+            if (i == g->next)
+                i = 0;
+            int len = g->ext[i].len < n - got ? g->ext[i].len : n - got;
+            runs[nruns] = (struct brun){.lba = g->ext[i].start, .len = len};
+            take(g, i, g->ext[i].start, len);
+            advance(g, runs[nruns].lba + len);
+            got += len;
+            nruns++;
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+    if (got < n) {
+        while (nruns > 0) {
+            nruns--;
+            balloc_free(runs[nruns].lba, runs[nruns].len);
+        }
+        return -ENOSPC;
+    }
+    return nruns;
+}
+
+void balloc_free(int lba, int n)
+{
+    for (int b = lba; b < lba + n;) {
+        struct group *g = &groups[balloc_group(b)];
+        int end = g->end < lba + n ? g->end : lba + n;
+
+        pthread_mutex_lock(&g->lock);
+        for (int i = b; i < end;) {
+            /* only the blocks in the range that are in use */
+            int start = scan(g, i, end, 1);
+            int stop = scan(g, start, end, 0);
+            if (start < stop)
+                give(g, start, stop - start);
+            i = stop;
+        }
+        pthread_mutex_unlock(&g->lock);
+        b = end;
+    }
+}
+
+int balloc_count(void)
+{
+    int n = 0;
+
+    for (int k = 0; k < ngroups; k++)
+        n += nfree(&groups[k]);
+    return n;
+}
@@ -0,0 +1,390 @@
+/*
+ * file:        cache.c
+ * description: fixed-size block buffer cache.
+ *
+ * Buffers are found through a hash table indexed by LBA and replaced
+ * with a generalized CLOCK: every hit bumps a small saturating
+ * reference count, and the clock hand decrements counts until it
+ * finds a buffer at zero. New blocks enter with a count of zero, so a
+ * large one-pass scan only recycles its own buffers instead of
+ * flushing out blocks that are used over and over (the root inode,
+ * directory blocks, the bitmap).
+ *
+ * In write-back mode blocks are marked dirty instead of being written
+ * through, so repeated writes to the same block (the bitmap, an inode
+ * being appended to) cost one device write when they are cleaned.
+ * Dirty buffers are cleaned by cache_flush(), or one at a time when
+ * the clock hand picks them for eviction.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../include/fs.h"
+#include "../include/block.h"
+#include "../include/cache.h"
+
+#define REF_MAX 3
+
+struct cbuf {
+    int           lba;          /* -1 if the buffer is free */
+    unsigned char ref;          /* CLOCK reference count */
+    unsigned char dirty;        /* newer than the device copy */
+    unsigned char busy;         /* a snapshot is being flushed */
+    unsigned char ahead;        /* read ahead, not yet asked for */
+    struct cbuf  *hnext;        /* hash chain */
+    char         *data;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* serializes cache_flush() calls, so an older snapshot of a block can
+ * never land on the device after a newer one
+ */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int (*writeback)(const struct block_iov *iov, int iovcnt);
+static int ndirty;
+
+static struct cbuf  *bufs;
+static char         *pool;
+static int           nbufs;
+static int           hand;
+static struct cbuf **htab;
+static unsigned      hmask;
+
+static unsigned long wseq;      /* bumped by every cache_update */
+static struct cache_stats stats;
+
+static unsigned hash(int lba)
+{
+    return ((unsigned)lba * 2654435761u) & hmask;
+}
+
+static struct cbuf *lookup(int lba)
+{
+    struct cbuf *b;
+    for (b = htab[hash(lba)]; b != NULL; b = b->hnext)
+        if (b->lba == lba)
+            return b;
+    return NULL;
+}
+
+static void unhash(struct cbuf *b)
+{
+    struct cbuf **pp = &htab[hash(b->lba)];
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+}
+
+/* write one dirty buffer back before it is reused
+ */
+static void clean(struct cbuf *b)
+{
+    struct block_iov iov = {.lba = b->lba, .buf = b->data, .nblks = 1};
+
+    if (writeback(&iov, 1) < 0)
+        fprintf(stderr, "cache: lost write to block %d\n", b->lba);
+    b->dirty = 0;
+    ndirty--;
+    stats.writebacks++;
+}
+
+/* advance the clock hand to a buffer with no recent references and
+ * take it over for 'lba'. A dirty victim is written back first, unless
+ * an older copy of it is still being flushed - then it is passed over.
+ */
+static struct cbuf *evict(int lba)
+{
+    struct cbuf *b;
+
+    for (;;) {
+        b = &bufs[hand];
+        hand = (hand + 1) % nbufs;
+        if (b->busy && b->dirty)
+            continue;           /* would overtake the older snapshot */
+        if (b->lba < 0)
+            break;
+        if (b->ref == 0) {
+            if (b->dirty)
+                clean(b);
+            unhash(b);
+            stats.evictions++;
+            break;
+        }
+        b->ref--;
+    }
+
+    b->lba = lba;
+    b->ref = 0;
+    b->ahead = 0;
+    b->hnext = htab[hash(lba)];
+    htab[hash(lba)] = b;
+    return b;
+}
+
+int cache_init(size_t bytes)
+{
+    int n = bytes / FS_BLOCK_SIZE;
+    unsigned nhash = 1;
+
+    pthread_mutex_lock(&lock);
+    free(bufs);
+    free(pool);
+    free(htab);
+    bufs = NULL;
+    pool = NULL;
+    htab = NULL;
+    nbufs = hand = ndirty = 0;
+
+    if (n > 0) {
+        while (nhash < (unsigned)n)
+            nhash <<= 1;
+        bufs = calloc(n, sizeof(*bufs));
+        pool = malloc((size_t)n * FS_BLOCK_SIZE);
+        htab = calloc(nhash, sizeof(*htab));
+        if (bufs == NULL || pool == NULL || htab == NULL) {
+            free(bufs);
+            free(pool);
+            free(htab);
+            bufs = NULL;
+            pool = NULL;
+            htab = NULL;
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            bufs[i].lba = -1;
+            bufs[i].data = pool + (size_t)i * FS_BLOCK_SIZE;
+        }
+        nbufs = n;
+        hmask = nhash - 1;
+    }
+    stats.nbufs = nbufs;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int cache_enabled(void)
+{
+    return nbufs > 0;
+}
+
+int cache_read(int lba, void *buf)
+{
+    struct cbuf *b;
+
+    pthread_mutex_lock(&lock);
+    if ((b = lookup(lba)) != NULL) {
+        memcpy(buf, b->data, FS_BLOCK_SIZE);
+        if (b->ref < REF_MAX)
+            b->ref++;
+        if (b->ahead) {
+            b->ahead = 0;
+            stats.ra_hits++;
+        }
+        stats.hits++;
+    } else {
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&lock);
+    return b != NULL;
+}
+
+unsigned long cache_seq(void)
+{
+    pthread_mutex_lock(&lock);
+    unsigned long seq = wseq;
+    pthread_mutex_unlock(&lock);
+    return seq;
+}
+
+void cache_fill(int lba, const void *buf, unsigned long seq, int ahead)
+{
+    struct cbuf *b;
+
+    pthread_mutex_lock(&lock);
+    if (seq == wseq && lookup(lba) == NULL) {
+        b = evict(lba);
+        memcpy(b->data, buf, FS_BLOCK_SIZE);
+        if (ahead)
+            stats.ra_fills++;
+        b->ahead = ahead;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int cache_contains(int lba)
+{
+    pthread_mutex_lock(&lock);
+    int rv = nbufs > 0 && lookup(lba) != NULL;
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+void cache_update(int lba, const void *buf)
+{
+    struct cbuf *b;
+
+    pthread_mutex_lock(&lock);
+    wseq++;
+    if ((b = lookup(lba)) == NULL)
+        b = evict(lba);
+    memcpy(b->data, buf, FS_BLOCK_SIZE);
+    pthread_mutex_unlock(&lock);
+}
+
+void cache_write(int lba, const void *buf)
+{
+    struct cbuf *b;
+
+    pthread_mutex_lock(&lock);
+    wseq++;
+    if ((b = lookup(lba)) == NULL)
+        b = evict(lba);
+    memcpy(b->data, buf, FS_BLOCK_SIZE);
+    if (!b->dirty) {
+        b->dirty = 1;
+        ndirty++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void cache_set_writeback(int (*fn)(const struct block_iov *iov, int iovcnt))
+{
+    writeback = fn;
+}
+
+int cache_dirty(void)
+{
+    return ndirty;
+}
+
+static int cmp_lba(const void *a, const void *b)
+{
+    const struct cbuf *x = *(const struct cbuf **)a;
+    const struct cbuf *y = *(const struct cbuf **)b;
+    return (x->lba > y->lba) - (x->lba < y->lba);
+}
+
+int cache_flush(void)
+{
+    struct cbuf **dirty = NULL;
+    struct block_iov *iov = NULL;
+    char *snap = NULL;
+    int n = 0, rv = 0;
+
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&lock);
+    if (ndirty == 0) {
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&flush_lock);
+        return 0;
+    }
+
+    /* snapshot the dirty buffers in LBA order and mark them clean
+     * (and busy, so they are not evicted while the copy is in
+     * flight). A block dirtied again meanwhile is simply dirty again.
+     */
+    dirty = malloc(ndirty * sizeof(*dirty));
+    iov = malloc(ndirty * sizeof(*iov));
+    snap = malloc((size_t)ndirty * FS_BLOCK_SIZE);
+    if (dirty == NULL || iov == NULL || snap == NULL) {
+        pthread_mutex_unlock(&lock);
+        rv = -EIO;
+        goto out;
+    }
+    for (int i = 0; i < nbufs; i++)
+        if (bufs[i].dirty)
+            dirty[n++] = &bufs[i];
+    qsort(dirty, n, sizeof(*dirty), cmp_lba);
+    for (int i = 0; i < n; i++) {
+        memcpy(snap + (size_t)i * FS_BLOCK_SIZE, dirty[i]->data, FS_BLOCK_SIZE);
+        iov[i].lba = dirty[i]->lba;
+        iov[i].buf = snap + (size_t)i * FS_BLOCK_SIZE;
+        iov[i].nblks = 1;
+        dirty[i]->dirty = 0;
+        dirty[i]->busy = 1;
+    }
+    ndirty -= n;
+    pthread_mutex_unlock(&lock);
+
+    rv = writeback(iov, n);
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < n; i++) {
+        dirty[i]->busy = 0;
+        if (rv < 0 && dirty[i]->lba == iov[i].lba && !dirty[i]->dirty) {
+            dirty[i]->dirty = 1;    /* try again next time */
+            ndirty++;
+        }
+    }
+    if (rv == 0)
+        stats.writebacks += n;
+    pthread_mutex_unlock(&lock);
+
+out:
+    pthread_mutex_unlock(&flush_lock);
+    free(dirty);
+    free(iov);
+    free(snap);
+    return rv;
+}
+
+void cache_discard(int lba)
+{
+    struct cbuf *b;
+
+    pthread_mutex_lock(&lock);
+    wseq++;                     /* a read in flight must not refill it */
+    if (nbufs > 0 && (b = lookup(lba)) != NULL) {
+        unhash(b);
+        if (b->dirty)
+            ndirty--;
+        b->lba = -1;
+        b->ref = 0;
+        b->dirty = 0;
+        b->ahead = 0;
+        b->hnext = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void cache_invalidate(void)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < nbufs; i++) {
+        bufs[i].lba = -1;
+        bufs[i].ref = 0;
+        bufs[i].dirty = 0;
+        bufs[i].busy = 0;
+        bufs[i].ahead = 0;
+        bufs[i].hnext = NULL;
+    }
+    ndirty = 0;
+    if (htab != NULL)
+        memset(htab, 0, (hmask + 1) * sizeof(*htab));
+    hand = 0;
+    wseq++;
+    pthread_mutex_unlock(&lock);
+}
+
+void cache_get_stats(struct cache_stats *st)
+{
+    pthread_mutex_lock(&lock);
+    *st = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+void cache_reset_stats(void)
+{
+    pthread_mutex_lock(&lock);
+    stats.hits = stats.misses = stats.evictions = stats.writebacks = 0;
+    stats.ra_fills = stats.ra_hits = 0;
+    pthread_mutex_unlock(&lock);
+}
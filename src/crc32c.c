@@ -0,0 +1,134 @@
+/*
+ * file:        crc32c.c
+ * description: CRC32C with hardware acceleration. x86-64 uses the
+ *              SSE4.2 crc32 instruction when cpuid reports it, arm64
+ *              the ARMv8 CRC32C instructions; everything else (and
+ *              older x86) uses a slice-by-8 table. zlib's crc32() is
+ *              a different polynomial, so it can't stand in here -
+ *              images must checksum the same on every machine.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_SSE42_CRC 1
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define HAVE_ARM_CRC 1
+#include <arm_acle.h>
+#endif
+
+#define POLY 0x82f63b78         /* CRC32C, reflected */
+
+static uint32_t table[8][256];
+
+static void make_table(void)
+{
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+}
+
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;               /* little-endian only, like the image */
+        crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+              table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+              table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+              table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    while (len-- > 0)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+#ifdef HAVE_ARM_CRC
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+    }
+    while (len-- > 0)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t (*impl)(uint32_t, const unsigned char *, size_t);
+static const char *impl_name;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void pick(void)
+{
+    impl = crc_sw;
+    impl_name = "table";
+#if defined(HAVE_SSE42_CRC)
+    if (__builtin_cpu_supports("sse4.2")) {
+        impl = crc_hw;
+        impl_name = "sse4.2";
+    }
+#elif defined(HAVE_ARM_CRC)
+    impl = crc_hw;
+    impl_name = "armv8-crc";
+#endif
+    if (impl == crc_sw)
+        make_table();
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&once, pick);
+    return ~impl(~crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+    pthread_once(&once, pick);
+    return impl_name;
+}
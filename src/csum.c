@@ -0,0 +1,106 @@
+/*
+ * file:        csum.c
+ * description: in-memory copy of the checksum region. Entry 'lba'
+ *              holds the CRC32C of block 'lba'; the region's own
+ *              blocks are not covered. The block layer keeps the
+ *              region on disk in step with the data it describes.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/fs.h"
+#include "../include/crc32c.h"
+#include "../include/csum.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *tab;
+static int start, nblocks;
+
+int csum_init(int first, int n)
+{
+    uint32_t *t = calloc((size_t)n * CSUM_PER_BLOCK, sizeof(*t));
+
+    if (t == NULL)
+        return -1;
+    pthread_mutex_lock(&lock);
+    free(tab);
+    tab = t;
+    start = first;
+    nblocks = n;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void csum_exit(void)
+{
+    pthread_mutex_lock(&lock);
+    free(tab);
+    tab = NULL;
+    start = nblocks = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+int csum_active(void)
+{
+    return tab != NULL;
+}
+
+int csum_start(void)
+{
+    return start;
+}
+
+int csum_nblocks(void)
+{
+    return nblocks;
+}
+
+int csum_in_region(int lba)
+{
+    return lba >= start && lba < start + nblocks;
+}
+
+static int covered(int lba)
+{
+    return lba >= 0 && (size_t)lba < (size_t)nblocks * CSUM_PER_BLOCK &&
+        !csum_in_region(lba);
+}
+
+int csum_verify(int lba, const void *buf)
+{
+    if (!covered(lba))
+        return 0;
+    uint32_t crc = crc32c(0, buf, FS_BLOCK_SIZE);
+    pthread_mutex_lock(&lock);
+    int ok = tab[lba] == crc;
+    pthread_mutex_unlock(&lock);
+    return ok ? 0 : -1;
+}
+
+int csum_update(int lba, const void *buf)
+{
+    if (!covered(lba))
+        return -1;
+    uint32_t crc = crc32c(0, buf, FS_BLOCK_SIZE);
+    pthread_mutex_lock(&lock);
+    tab[lba] = crc;
+    pthread_mutex_unlock(&lock);
+    return lba / CSUM_PER_BLOCK;
+}
+
+void csum_save_block(int idx, void *buf)
+{
+    pthread_mutex_lock(&lock);
+    memcpy(buf, tab + (size_t)idx * CSUM_PER_BLOCK, FS_BLOCK_SIZE);
+    pthread_mutex_unlock(&lock);
+}
+
+void csum_load_block(int idx, const void *buf)
+{
+    pthread_mutex_lock(&lock);
+    memcpy(tab + (size_t)idx * CSUM_PER_BLOCK, buf, FS_BLOCK_SIZE);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,200 @@
+/*
+ * file:        dcache.c
+ * description: directory entry cache. Two direct-mapped tables: one
+ *              maps (directory inode, name) to an inode and saves the
+ *              directory scan for each path component, the other maps
+ *              a whole path to its inode so a repeated lookup of a deep
+ *              path is one hash probe. A collision just replaces the
+ *              older entry.
+ *
+ *              Names that were looked up and not found are cached too
+ *              (inode 0), so probes for missing files don't scan the
+ *              directory again. Adding a name replaces its negative
+ *              entry, since both hash to the same slot; unlink, rmdir
+ *              and rename turn the old name's entry negative and drop
+ *              every cached path with the inode on it.
+ *
+ *              A path is resolved one component at a time, each with
+ *              its directory locked, so a removal can come between two
+ *              of them; it bumps a generation count, and a path that
+ *              was resolved across one isn't added.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../include/dcache.h"
+
+#define DENT_SLOTS 4096
+#define PATH_SLOTS 1024
+
+/* same limits as path parsing in filesystem.c */
+#define MAX_PATH_LEN 10
+#define NAME_LEN 28
+
+struct dent {
+    int  dir;                   /* 0 = unused */
+    int  inum;                  /* 0 = no such name */
+    char name[NAME_LEN];
+};
+
+struct pent {
+    int  depth;                 /* 0 = unused */
+    int  inums[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN * NAME_LEN];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dent dents[DENT_SLOTS];
+static struct pent pents[PATH_SLOTS];
+static struct dcache_stats stats;
+static unsigned long generation;
+
+/* FNV-1a */
+static uint32_t hash(uint32_t h, const char *s)
+{
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static struct dent *dent_slot(int dir, const char *name)
+{
+    return &dents[hash(2166136261u ^ dir, name) % DENT_SLOTS];
+}
+
+int dcache_lookup(int dir, const char *name)
+{
+    struct dent *d = dent_slot(dir, name);
+    int inum = 0;
+
+    pthread_mutex_lock(&lock);
+    if (d->dir == dir && strcmp(d->name, name) == 0) {
+        inum = d->inum;
+        if (inum == 0) {
+            inum = -ENOENT;
+            stats.neg_hits++;
+        } else {
+            stats.hits++;
+        }
+    } else {
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&lock);
+    return inum;
+}
+
+void dcache_add(int dir, const char *name, int inum)
+{
+    struct dent *d = dent_slot(dir, name);
+
+    if (strlen(name) >= NAME_LEN)
+        return;
+    pthread_mutex_lock(&lock);
+    d->dir = dir;
+    d->inum = inum;
+    strcpy(d->name, name);
+    pthread_mutex_unlock(&lock);
+}
+
+/* join the components into 'buf'. Returns 0, or -1 if the path is too
+ * long to cache
+ */
+static int join(int pathc, char **pathv, char *buf)
+{
+    size_t len = 0;
+
+    if (pathc > MAX_PATH_LEN)
+        return -1;
+    for (int i = 0; i < pathc; i++) {
+        size_t n = strlen(pathv[i]);
+        if (n >= NAME_LEN)
+            return -1;
+        buf[len++] = '/';
+        memcpy(buf + len, pathv[i], n);
+        len += n;
+    }
+    buf[len] = 0;
+    return 0;
+}
+
+int dcache_path(int pathc, char **pathv)
+{
+    char key[MAX_PATH_LEN * NAME_LEN];
+    int inum = 0;
+
+    if (join(pathc, pathv, key) < 0)
+        return 0;
+    struct pent *p = &pents[hash(2166136261u, key) % PATH_SLOTS];
+
+    pthread_mutex_lock(&lock);
+    if (p->depth == pathc && strcmp(p->path, key) == 0) {
+        inum = p->inums[pathc - 1];
+        stats.path_hits++;
+    }
+    pthread_mutex_unlock(&lock);
+    return inum;
+}
+
+void dcache_add_path(int pathc, char **pathv, const int *inums,
+                     unsigned long gen)
+{
+    char key[MAX_PATH_LEN * NAME_LEN];
+
+    if (pathc < 1 || join(pathc, pathv, key) < 0)
+        return;
+    struct pent *p = &pents[hash(2166136261u, key) % PATH_SLOTS];
+
+    pthread_mutex_lock(&lock);
+    if (gen != generation) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    p->depth = pathc;
+    memcpy(p->inums, inums, pathc * sizeof(int));
+    strcpy(p->path, key);
+    pthread_mutex_unlock(&lock);
+}
+
+void dcache_remove(int dir, const char *name, int inum)
+{
+    dcache_add(dir, name, 0);
+
+    pthread_mutex_lock(&lock);
+    generation++;
+    for (int i = 0; i < PATH_SLOTS; i++) {
+        for (int j = 0; j < pents[i].depth; j++) {
+            if (pents[i].inums[j] == inum) {
+                pents[i].depth = 0;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned long dcache_generation(void)
+{
+    pthread_mutex_lock(&lock);
+    unsigned long gen = generation;
+    pthread_mutex_unlock(&lock);
+    return gen;
+}
+
+void dcache_reset(void)
+{
+    pthread_mutex_lock(&lock);
+    memset(dents, 0, sizeof(dents));
+    memset(pents, 0, sizeof(pents));
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&lock);
+}
+
+void dcache_get_stats(struct dcache_stats *st)
+{
+    pthread_mutex_lock(&lock);
+    *st = stats;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,185 @@
+/*
+ * file:        dirscan.c
+ * description: name lookup in a directory block. Each entry is 32
+ *              bytes - a word holding the valid bit and inode, then
+ *              the name - so a match is one masked compare of the
+ *              entry against a key: the valid bit, and the name bytes
+ *              up to and including its NUL. Bytes after the NUL are
+ *              masked off, since nothing in the format says they are
+ *              zero.
+ *
+ *              x86-64 compares a whole entry with one AVX2 instruction
+ *              when cpuid reports it and two SSE2 ones otherwise;
+ *              arm64 uses NEON, and anything else 64-bit words.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/dirscan.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define NAME_MAX_LEN 27
+
+struct key {
+    unsigned char val[32] __attribute__((aligned(32)));
+    unsigned char mask[32] __attribute__((aligned(32)));
+};
+
+/* Returns -1 if no entry can be called 'name' */
+static int make_key(struct key *k, const char *name)
+{
+    size_t len = strlen(name);
+    struct fs_dirent valid;
+
+    if (len > NAME_MAX_LEN)
+        return -1;
+
+    /* where the compiler put the bit field */
+    memset(&valid, 0, sizeof(valid));
+    valid.valid = 1;
+    memcpy(k->mask, &valid, 4);
+    memcpy(k->val, &valid, 4);
+
+    memset(k->mask + 4, 0, 28);
+    memset(k->mask + 4, 0xff, len + 1);
+    memset(k->val + 4, 0, 28);
+    memcpy(k->val + 4, name, len);
+    return 0;
+}
+
+static int find_scalar(const struct fs_dirent *d, int n, const struct key *k)
+{
+    uint64_t val[4], mask[4];
+
+    memcpy(val, k->val, 32);
+    memcpy(mask, k->mask, 32);
+    for (int i = 0; i < n; i++) {
+        uint64_t e[4];
+        memcpy(e, &d[i], 32);
+        if (((e[0] & mask[0]) ^ val[0]) == 0 && ((e[1] & mask[1]) ^ val[1]) == 0 &&
+            ((e[2] & mask[2]) ^ val[2]) == 0 && ((e[3] & mask[3]) ^ val[3]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+static int find_sse2(const struct fs_dirent *d, int n, const struct key *k)
+{
+    __m128i v0 = _mm_load_si128((const __m128i *)k->val);
+    __m128i v1 = _mm_load_si128((const __m128i *)(k->val + 16));
+    __m128i m0 = _mm_load_si128((const __m128i *)k->mask);
+    __m128i m1 = _mm_load_si128((const __m128i *)(k->mask + 16));
+
+    for (int i = 0; i < n; i++) {
+        const __m128i *p = (const __m128i *)&d[i];
+        __m128i e0 = _mm_and_si128(_mm_loadu_si128(p), m0);
+        __m128i e1 = _mm_and_si128(_mm_loadu_si128(p + 1), m1);
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(e0, v0), _mm_cmpeq_epi8(e1, v1));
+        if (_mm_movemask_epi8(eq) == 0xffff)
+            return i;
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(const struct fs_dirent *d, int n, const struct key *k)
+{
+    __m256i v = _mm256_load_si256((const __m256i *)k->val);
+    __m256i m = _mm256_load_si256((const __m256i *)k->mask);
+
+    for (int i = 0; i < n; i++) {
+        __m256i e = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&d[i]), m);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(e, v)) == -1)
+            return i;
+    }
+    return -1;
+}
+#endif
+
+#ifdef HAVE_NEON
+static int find_neon(const struct fs_dirent *d, int n, const struct key *k)
+{
+    uint8x16_t v0 = vld1q_u8(k->val), v1 = vld1q_u8(k->val + 16);
+    uint8x16_t m0 = vld1q_u8(k->mask), m1 = vld1q_u8(k->mask + 16);
+
+    for (int i = 0; i < n; i++) {
+        const uint8_t *p = (const uint8_t *)&d[i];
+        uint8x16_t eq = vandq_u8(vceqq_u8(vandq_u8(vld1q_u8(p), m0), v0),
+                                 vceqq_u8(vandq_u8(vld1q_u8(p + 16), m1), v1));
+        if (vminvq_u8(eq) == 0xff)
+            return i;
+    }
+    return -1;
+}
+#endif
+
+static const struct {
+    const char *name;
+    int (*find)(const struct fs_dirent *, int, const struct key *);
+} impls[] = {
+#ifdef HAVE_X86_SIMD
+    {"avx2", find_avx2},
+    {"sse2", find_sse2},
+#endif
+#ifdef HAVE_NEON
+    {"neon", find_neon},
+#endif
+    {"scalar", find_scalar},
+};
+
+static int impl;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static int supported(const char *name)
+{
+#ifdef HAVE_X86_SIMD
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+/* the first supported entry in 'impls' is the fastest */
+static void pick(void)
+{
+    while (!supported(impls[impl].name))
+        impl++;
+}
+
+int dirent_find(const struct fs_dirent *d, int n, const char *name)
+{
+    struct key k;
+
+    pthread_once(&once, pick);
+    if (make_key(&k, name) < 0)
+        return -1;
+    return impls[impl].find(d, n, &k);
+}
+
+const char *dirent_impl(void)
+{
+    pthread_once(&once, pick);
+    return impls[impl].name;
+}
+
+int dirent_set_impl(const char *name)
+{
+    pthread_once(&once, pick);
+    for (int i = 0; i < (int)(sizeof(impls) / sizeof(impls[0])); i++) {
+        if (strcmp(impls[i].name, name) == 0 && supported(name)) {
+            impl = i;
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,308 @@
+/*
+ * file:        filedev.c
+ * description: POSIX file backend for the block layer. Adjacent runs
+ *              are folded into one preadv/pwritev; lists that need
+ *              several transfers go through io_uring when it is set
+ *              up, and with -mmap every transfer is a memcpy against
+ *              a mapping of the whole image.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/fs.h"        /* only for FS_BLOCK_SIZE */
+#include "../include/block.h"
+#include "../include/blockdev.h"
+#include "../include/uring.h"
+
+/* max number of iovecs handed to a single preadv/pwritev call
+ * (POSIX guarantees IOV_MAX >= 16, Linux and macOS allow 1024)
+ */
+#define IOV_BATCH 64
+
+struct filedev {
+    struct blockdev dev;
+    int    fd;
+    char  *map;                 /* whole image mapped (-mmap), or NULL */
+    size_t map_len;
+};
+
+#define SYSCALLS_ADD(d, n) \
+    __atomic_fetch_add(&(d)->dev.syscalls, (n), __ATOMIC_RELAXED)
+
+/* transfer a vector of buffers that is contiguous on disk starting
+ * at byte 'off', restarting after short transfers. Returns -EIO if
+ * error (including hitting the end of the image), 0 otherwise
+ */
+static int xfer(struct filedev *d, int write, struct iovec *v, int cnt,
+                off_t off)
+{
+    while (cnt > 0) {
+        ssize_t n = write ? pwritev(d->fd, v, cnt, off) :
+                            preadv(d->fd, v, cnt, off);
+        SYSCALLS_ADD(d, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        off += n;
+        while (cnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* mmap mode: every transfer is a memcpy to or from the mapping
+ */
+static int map_rw(struct filedev *d, int write, const struct block_iov *iov,
+                  int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        size_t off = (size_t)iov[i].lba * FS_BLOCK_SIZE;
+        size_t len = (size_t)iov[i].nblks * FS_BLOCK_SIZE;
+
+        if (iov[i].lba < 0 || off + len > d->map_len)
+            return -EIO;
+        if (write)
+            memcpy(d->map + off, iov[i].buf, len);
+        else
+            memcpy(iov[i].buf, d->map + off, len);
+    }
+    return 0;
+}
+
+/* walk the run list, folding runs that continue where the previous
+ * one ended into the same positional transfer. With io_uring, a list
+ * that needs more than one transfer goes to the kernel in a single
+ * submission; otherwise each transfer is a preadv/pwritev call.
+ */
+static int file_rw(struct filedev *d, int write, const struct block_iov *iov,
+                   int iovcnt)
+{
+    struct iovec vbuf[IOV_BATCH], *v = vbuf;
+    struct uring_seg sbuf[IOV_BATCH], *seg = sbuf;
+    int nseg = 0, next = 0, rv = 0;
+
+    if (d->map != NULL)
+        return map_rw(d, write, iov, iovcnt);
+
+    if (iovcnt > IOV_BATCH) {
+        v = malloc(iovcnt * sizeof(*v));
+        seg = malloc(iovcnt * sizeof(*seg));
+        if (v == NULL || seg == NULL) {
+            rv = -EIO;
+            goto out;
+        }
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        v[i].iov_base = iov[i].buf;
+        v[i].iov_len = (size_t)iov[i].nblks * FS_BLOCK_SIZE;
+        if (nseg > 0 && iov[i].lba == next && seg[nseg - 1].cnt < IOV_BATCH) {
+            seg[nseg - 1].cnt++;
+        } else {
+            seg[nseg].iov = &v[i];
+            seg[nseg].cnt = 1;
+            seg[nseg].off = (off_t)iov[i].lba * FS_BLOCK_SIZE;
+            nseg++;
+        }
+        next = iov[i].lba + iov[i].nblks;
+    }
+
+    int use_ring = nseg > 1 && uring_active();
+    if (use_ring) {
+        int calls = uring_submit(write, seg, nseg);
+        if (calls < 0) {
+            rv = -EIO;
+            goto out;
+        }
+        SYSCALLS_ADD(d, calls);
+    }
+
+    for (int i = 0; i < nseg && rv == 0; i++) {
+        off_t off = seg[i].off;
+        struct iovec *sv = seg[i].iov;
+        int cnt = seg[i].cnt;
+
+        if (use_ring) {
+            /* finish a short completion synchronously */
+            ssize_t n = seg[i].res;
+            if (n <= 0) {
+                rv = -EIO;
+                break;
+            }
+            off += n;
+            while (cnt > 0 && (size_t)n >= sv->iov_len) {
+                n -= sv->iov_len;
+                sv++;
+                cnt--;
+            }
+            if (cnt > 0) {
+                sv->iov_base = (char *)sv->iov_base + n;
+                sv->iov_len -= n;
+            }
+        }
+        rv = xfer(d, write, sv, cnt, off);
+    }
+
+out:
+    if (v != vbuf)
+        free(v);
+    if (seg != sbuf)
+        free(seg);
+    return rv;
+}
+
+static int file_read(struct blockdev *dev, const struct block_iov *iov,
+                     int iovcnt)
+{
+    return file_rw((struct filedev *)dev, 0, iov, iovcnt);
+}
+
+static int file_write(struct blockdev *dev, const struct block_iov *iov,
+                      int iovcnt)
+{
+    return file_rw((struct filedev *)dev, 1, iov, iovcnt);
+}
+
+static int file_flush(struct blockdev *dev)
+{
+    struct filedev *d = (struct filedev *)dev;
+
+    if (d->map != NULL && msync(d->map, d->map_len, MS_SYNC) < 0)
+        return -EIO;
+    SYSCALLS_ADD(d, 1);
+    return fsync(d->fd) < 0 ? -EIO : 0;
+}
+
+/* give the blocks back to the host file system by punching a hole;
+ * they read back as zeroes
+ */
+static int file_discard(struct blockdev *dev, int lba, int nblks)
+{
+    struct filedev *d = (struct filedev *)dev;
+    off_t off = (off_t)lba * FS_BLOCK_SIZE;
+    off_t len = (off_t)nblks * FS_BLOCK_SIZE;
+
+    SYSCALLS_ADD(d, 1);
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  off, len) == 0)
+        return 0;
+#elif defined(F_PUNCHHOLE)
+    struct fpunchhole ph = {.fp_flags = 0, .reserved = 0,
+                            .fp_offset = off, .fp_length = len};
+    if (fcntl(d->fd, F_PUNCHHOLE, &ph) == 0)
+        return 0;
+#else
+    errno = EOPNOTSUPP;
+#endif
+    return errno == EOPNOTSUPP || errno == ENOTSUP ? -EOPNOTSUPP : -EIO;
+}
+
+static long file_size(struct blockdev *dev)
+{
+    struct filedev *d = (struct filedev *)dev;
+    struct stat sb;
+
+    if (fstat(d->fd, &sb) < 0)
+        return -EIO;
+    return sb.st_size / FS_BLOCK_SIZE;
+}
+
+static void *file_map(struct blockdev *dev, int lba)
+{
+    struct filedev *d = (struct filedev *)dev;
+
+    if (d->map == NULL || lba < 0 ||
+        (size_t)(lba + 1) * FS_BLOCK_SIZE > d->map_len)
+        return NULL;
+    return d->map + (size_t)lba * FS_BLOCK_SIZE;
+}
+
+static void file_close(struct blockdev *dev)
+{
+    struct filedev *d = (struct filedev *)dev;
+
+    uring_exit();
+    if (d->map != NULL)
+        munmap(d->map, d->map_len);
+    close(d->fd);
+    free(d);
+}
+
+static const struct blockdev_ops file_ops = {
+    .name = "file",
+    .read = file_read,
+    .write = file_write,
+    .flush = file_flush,
+    .discard = file_discard,
+    .size = file_size,
+    .map = file_map,
+    .close = file_close,
+};
+
+struct blockdev *filedev_open(const char *file)
+{
+    struct filedev *d = calloc(1, sizeof(*d));
+
+    if (d == NULL)
+        return NULL;
+    if ((d->fd = open(file, O_RDWR)) < 0) {
+        free(d);
+        return NULL;
+    }
+    d->dev.ops = &file_ops;
+    return &d->dev;
+}
+
+/* submit through io_uring. Returns 0, or -errno if io_uring is not
+ * available (the device keeps using preadv/pwritev)
+ */
+int filedev_uring(struct blockdev *dev, int depth)
+{
+    if (dev->ops != &file_ops)
+        return -EINVAL;
+    return uring_init(((struct filedev *)dev)->fd, depth);
+}
+
+/* map the whole image into memory. Returns 0 or -errno (in which
+ * case normal I/O is used)
+ */
+int filedev_mmap(struct blockdev *dev)
+{
+    struct filedev *d = (struct filedev *)dev;
+    struct stat sb;
+
+    if (dev->ops != &file_ops)
+        return -EINVAL;
+    if (d->map != NULL)
+        return 0;
+    if (fstat(d->fd, &sb) < 0)
+        return -errno;
+    void *p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   d->fd, 0);
+    if (p == MAP_FAILED)
+        return -errno;
+    d->map = p;
+    d->map_len = sb.st_size;
+    return 0;
+}
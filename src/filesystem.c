@@ -5,7 +5,6 @@
 
 #define FUSE_USE_VERSION 27
 #define _FILE_OFFSET_BITS 64
-#define MAX_BLOCKS 32768 //4096 bytes × 8 bits
 #define BLOCK_SIZE 4096
 
 #include <stdlib.h>
@@ -17,8 +16,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "../include/fs.h"
+#include "../include/block.h"
+#include "../include/readahead.h"
+#include "../include/inode.h"
+#include "../include/dcache.h"
+#include "../include/dirscan.h"
+#include "../include/balloc.h"
+#include "../include/txn.h"
 
 /* if you don't understand why you can't use these system calls here, 
  * you need to read the assignment description another time
@@ -28,14 +35,8 @@
 #define read(a, b, c) error do not use read()
 #define write(a, b, c) error do not use write()
 
-unsigned char bitmap[BLOCK_SIZE]; // block 1, global for use in allocation later
-
-/* disk access. All access is in terms of 4KB blocks; read and
- * write functions return 0 (success) or -EIO.
- */
-extern int block_read(void *buf, int lba, int nblks);
-
-extern int block_write(void *buf, int lba, int nblks);
+unsigned char *bitmap; // blocks 1.., global for use in allocation later
+static int bitmap_blocks;
 
 /* bitmap functions
  */
@@ -51,6 +52,18 @@ int bit_test(unsigned char *map, int i) {
     return map[i / 8] & (1 << (i % 8));
 }
 
+/* return a pointer to the contents of block 'lba': straight into the
+ * image when it is mmap'd (no copy, see block_map_read), otherwise
+ * read into 'scratch'. Returns NULL on I/O error.
+ */
+static const void *block_get(int lba, void *scratch) {
+    const void *p = block_map_read(lba);
+    if (p != NULL) {
+        return p;
+    }
+    return block_read(scratch, lba, 1) < 0 ? NULL : scratch;
+}
+
 #define MAX_PATH_LEN 10
 #define MAX_NAME_LEN 27
 
@@ -60,9 +73,10 @@ int bit_test(unsigned char *map, int i) {
  * components is returned.
  */
 int parse(char *path, char **argv) {
+    char *save; // strtok_r: ops run on several FUSE threads at once
     int i;
     for (i = 0; i < MAX_PATH_LEN; i++) {
-        if ((argv[i] = strtok(path, "/")) == NULL)
+        if ((argv[i] = strtok_r(path, "/", &save)) == NULL)
             break;
         if (strlen(argv[i]) > MAX_NAME_LEN)
             argv[i][MAX_NAME_LEN] = 0;
@@ -71,73 +85,864 @@ int parse(char *path, char **argv) {
     return i;
 }
 
+static int disk_size; // in blocks, from the superblock
+static bool compact;  // inodes are in an inode table (see fs.h)
+static int ninodes;   // in the inode table
+
+static struct txn_map bitmap_bits; // the bitmap as committed (see txn_bits)
+
+/* blocks 'lba'..'lba'+'n'-1, just allocated, are part of operation
+ * 'tx'; if that can't be recorded they are given back. Returns 0 or
+ * -ENOMEM
+ */
+static int blocks_taken(struct txn *tx, int lba, int n) {
+    if (txn_bits(tx, &bitmap_bits, lba, n, 1) < 0) {
+        balloc_free(lba, n);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* blocks 'lba'..'lba'+'n'-1 are freed by operation 'tx': they can be
+ * allocated again once it has committed
+ */
+static void blocks_freed(struct txn *tx, int lba, int n) {
+    if (txn_bits(tx, &bitmap_bits, lba, n, 0) < 0) {
+        balloc_free(lba, n); // on disk they stay in use
+    }
+}
+
+/* allocation groups (see balloc.h): a file's blocks, and the blocks
+ * that map them, go in the group of its inode. In the compact format
+ * the inode table is split into as many equal parts as there are
+ * groups, one for each; an original-format inode is a block, so its
+ * group is the one it is in
+ */
+static int inode_group(int inum) {
+    if (compact) {
+        return (long)inum * balloc_groups() / ninodes;
+    }
+    return balloc_group(inum);
+}
+
+/* the group for a new directory: the next one round, spreading them
+ * (and the files in them) over the disk
+ */
+static int dir_group(void) {
+    static int next_group;
+    return __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED) % balloc_groups();
+}
+
+/* a number for a new inode in group 'group' (or the next one round
+ * with room), allocated as part of 'tx': a slot in the inode table, or
+ * in the original format a block to hold the inode. Returns -ENOSPC if
+ * there is none, or -ENOMEM
+ */
+static int inode_alloc(struct txn *tx, int group) {
+    if (compact) {
+        return ialloc(tx, group, balloc_groups());
+    }
+    int inum = balloc(group);
+    if (inum >= 0 && blocks_taken(tx, inum, 1) < 0) {
+        return -ENOMEM;
+    }
+    return inum;
+}
+
+/* give back inode 'inum' as part of 'tx' (a failed create, unlink or
+ * rmdir) and drop it from the inode cache
+ */
+static void inode_free(struct txn *tx, int inum) {
+    if (compact) {
+        ifree(tx, inum);
+        return;
+    }
+    iforget(inum);
+    blocks_freed(tx, inum, 1);
+}
+
+/* block map helpers (see bmap_append, bmap_truncate): blocks come from
+ * and go back to the bitmap as part of the operation passed in - for
+ * free_block in a 'struct freelist', which also gets each freed block
+ * for block_release if it has a list
+ */
+static int alloc_block(const struct inode *ip, void *arg) {
+    int lba = balloc(inode_group(ip->inum));
+    if (lba >= 0 && blocks_taken(arg, lba, 1) < 0) {
+        return -ENOMEM;
+    }
+    return lba;
+}
+
+struct freelist {
+    struct txn *tx;
+    int *lba;
+    int n;
+};
+
+static void free_block(uint32_t lba, void *arg) {
+    struct freelist *fl = arg;
+    blocks_freed(fl->tx, lba, 1);
+    if (fl->lba != NULL) {
+        fl->lba[fl->n++] = lba;
+    }
+}
+
+/* a list for the blocks 'ip' maps, its map blocks and one more (its own
+ * block in the original format). NULL if out of memory
+ */
+static int *freelist_alloc(const struct inode *ip) {
+    int nmap = ip->nblocks / FS_PTRS_PER_BLOCK + FS_NEXTENT + 2;
+    return malloc((ip->nblocks + nmap + 1) * sizeof(int));
+}
+
+/* add blocks to the end of file 'ip' until its map has 'n' - as one
+ * contiguous run if there is one, else as few as it takes, straight
+ * after its last block when there is room there - along with
+ * the map blocks that takes, as part of 'tx'. Returns 0, -ENOSPC,
+ * -EFBIG, -ENOMEM or -EIO; nothing is added on error
+ */
+static int grow(struct txn *tx, struct inode *ip, int n) {
+    int old = ip->nblocks, want = n - old, rv = 0;
+    if (want <= 0) {
+        return 0;
+    }
+
+    struct brun *runs = malloc(want * sizeof(*runs));
+    if (runs == NULL) {
+        return -ENOMEM;
+    }
+    int last = old > 0 ? (int)bmap(ip, old - 1, NULL) : 0;
+    int goal = last > 0 ? last + 1 : -1;
+    int nruns = balloc_bulk(want, goal, inode_group(ip->inum), runs);
+    if (nruns < 0) {
+        free(runs);
+        return nruns;
+    }
+    int i = 0;
+    while (i < nruns && rv == 0) {
+        rv = blocks_taken(tx, runs[i].lba, runs[i].len);
+        i++;
+    }
+    if (rv < 0) { // the run that failed went back already
+        for (int j = 0; j < nruns; j++) {
+            if (j < i - 1) {
+                blocks_freed(tx, runs[j].lba, runs[j].len);
+            } else if (j >= i) {
+                balloc_free(runs[j].lba, runs[j].len);
+            }
+        }
+        free(runs);
+        return rv;
+    }
+
+    struct freelist fl = {.tx = tx};
+    i = 0;
+    while (i < nruns && rv == 0) {
+        rv = bmap_append(ip, runs[i].lba, runs[i].len, alloc_block, tx);
+        i++;
+    }
+    if (rv < 0) {
+        bmap_truncate(ip, old, free_block, &fl); // whatever got mapped
+        for (i--; i < nruns; i++) {
+            blocks_freed(tx, runs[i].lba, runs[i].len);
+        }
+    }
+    free(runs);
+    return rv;
+}
+
+/* undo grow: 'ip' maps its first 'n' blocks again, the rest going back
+ * as part of 'tx'
+ */
+static void shrink(struct txn *tx, struct inode *ip, int n) {
+    struct freelist fl = {.tx = tx};
+    bmap_truncate(ip, n, free_block, &fl);
+}
+
+/* 'iov' entries moving blocks 'first'..'first'+'n'-1 of 'ip' to or from
+ * 'buf', one per run of them that is contiguous on disk. Returns how
+ * many ('iov' has room for 'n'), or -EIO if an indirect block can't be
+ * read
+ */
+static int map_iov(const struct inode *ip, int first, int n, char *buf,
+                   struct block_iov *iov) {
+    int niov = 0;
+    for (int i = 0; i < n; niov++) {
+        int run = n - i;
+        if ((iov[niov].lba = bmap(ip, first + i, &run)) == 0) {
+            return -EIO;
+        }
+        iov[niov].buf = buf + (size_t)i * BLOCK_SIZE;
+        iov[niov].nblks = run;
+        i += run;
+    }
+    return niov;
+}
+
+/* directories are hashed (linear hashing): a directory of n blocks has
+ * n buckets, and a name lives in block dir_bucket(dir_hash(name), n)
+ * of it (see fs.h). When the bucket a name belongs in is full, the
+ * directory grows by one block, which takes over part of one existing
+ * bucket - so lookup, insert and delete each touch a single directory
+ * block. One-block directories are the same in both formats; older
+ * images may also have multi-block directories in the original format,
+ * which are scanned in full until they fill up and get converted.
+ */
+static uint32_t dir_hash(const char *name) {
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+static int dir_nblocks(const struct inode *dp) {
+    int n = dp->size / BLOCK_SIZE;
+    return n > 0 ? n : 1;
+}
+
+static bool dir_hashed(const struct inode *dp) {
+    return (dp->flags & FS_DIR_HASHED) || dir_nblocks(dp) == 1;
+}
+
+static int dir_bucket(uint32_t h, int n) {
+    uint32_t m = 1;
+    while (m * 2 <= (uint32_t)n) {
+        m *= 2;
+    } // m <= n < 2m
+    uint32_t b = h & (2 * m - 1);
+    return b < (uint32_t)n ? b : h & (m - 1);
+}
+
+/* the directory blocks [*first, *last] that may hold 'name' */
+static void dir_span(const struct inode *dp, const char *name,
+                     int *first, int *last) {
+    if (dir_hashed(dp)) {
+        *first = *last = dir_bucket(dir_hash(name), dir_nblocks(dp));
+    } else {
+        *first = 0;
+        *last = dir_nblocks(dp) - 1;
+    }
+}
+
+/* find 'name' in directory 'dp'. Returns its inode number, -ENOENT,
+ * or -EIO
+ */
+static int dir_lookup(const struct inode *dp, const char *name) {
+    int first, last;
+    dir_span(dp, name, &first, &last);
+
+    for (int b = first; b <= last; b++) {
+        struct fs_dirent dirent_buf[128];
+        const struct fs_dirent *dirent = block_get(bmap(dp, b, NULL), dirent_buf);
+        if (dirent == NULL) {
+            fprintf(stderr, "Failed to read directory block %u\n", bmap(dp, b, NULL));
+            return -EIO;
+        }
+
+        int i = dirent_find(dirent, 128, name);
+        if (i >= 0) {
+            return dirent[i].inode;
+        }
+    }
+    return -ENOENT;
+}
+
+/* dir_lookup, through the dentry cache: 'dp' is locked by the caller
+ * (see op_get), so what the cache says is current
+ */
+static int dir_child(const struct inode *dp, const char *name) {
+    int inum = dcache_lookup(dp->inum, name);
+    if (inum == 0) {
+        inum = dir_lookup(dp, name);
+    }
+    return inum;
+}
+
+/* like dir_lookup, but read the block holding the entry into 'dirent'
+ * (as operation 'tx' has left it) and set *lba. Returns the entry's
+ * slot, -ENOENT or -EIO
+ */
+static int dir_find(struct txn *tx, const struct inode *dp, const char *name,
+                    struct fs_dirent *dirent, int *lba) {
+    int first, last;
+    dir_span(dp, name, &first, &last);
+
+    for (int b = first; b <= last; b++) {
+        *lba = bmap(dp, b, NULL);
+        if (txn_read(tx, dirent, *lba) < 0) {
+            fprintf(stderr, "Error reading directory entries\n");
+            return -EIO;
+        }
+        int i = dirent_find(dirent, 128, name);
+        if (i >= 0) {
+            return i;
+        }
+    }
+    return -ENOENT;
+}
+
+/* grow hashed directory 'dp' by one block, moving the entries of the
+ * bucket being split that now hash to the new block. Returns 0,
+ * -ENOSPC, -ENOMEM or -EIO
+ */
+static int dir_split(struct txn *tx, struct inode *dp) {
+    int n = dir_nblocks(dp);
+    int m = 1;
+    while (m * 2 <= n) {
+        m *= 2;
+    }
+    int src = n - m; // the bucket that block n takes entries from
+
+    struct freelist fl = {.tx = tx};
+    int lba = alloc_block(dp, tx);
+    if (lba < 0) {
+        return lba;
+    }
+    if (bmap_append(dp, lba, 1, alloc_block, tx) < 0) {
+        blocks_freed(tx, lba, 1);
+        bmap_truncate(dp, n, free_block, &fl);
+        return -ENOSPC;
+    }
+
+    struct fs_dirent old[128], new[128];
+    if (txn_read(tx, old, bmap(dp, src, NULL)) < 0) {
+        bmap_truncate(dp, n, free_block, &fl);
+        return -EIO;
+    }
+    memset(new, 0, sizeof(new));
+    for (int i = 0, j = 0; i < 128; i++) {
+        if (old[i].valid && dir_bucket(dir_hash(old[i].name), n + 1) == n) {
+            new[j++] = old[i];
+            memset(&old[i], 0, sizeof(old[i]));
+        }
+    }
+
+    struct block_iov iov[] = {
+        {.lba = lba, .buf = new, .nblks = 1},
+        {.lba = bmap(dp, src, NULL), .buf = old, .nblks = 1},
+    };
+    if (txn_add(tx, iov, 2) < 0) {
+        bmap_truncate(dp, n, free_block, &fl);
+        return -ENOMEM;
+    }
+
+    dp->size = (n + 1) * BLOCK_SIZE;
+    dp->flags |= FS_DIR_HASHED;
+    return txn_inode(tx, dp);
+}
+
+static int dir_add(struct txn *tx, struct inode *dp, const char *name, int inum);
+
+/* rewrite a full directory in the original format as a hashed one.
+ * Entries go to their bucket in the existing blocks; the ones that
+ * don't fit are added again afterwards, splitting buckets as needed.
+ * Returns 0, -ENOSPC, -ENOMEM or -EIO
+ */
+static int dir_convert(struct txn *tx, struct inode *dp) {
+    int n = dir_nblocks(dp);
+    struct fs_dirent *old = malloc((size_t)n * BLOCK_SIZE);
+    struct fs_dirent *new = calloc(n, BLOCK_SIZE);
+    struct block_iov *iov = malloc(n * sizeof(*iov));
+    int *used = calloc(n, sizeof(int));
+    int rv = 0, nspill = 0;
+
+    if (old == NULL || new == NULL || iov == NULL || used == NULL) {
+        rv = -ENOMEM;
+        goto out;
+    }
+
+    for (int b = 0; b < n; b++) {
+        iov[b].lba = bmap(dp, b, NULL);
+        iov[b].buf = old + b * 128;
+        iov[b].nblks = 1;
+    }
+    if (txn_preadv(tx, iov, n) < 0) {
+        rv = -EIO;
+        goto out;
+    }
+
+    /* entries that don't fit their bucket are collected at the front
+     * of 'old' (behind the read position, so nothing is overwritten)
+     */
+    for (int i = 0; i < n * 128; i++) {
+        if (!old[i].valid) {
+            continue;
+        }
+        int b = dir_bucket(dir_hash(old[i].name), n);
+        if (used[b] < 128) {
+            new[b * 128 + used[b]++] = old[i];
+        } else {
+            old[nspill++] = old[i];
+        }
+    }
+
+    for (int b = 0; b < n; b++) {
+        iov[b].buf = new + b * 128;
+    }
+    if (txn_add(tx, iov, n) < 0) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    dp->flags |= FS_DIR_HASHED;
+    if ((rv = txn_inode(tx, dp)) < 0) {
+        goto out;
+    }
+
+    for (int i = 0; i < nspill && rv == 0; i++) {
+        rv = dir_add(tx, dp, old[i].name, old[i].inode);
+    }
+
+out:
+    free(old);
+    free(new);
+    free(iov);
+    free(used);
+    return rv;
+}
+
+/* add 'name' -> 'inum' to directory 'dp'. Returns 0, -ENOSPC,
+ * -ENOMEM or -EIO
+ */
+static int dir_add(struct txn *tx, struct inode *dp, const char *name, int inum) {
+    struct fs_dirent dirent[128];
+
+    for (;;) {
+        int first, last;
+        dir_span(dp, name, &first, &last);
+
+        for (int b = first; b <= last; b++) {
+            int lba = bmap(dp, b, NULL);
+            if (txn_read(tx, dirent, lba) < 0) {
+                fprintf(stderr, "Error reading directory entries\n");
+                return -EIO;
+            }
+
+            for (int i = 0; i < 128; i++) {
+                if (dirent[i].valid) {
+                    continue;
+                }
+                dirent[i].valid = true;
+                dirent[i].inode = inum;
+                strncpy(dirent[i].name, name, sizeof(dirent[i].name) - 1);
+                dirent[i].name[sizeof(dirent[i].name) - 1] = '\0';
+
+                struct block_iov iov = {.lba = lba, .buf = dirent, .nblks = 1};
+                return txn_add(tx, &iov, 1) < 0 ? -ENOMEM : 0;
+            }
+        }
+
+        // no room: grow the bucket, or switch to the hashed format
+        int rv = dir_hashed(dp) ? dir_split(tx, dp) : dir_convert(tx, dp);
+        if (rv < 0) {
+            fprintf(stderr, "Directory is full\n");
+            return rv;
+        }
+    }
+}
+
+/* remove 'name' from directory 'dp'. Returns the inode number it
+ * referred to, -ENOENT, -ENOMEM or -EIO
+ */
+static int dir_remove(struct txn *tx, struct inode *dp, const char *name) {
+    struct fs_dirent dirent[128];
+    int lba;
+    int slot = dir_find(tx, dp, name, dirent, &lba);
+    if (slot < 0) {
+        return slot;
+    }
+
+    int inum = dirent[slot].inode;
+    dirent[slot].valid = 0;
+    struct block_iov iov = {.lba = lba, .buf = dirent, .nblks = 1};
+    if (txn_add(tx, &iov, 1) < 0) {
+        return -ENOMEM;
+    }
+    return inum;
+}
+
+/* rename 'from' to 'to' within directory 'dp' - in place, unless the
+ * new name belongs in a different bucket. Returns 0, -ENOENT, -ENOSPC,
+ * -ENOMEM or -EIO
+ */
+static int dir_rename(struct txn *tx, struct inode *dp, const char *from, const char *to) {
+    int n = dir_nblocks(dp);
+    if (!dir_hashed(dp) ||
+        dir_bucket(dir_hash(from), n) == dir_bucket(dir_hash(to), n)) {
+        struct fs_dirent dirent[128];
+        int lba;
+        int slot = dir_find(tx, dp, from, dirent, &lba);
+        if (slot < 0) {
+            return slot;
+        }
+        strncpy(dirent[slot].name, to, MAX_NAME_LEN);
+        dirent[slot].name[MAX_NAME_LEN] = '\0';
+        struct block_iov iov = {.lba = lba, .buf = dirent, .nblks = 1};
+        return txn_add(tx, &iov, 1) < 0 ? -ENOMEM : 0;
+    }
+
+    int inum = dir_remove(tx, dp, from);
+    if (inum < 0) {
+        return inum;
+    }
+    int rv = dir_add(tx, dp, to, inum);
+    if (rv < 0 && dir_add(tx, dp, from, inum) < 0) {
+        fprintf(stderr, "Lost directory entry %s -> %d\n", from, inum);
+    }
+    return rv;
+}
+
+/* the inode 'inum' locked for reading (see ilock), or NULL with
+ * '*err' set: -EIO, or -ENOENT if it has been freed. Given back with
+ * read_put
+ */
+static struct inode *read_get(int inum, int *err) {
+    struct inode *ip = iget(inum);
+    if (ip == NULL) {
+        fprintf(stderr, "Error reading inode %d\n", inum);
+        *err = -EIO;
+        return NULL;
+    }
+    ilock_shared(ip);
+    if (ip->gone) {
+        iunlock(ip);
+        iput(ip);
+        *err = -ENOENT;
+        return NULL;
+    }
+    return ip;
+}
+
+static void read_put(struct inode *ip) {
+    iunlock(ip);
+    iput(ip);
+}
+
 /*
  * translate - translate a path into an inode number. The path is
  * assumed to be absolute, and the first component is the root
- * directory.
+ * directory. Paths and single directory entries that have been looked
+ * up before come out of the dentry cache. Each directory is looked in
+ * with it locked, so an entry is never cached after it was removed.
  */
 int translate(int pathc, char **pathv) {
     int inum = 2; // root inode
-    struct fs_inode inode;
+    int inums[MAX_PATH_LEN];
 
     if (pathc == 0) {
         return inum; // no path components, return root inode
     }
 
+    int cached = dcache_path(pathc, pathv);
+    if (cached > 0) {
+        return cached;
+    }
+    unsigned long gen = dcache_generation();
+
     for (int i = 0; i < pathc; i++) {
-        if (block_read(&inode, inum, 1) < 0) {
-            fprintf(stderr, "Error reading inode %d\n", inum);
-            return -EIO;
+        int err;
+        struct inode *inode = read_get(inum, &err);
+        if (inode == NULL) {
+            return err;
         }
 
-        if (!S_ISDIR(inode.mode)) {
+        if (!S_ISDIR(inode->mode)) {
             fprintf(stderr, "Not a directory: %s\n", pathv[i]);
+            read_put(inode);
             return -ENOTDIR;
         }
 
-        struct fs_dirent dirent[128];
-        if (block_read(dirent, inode.ptrs[0], 1) < 0) {
-            fprintf(stderr, "Failed to read directory block %u for inode %d\n", inode.ptrs[0], inum);
-            return -EIO;
-        } // read the directory entries
-
-        bool found = false;
-        for (int j = 0; j < 128; j++) {
-            if (dirent[j].valid && strcmp(pathv[i], dirent[j].name) == 0) {
-                inum = dirent[j].inode;
-                found = true;
-                break;
-            } // check if the name matches between the directory entry and the path
-        } // loop through the directory entries
-
-        if (!found) {
-            fprintf(stderr, "File not found: %s\n", pathv[i]);
+        int dir = inum;
+        int child = dcache_lookup(dir, pathv[i]);
+        if (child == -ENOENT) {
+            read_put(inode);
             return -ENOENT;
         }
+        if (child > 0) {
+            read_put(inode);
+            inum = inums[i] = child;
+            continue;
+        }
+
+        inum = dir_lookup(inode, pathv[i]);
+        if (inum == -ENOENT) {
+            dcache_add(dir, pathv[i], 0);
+        } else if (inum >= 0) {
+            dcache_add(dir, pathv[i], inum);
+        }
+        read_put(inode);
+        if (inum < 0) {
+            return inum;
+        }
+        inums[i] = inum;
     }
 
+    dcache_add_path(pathc, pathv, inums, gen);
     return inum;
 }
 
 // factored out inode-to-struct stat conversion
 int inode_to_stat(int inum, struct stat *sb) {
-    struct fs_inode inode;
-    if (block_read(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error reading inode %d\n", inum);
-        return -EIO;
+    int err;
+    struct inode *inode = read_get(inum, &err);
+    if (inode == NULL) {
+        return err;
     }
 
     memset(sb, 0, sizeof(struct stat));
-    sb->st_mode = inode.mode;
+    sb->st_mode = inode->mode;
     sb->st_nlink = 1;
-    sb->st_uid = inode.uid;
-    sb->st_gid = inode.gid;
-    sb->st_size = inode.size;
-    sb->st_mtime = inode.mtime;
-    sb->st_ctime = inode.ctime;
-    sb->st_atime = inode.mtime;
-    sb->st_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    sb->st_uid = inode->uid;
+    sb->st_gid = inode->gid;
+    sb->st_size = inode->size;
+    sb->st_mtime = inode->mtime;
+    sb->st_ctime = inode->ctime;
+    sb->st_atime = inode->mtime;
+    sb->st_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    read_put(inode);
+    return 0;
+}
+
+/* mkfs - write an empty file system to a blank 'nblks' block device:
+ * superblock, bitmap (as many blocks as 'nblks' needs), the inode
+ * table bitmap and inode table (one
+ * inode per two blocks), and a root directory (inode 2) with one empty
+ * directory block. Returns 0, -ENOMEM or -EIO.
+ */
+int fs_mkfs(int nblks) {
+    struct fs_super sb;
+
+    int nmap = FS_BITMAP_BLOCKS(nblks);
+    int ninodes = DIV_ROUND_UP(nblks / 2, FS_INODES_PER_BLOCK) * FS_INODES_PER_BLOCK;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = FS_MAGIC;
+    sb.disk_size = nblks;
+    sb.imap_start = 1 + nmap;
+    sb.imap_blocks = DIV_ROUND_UP(ninodes, BLOCK_SIZE * 8);
+    sb.itab_start = sb.imap_start + sb.imap_blocks;
+    sb.itab_blocks = ninodes / FS_INODES_PER_BLOCK;
+    int root_dir = sb.itab_start + sb.itab_blocks;
+    sb.free_blocks = nblks - root_dir - 1;
+    sb.free_inodes = ninodes - 3;
+
+    unsigned char *map = calloc(nmap, BLOCK_SIZE);
+    unsigned char *imap = calloc(sb.imap_blocks, BLOCK_SIZE);
+    struct fs_cinode *itab = calloc(sb.itab_blocks, BLOCK_SIZE);
+    if (map == NULL || imap == NULL || itab == NULL) {
+        free(map);
+        free(imap);
+        free(itab);
+        return -ENOMEM;
+    }
+    for (int i = 0; i <= root_dir; i++) {
+        bit_set(map, i);
+    }
+    for (int i = 0; i <= 2; i++) {
+        bit_set(imap, i); // 0 and 1 are never used
+    }
+
+    struct fs_cinode *root = &itab[2];
+    root->uid = getuid();
+    root->gid = getgid();
+    root->mode = S_IFDIR | 0777;
+    root->ctime = root->mtime = time(NULL);
+    root->size = BLOCK_SIZE;
+    root->ptrs[0] = root_dir;
+
+    char dir[BLOCK_SIZE];
+    memset(dir, 0, sizeof(dir));
+
+    /* block 0 can't go through block_pwritev */
+    struct block_iov iov[] = {
+        {.lba = 1, .buf = map, .nblks = nmap},
+        {.lba = sb.imap_start, .buf = imap, .nblks = sb.imap_blocks},
+        {.lba = sb.itab_start, .buf = itab, .nblks = sb.itab_blocks},
+        {.lba = root_dir, .buf = dir, .nblks = 1},
+    };
+    int rv = 0;
+    if (block_pwritev(iov, 4) < 0 || block_write_super(&sb) < 0) {
+        fprintf(stderr, "Error formatting device\n");
+        rv = -EIO;
+    }
+    free(map);
+    free(imap);
+    free(itab);
+    return rv;
+}
+
+/* block checksums (-csum): an image that has a checksum region is
+ * always verified; with want_csum set, an image without one gets it
+ * at mount time
+ */
+static int want_csum;
+
+void fs_set_csum(int on) {
+    want_csum = on;
+}
+
+/* files created on compact images map extents unless this is cleared,
+ * in which case they use block pointers (for comparing the two)
+ */
+static int want_extents = 1;
+
+void fs_set_extents(int on) {
+    want_extents = on;
+}
+
+/* metadata journal (-journal): like checksums, an image that has one
+ * always uses it, and with want_journal set one without gets it at
+ * mount time
+ */
+static int want_journal;
+
+void fs_set_journal(int on) {
+    want_journal = on;
+}
+
+/* a write operation: 'tx' collects the metadata blocks it changes
+ * (see txn.h), and with the journal on they are one journal operation
+ */
+static void op_begin(struct txn *tx) {
+    block_op_begin();
+    txn_begin(tx);
+}
+
+/* end an operation started with op_begin, writing its blocks and the
+ * bitmap bits it changed: its result 'rv', or -EIO if its metadata
+ * couldn't be committed. What it freed is only handed back once the
+ * journal has it (see txn_end).
+ * A failed operation is committed too: it undoes what it can't keep
+ * (fs_write gives back the blocks it added), and what it keeps - a
+ * directory split before the add that needed it failed - has to reach
+ * the image with the blocks it allocated
+ */
+static int op_end(struct txn *tx, int rv) {
+    int err = txn_commit(tx) < 0;
+    int jerr = block_op_end() < 0;
+    txn_end(tx, !jerr);
+    if ((err || jerr) && rv >= 0) {
+        fprintf(stderr, "Error committing metadata\n");
+        return -EIO;
+    }
+    return rv;
+}
+
+/* the inode 'inum', locked by the operation 'tx' until it ends (see
+ * txn_lock), or NULL with '*err' set: -EIO, -ENOMEM, or -ENOENT if it
+ * has been freed
+ */
+static struct inode *op_get(struct txn *tx, int inum, int *err) {
+    struct inode *ip = iget(inum);
+    if (ip == NULL) {
+        fprintf(stderr, "Error reading inode %d\n", inum);
+        *err = -EIO;
+        return NULL;
+    }
+    int rv = txn_lock(tx, ip);
+    if (rv < 0) {
+        *err = rv;
+        return NULL;
+    }
+    return ip;
+}
+
+/* give an image without a checksum region one (want_csum) */
+static void csum_setup(void) {
+    struct fs_super sb;
+
+    if (!want_csum) {
+        return;
+    }
+    if (block_read(&sb, 0, 1) < 0) {
+        fprintf(stderr, "Error reading superblock\n");
+        return;
+    }
+    if (sb.csum_start != 0) {
+        return;
+    }
 
+    int n = DIV_ROUND_UP(sb.disk_size, FS_BLOCK_SIZE / sizeof(uint32_t));
+    int start = balloc_run(n);
+    if (start < 0) {
+        fprintf(stderr, "No room for %d checksum blocks\n", n);
+        return;
+    }
+    sb.csum_start = start;
+    sb.csum_blocks = n;
+    struct txn tx;
+    op_begin(&tx);
+    int rv = blocks_taken(&tx, start, n);
+    if (op_end(&tx, rv) < 0 || block_write_super(&sb) < 0) {
+        fprintf(stderr, "Error recording checksum region\n");
+        return;
+    }
+    block_csum_init(start, n, 1);
+}
+
+/* give an image without a journal one (want_journal): 1/64 of the
+ * disk, between 256KB and 32MB
+ */
+static void journal_setup(void) {
+    struct fs_super sb;
+
+    if (!want_journal) {
+        return;
+    }
+    if (block_read(&sb, 0, 1) < 0) {
+        fprintf(stderr, "Error reading superblock\n");
+        return;
+    }
+    if (sb.journal_start != 0) {
+        return;
+    }
+
+    int n = disk_size / 64;
+    if (n < 64) {
+        n = 64;
+    }
+    if (n > 8192) {
+        n = 8192;
+    }
+    int start = balloc_run(n);
+    if (start < 0) {
+        fprintf(stderr, "No room for %d journal blocks\n", n);
+        return;
+    }
+    sb.journal_start = start;
+    sb.journal_blocks = n;
+    struct txn tx;
+    op_begin(&tx);
+    int rv = blocks_taken(&tx, start, n);
+    if (op_end(&tx, rv) < 0 || block_write_super(&sb) < 0) {
+        fprintf(stderr, "Error recording journal region\n");
+        return;
+    }
+    block_journal_init(start, n, 1);
+}
+
+/* bring the superblock's free counts up to date with the in-memory
+ * ones (writing it only if they differ)
+ */
+static int super_update(void) {
+    struct fs_super sb;
+    int ifree;
+
+    if (block_read(&sb, 0, 1) < 0) {
+        fprintf(stderr, "Error reading superblock\n");
+        return -EIO;
+    }
+    itable_size(&ifree);
+    if (sb.free_blocks == balloc_count() && sb.free_inodes == ifree) {
+        return 0;
+    }
+    sb.free_blocks = balloc_count();
+    sb.free_inodes = ifree;
+    if (block_write_super(&sb) < 0) {
+        fprintf(stderr, "Error writing superblock\n");
+        return -EIO;
+    }
     return 0;
 }
 
@@ -148,10 +953,57 @@ int inode_to_stat(int inum, struct stat *sb) {
  *   - allocate memory, read bitmaps and inodes
  */
 void *fs_init(struct fuse_conn_info *conn) {
-    if (block_read(bitmap, 1, 1) < 0) {
+    struct fs_super sb;
+    if (block_read(&sb, 0, 1) < 0) {
+        fprintf(stderr, "Error reading superblock\n");
+        return NULL;
+    }
+    disk_size = sb.disk_size;
+    compact = sb.itab_start != 0;
+    ninodes = sb.itab_blocks * FS_INODES_PER_BLOCK;
+
+    /* checksums first: replaying the journal writes blocks */
+    if (sb.csum_start != 0) {
+        block_csum_init(sb.csum_start, sb.csum_blocks, 0);
+    }
+    if (sb.journal_start != 0) {
+        int n = block_journal_init(sb.journal_start, sb.journal_blocks, 0);
+        if (n < 0) {
+            return NULL;
+        }
+        if (n > 0) {
+            fprintf(stderr, "replayed %d journal records\n", n);
+        }
+    }
+
+    int nmap = FS_BITMAP_BLOCKS(disk_size);
+    if (nmap != bitmap_blocks) {
+        free(bitmap);
+        bitmap_blocks = 0;
+        if ((bitmap = malloc((size_t)nmap * BLOCK_SIZE)) == NULL) {
+            fprintf(stderr, "Out of memory for the block bitmap\n");
+            return NULL;
+        }
+        bitmap_blocks = nmap;
+    }
+    if (block_read(bitmap, 1, nmap) < 0) {
         fprintf(stderr, "Error reading block bitmap\n");
         return NULL;
     }
+    if (balloc_init(bitmap, disk_size, 2 + nmap) < 0 ||
+        txn_map_init(&bitmap_bits, 1, nmap, bitmap, balloc_free) < 0) {
+        fprintf(stderr, "Out of memory indexing free blocks\n");
+        return NULL;
+    }
+    ra_reset();
+    if (icache_init(&sb) < 0) { /* inodes are loaded as they are used */
+        fprintf(stderr, "Error reading inode table bitmap\n");
+        return NULL;
+    }
+    dcache_reset();
+    csum_setup();
+    journal_setup();
+    super_update(); /* counts from an image not cleanly unmounted */
     return NULL;
 }
 
@@ -230,42 +1082,51 @@ int fs_readdir(const char *c_path, void *ptr, fuse_fill_dir_t filler,
         return inum;
     }
 
-    struct fs_inode inode; // inode of the directory
-    if (block_read(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error reading inode %d\n", inum);
-        return -EIO;
-    } // read the inode of the directory
+    int rv;
+    struct inode *inode = read_get(inum, &rv); // inode of the directory
+    if (inode == NULL) {
+        return rv;
+    } // locked, so no entry goes away while it is listed
 
-    if (!S_ISDIR(inode.mode)) {
+    if (!S_ISDIR(inode->mode)) {
         fprintf(stderr, "Not a directory: %s\n", c_path);
+        read_put(inode);
         return -ENOTDIR;
     } // check if the inode is a directory
 
-    struct fs_dirent dirent[128]; // directory entries
-    if (block_read(dirent, inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error reading directory entries\n");
-        return -EIO;
-    } // read the directory entries
-
-    // loop through the directory entries and call the filler function
-    for (int i = 0; i < 128; i++) {
-        if (!dirent[i].valid) {
-            continue;
-        }
+    // loop through the entries of every directory block and call the
+    // filler function
+    rv = 0;
+    for (int b = 0; b < dir_nblocks(inode); b++) {
+        struct fs_dirent dirent_buf[128]; // directory entries
+        const struct fs_dirent *dirent = block_get(bmap(inode, b, NULL), dirent_buf);
+        if (dirent == NULL) {
+            fprintf(stderr, "Error reading directory entries\n");
+            rv = -EIO;
+            goto out;
+        } // read the directory entries
 
-        struct stat sb;
-        if (inode_to_stat(dirent[i].inode, &sb) < 0) {
-            fprintf(stderr, "Error converting inode to stat\n");
-            return -EIO;
-        }
+        for (int i = 0; i < 128; i++) {
+            if (!dirent[i].valid) {
+                continue;
+            }
 
+            struct stat sb;
+            if (inode_to_stat(dirent[i].inode, &sb) < 0) {
+                fprintf(stderr, "Error converting inode to stat\n");
+                rv = -EIO;
+                goto out;
+            }
 
-        if (filler(ptr, dirent[i].name, &sb, 0) != 0) {
-            break; // STOP if buffer is full
+            if (filler(ptr, dirent[i].name, &sb, 0) != 0) {
+                goto out; // STOP if buffer is full
+            }
         }
     }
 
-    return 0;
+out:
+    read_put(inode);
+    return rv;
 }
 
 /* create - create a new file with specified permissions
@@ -282,7 +1143,7 @@ int fs_readdir(const char *c_path, void *ptr, fuse_fill_dir_t filler,
  * If there are already 128 entries in the directory (i.e. it's filled an
  * entire block), you are free to return -ENOSPC instead of expanding it.
  */
-int fs_create(const char *c_path, mode_t mode, struct fuse_file_info *fi) {
+int fs_create(struct txn *tx, const char *c_path, mode_t mode, struct fuse_file_info *fi) {
     char *path = strdup(c_path);
     char *pathv[MAX_PATH_LEN];
     int pathc = parse(path, pathv);
@@ -311,96 +1172,75 @@ int fs_create(const char *c_path, mode_t mode, struct fuse_file_info *fi) {
         parent_inum = 2;
     }
 
-    struct fs_inode parent_inode;
-    if (block_read(&parent_inode, parent_inum, 1) < 0) {
-        fprintf(stderr, "Error reading parent inode %d\n", parent_inum);
+    int err;
+    struct inode *parent_inode = op_get(tx, parent_inum, &err);
+    if (parent_inode == NULL) {
         free(path);
-        return -EIO;
+        return err;
     }
 
-    if (!S_ISDIR(parent_inode.mode)) {
+    if (!S_ISDIR(parent_inode->mode)) {
         fprintf(stderr, "Not a directory: %s\n", c_path);
         free(path);
         return -ENOTDIR;
     }
 
-    if (translate(pathc, pathv) >= 0) {
+    /* the name must not exist yet. The dentry cache usually knows;
+     * if not, its directory block is checked
+     */
+    int existing = dir_child(parent_inode, pathv[pathc - 1]);
+    if (existing >= 0) {
         fprintf(stderr, "File already exists: %s\n", c_path);
         free(path);
         return -EEXIST;
     }
-
-    int block_num = -1;
-    for (int i = 3; i < MAX_BLOCKS; i++) {
-        if (!bit_test(bitmap, i)) {
-            block_num = i;
-            bit_set(bitmap, block_num);
-            break;
-        }
-    }
-
-    if (block_num < 0) {
-        fprintf(stderr, "No free blocks available\n");
+    if (existing != -ENOENT) {
         free(path);
-        return -ENOSPC;
+        return existing;
     }
 
-    struct fs_inode new_inode;
-    memset(&new_inode, 0, sizeof(struct fs_inode));
-    memset(new_inode.ptrs, 0, sizeof(new_inode.ptrs));
-    new_inode.uid = getuid();
-    new_inode.gid = getgid();
-    new_inode.mode = mode;
-    new_inode.size = 0;
-    new_inode.mtime = time(NULL);
-    new_inode.ctime = new_inode.mtime;
-    new_inode.ptrs[0] = block_num;
-
-    if (block_write(&new_inode, block_num, 1) < 0) {
-        fprintf(stderr, "Error writing new inode\n");
+    int inum = inode_alloc(tx, inode_group(parent_inum));
+    if (inum < 0) {
+        fprintf(stderr, "No free inodes available\n");
         free(path);
-        return -EIO;
+        return inum;
     }
 
-    if (block_write(bitmap, 1, 1) < 0) {
-        fprintf(stderr, "Error writing bitmap\n");
-        free(path);
-        return -EIO;
-    } // looks like bitmap has to be written into disk from memory
-
-    struct fs_dirent dirent[128];
-    if (block_read(dirent, parent_inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error reading directory entries\n");
+    struct inode *ip = inew(inum, mode);
+    if (ip == NULL || txn_lock(tx, ip) < 0) {
+        inode_free(tx, inum);
         free(path);
-        return -EIO;
+        return -ENOMEM;
     }
-
-    bool found = false;
-    for (int i = 0; i < 128; i++) {
-        if (!dirent[i].valid) {
-            dirent[i].valid = true;
-            dirent[i].inode = block_num;
-            strncpy(dirent[i].name, pathv[pathc - 1], sizeof(dirent[i].name) - 1);
-            dirent[i].name[sizeof(dirent[i].name) - 1] = '\0'; // use sizeof(dirent[i].name) instead of MAX_NAME_LEN
-            found = true;
-            break;
-        }
+    ip->uid = getuid();
+    ip->gid = getgid();
+    ip->size = 0;
+    ip->mtime = time(NULL);
+    ip->ctime = ip->mtime;
+    if (compact && want_extents) {
+        ip->flags |= FS_EXTENTS; // files map extents in the compact format
     }
-
-    if (!found) {
-        fprintf(stderr, "Directory is full\n");
+    if (S_ISREG(mode) && inline_begin(ip) < 0) { // data in the inode until it outgrows it
+        inode_free(tx, inum);
         free(path);
-        return -ENOSPC;
+        return -ENOMEM;
     }
 
-    if (block_write(dirent, parent_inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error writing directory entries\n");
+    /* new inode, bitmap and parent directory block go out together
+     * when the operation ends
+     */
+    int rv = dir_add(tx, parent_inode, pathv[pathc - 1], inum);
+    if (rv < 0) {
+        fprintf(stderr, "Error writing new inode %d\n", inum);
+        inode_free(tx, inum);
         free(path);
-        return -EIO;
+        return rv;
     }
+    dcache_add(parent_inum, pathv[pathc - 1], inum);
+    rv = txn_inode(tx, ip);
 
     free(path);
-    return 0;
+    return rv;
 }
 
 /* mkdir - create a directory with the given mode.
@@ -412,7 +1252,7 @@ int fs_create(const char *c_path, mode_t mode, struct fuse_file_info *fi) {
  * Errors - path resolution, EEXIST
  * Conditions for EEXIST are the same as for create. 
  */
-int fs_mkdir(const char *c_path, mode_t mode) {
+int fs_mkdir(struct txn *tx, const char *c_path, mode_t mode) {
     char *path = strdup(c_path);
     char *pathv[MAX_PATH_LEN];
     int pathc = parse(path, pathv);
@@ -420,139 +1260,104 @@ int fs_mkdir(const char *c_path, mode_t mode) {
     if (pathc < 1) {
         fprintf(stderr, "Invalid path: %s\n", c_path);
         free(path);
-        return -ENOENT;
-    }
-
-    if (strlen(pathv[pathc - 1]) >= MAX_NAME_LEN) {
-        fprintf(stderr, "Name too long: %s\n", pathv[pathc - 1]);
-        free(path);
-        return -EINVAL;
-    }
-
-    int parent_inum;
-    if (pathc > 1) {
-        parent_inum = translate(pathc - 1, pathv);
-        if (parent_inum < 0) {
-            fprintf(stderr, "Error translating path: %s\n", c_path);
-            free(path);
-            return parent_inum;
-        }
-    } else {
-        parent_inum = 2;
-    }
-
-    if (translate(pathc, pathv) >= 0) {
-        fprintf(stderr, "File already exists: %s\n", c_path);
-        free(path);
-        return -EEXIST;
-    }
-
-    int block_num = -1;
-    for (int i = 3; i < MAX_BLOCKS; i++) {
-        if (!bit_test(bitmap, i)) {
-            block_num = i;
-            bit_set(bitmap, block_num);
-            break;
-        }
-    }
-
-    if (block_num < 0) {
-        fprintf(stderr, "No free blocks available\n");
-        free(path);
-        return -ENOSPC;
-    }
-
-    struct fs_inode new_dir_inode;
-    memset(&new_dir_inode, 0, sizeof(struct fs_inode));
-    new_dir_inode.uid = getuid();
-    new_dir_inode.gid = getgid();
-    new_dir_inode.mode = mode | S_IFDIR;
-    new_dir_inode.ctime = time(NULL);
-    new_dir_inode.mtime = new_dir_inode.ctime;
-    new_dir_inode.size = BLOCK_SIZE;
-
-    int dir_block_num = -1;
-    for (int i = 3; i < MAX_BLOCKS; i++) {
-        if (!bit_test(bitmap, i)) {
-            dir_block_num = i;
-            bit_set(bitmap, dir_block_num);
-            break;
-        }
-    }
-
-    if (dir_block_num < 0) {
-        fprintf(stderr, "No free blocks available for directory\n");
-        free(path);
-        return -ENOSPC;
+        return -ENOENT;
     }
 
-    struct fs_dirent empty_dirent[128] = {0};
-    if (block_write(empty_dirent, dir_block_num, 1) < 0) {
-        fprintf(stderr, "Error initializing new directory block\n");
+    if (strlen(pathv[pathc - 1]) >= MAX_NAME_LEN) {
+        fprintf(stderr, "Name too long: %s\n", pathv[pathc - 1]);
         free(path);
-        return -EIO;
+        return -EINVAL;
     }
 
-    new_dir_inode.ptrs[0] = dir_block_num;
+    int parent_inum;
+    if (pathc > 1) {
+        parent_inum = translate(pathc - 1, pathv);
+        if (parent_inum < 0) {
+            fprintf(stderr, "Error translating path: %s\n", c_path);
+            free(path);
+            return parent_inum;
+        }
+    } else {
+        parent_inum = 2;
+    }
 
-    if (block_write(&new_dir_inode, block_num, 1) < 0) {
-        fprintf(stderr, "Error writing new directory inode\n");
+    int err;
+    struct inode *parent_inode = op_get(tx, parent_inum, &err);
+    if (parent_inode == NULL) {
         free(path);
-        return -EIO;
+        return err;
     }
 
-    if (block_write(bitmap, 1, 1) < 0) {
-        fprintf(stderr, "Error writing bitmap\n");
+    if (!S_ISDIR(parent_inode->mode)) {
+        fprintf(stderr, "Parent is not a directory: %s\n", pathv[pathc - 2]);
         free(path);
-        return -EIO;
+        return -ENOTDIR;
     }
 
-    struct fs_inode parent_inode;
-    if (block_read(&parent_inode, parent_inum, 1) < 0) {
-        fprintf(stderr, "Error reading parent inode %d\n", parent_inum);
+    /* the name must not exist yet. The dentry cache usually knows;
+     * if not, its directory block is checked
+     */
+    int existing = dir_child(parent_inode, pathv[pathc - 1]);
+    if (existing >= 0) {
+        fprintf(stderr, "File already exists: %s\n", c_path);
         free(path);
-        return -EIO;
+        return -EEXIST;
     }
-
-    if (!S_ISDIR(parent_inode.mode)) {
-        fprintf(stderr, "Parent is not a directory: %s\n", pathv[pathc - 2]);
+    if (existing != -ENOENT) {
         free(path);
-        return -ENOTDIR;
+        return existing;
     }
 
-    struct fs_dirent dirent[128];
-    if (block_read(dirent, parent_inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error reading directory entries\n");
+    int inum = inode_alloc(tx, dir_group());
+    if (inum < 0) {
+        fprintf(stderr, "No free inodes available\n");
         free(path);
-        return -EIO;
+        return inum;
     }
 
-    bool found = false;
-    for (int i = 0; i < 128; i++) {
-        if (!dirent[i].valid) {
-            dirent[i].valid = true;
-            dirent[i].inode = block_num;
-            strncpy(dirent[i].name, pathv[pathc - 1], sizeof(dirent[i].name) - 1);
-            dirent[i].name[sizeof(dirent[i].name) - 1] = '\0';
-            found = true;
-            break;
-        }
+    int dir_block_num = balloc(inode_group(inum));
+    if (dir_block_num < 0 || blocks_taken(tx, dir_block_num, 1) < 0) {
+        fprintf(stderr, "No free blocks available for directory\n");
+        inode_free(tx, inum);
+        free(path);
+        return dir_block_num < 0 ? -ENOSPC : -ENOMEM;
     }
 
-    if (!found) {
-        fprintf(stderr, "Directory is full\n");
+    struct inode *ip = inew(inum, mode | S_IFDIR);
+    if (ip == NULL || txn_lock(tx, ip) < 0) {
+        inode_free(tx, inum);
+        blocks_freed(tx, dir_block_num, 1);
         free(path);
-        return -ENOSPC;
+        return -ENOMEM;
     }
+    ip->uid = getuid();
+    ip->gid = getgid();
+    ip->ctime = time(NULL);
+    ip->mtime = ip->ctime;
+    ip->size = BLOCK_SIZE;
+    bmap_append(ip, dir_block_num, 1, alloc_block, tx); // room for one is made by inew
 
-    if (block_write(dirent, parent_inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error writing directory entries\n");
+    struct fs_dirent empty_dirent[128] = {0};
+
+    /* empty directory block, new inode, bitmap(s) and parent directory
+     * block go out together when the operation ends
+     */
+    struct block_iov iov = {.lba = dir_block_num, .buf = empty_dirent, .nblks = 1};
+    int rv = txn_add(tx, &iov, 1) < 0
+                 ? -ENOMEM
+                 : dir_add(tx, parent_inode, pathv[pathc - 1], inum);
+    if (rv < 0) {
+        fprintf(stderr, "Error writing new directory inode %d\n", inum);
+        inode_free(tx, inum);
+        blocks_freed(tx, dir_block_num, 1);
         free(path);
-        return -EIO;
+        return rv;
     }
+    dcache_add(parent_inum, pathv[pathc - 1], inum);
+    rv = txn_inode(tx, ip);
 
     free(path);
-    return 0;
+    return rv;
 }
 
 
@@ -560,7 +1365,7 @@ int fs_mkdir(const char *c_path, mode_t mode) {
  *  success - return 0
  *  errors - path resolution, ENOENT, EISDIR
  */
-int fs_unlink(const char *c_path) {
+int fs_unlink(struct txn *tx, const char *c_path) {
     char *path = strdup(c_path);
     char *pathv[MAX_PATH_LEN];
     int pathc = parse(path, pathv);
@@ -583,79 +1388,66 @@ int fs_unlink(const char *c_path) {
         parent_inum = 2;
     }
 
-    struct fs_inode parent_inode;
-    if (block_read(&parent_inode, parent_inum, 1) < 0) {
+    int err;
+    struct inode *parent_inode = op_get(tx, parent_inum, &err);
+    if (parent_inode == NULL) {
         free(path);
-        return -EIO;
+        return err;
     }
 
-    if (!S_ISDIR(parent_inode.mode)) {
+    if (!S_ISDIR(parent_inode->mode)) {
         fprintf(stderr, "Not a directory: %s\n", c_path);
         free(path);
         return -ENOTDIR;
     }
 
-    int file_inum = translate(pathc, pathv);
+    int file_inum = dir_child(parent_inode, pathv[pathc - 1]);
     if (file_inum < 0) {
-        fprintf(stderr, "Error translating path: %s\n", c_path);
+        fprintf(stderr, "File not found: %s\n", c_path);
         free(path);
-        return -ENOENT;
+        return file_inum;
     }
 
-    struct fs_inode file_inode;
-    if (block_read(&file_inode, file_inum, 1) < 0) {
-        fprintf(stderr, "Error reading file inode %d\n", file_inum);
+    struct inode *file_inode = op_get(tx, file_inum, &err);
+    if (file_inode == NULL) {
         free(path);
-        return -EIO;
+        return err;
     }
 
-    if (S_ISDIR(file_inode.mode)) {
+    if (S_ISDIR(file_inode->mode)) {
         fprintf(stderr, "Not a file: %s\n", c_path);
         free(path);
         return -EISDIR;
     }
 
-    struct fs_dirent dirent[128];
-    if (block_read(dirent, parent_inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error reading directory entries\n");
-        free(path);
-        return -EIO;
-    }
-
-    bool removed = false;
-    for (int i = 0; i < 128; i++) {
-        if (dirent[i].valid && dirent[i].inode == file_inum) {
-            dirent[i].valid = 0;
-            removed = true;
-            break;
-        }
-    }
-
-    if (!removed) {
+    int removed = dir_remove(tx, parent_inode, pathv[pathc - 1]);
+    if (removed < 0) {
         fprintf(stderr, "File not found: %s\n", c_path);
         free(path);
-        return -ENOENT;
-    }
-
-    if (block_write(dirent, parent_inode.ptrs[0], 1) < 0) {
-        free(path);
-        return -EIO;
+        return removed;
     }
+    dcache_remove(parent_inum, pathv[pathc - 1], file_inum);
 
-    int block_num = (file_inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE; // calculate the number of blocks used by the file
-    for (int i = 0; i < block_num; i++) {
-        if (file_inode.ptrs[i] > 0 && file_inode.ptrs[i] < MAX_BLOCKS)
-            bit_clear(bitmap, file_inode.ptrs[i]); // clear the bitmap for each block used by the file
+    // clear the bitmap for every block of the file and of its map
+    struct freelist freed = {.tx = tx, .lba = freelist_alloc(file_inode)};
+    bmap_truncate(file_inode, 0, free_block, &freed);
+    if (!compact && freed.lba != NULL) {
+        freed.lba[freed.n++] = file_inum; // the inode's own block
     }
 
-    bit_clear(bitmap, file_inum); // clear the bitmap for the inode itself
+    // free the inode itself; the block bitmap and (compact format) the
+    // inode table bitmap go out after the directory block, and the
+    // blocks are released after that
+    inode_free(tx, file_inum);
+    ra_forget(file_inum);
 
-    if (block_write(bitmap, 1, 1) < 0) {
-        fprintf(stderr, "Error writing bitmap\n");
+    if (txn_release(tx, freed.lba, freed.n) < 0) {
+        free(freed.lba);
         free(path);
-        return -EIO;
+        return -ENOMEM;
     }
 
+    free(freed.lba);
     free(path);
     return 0;
 }
@@ -664,7 +1456,7 @@ int fs_unlink(const char *c_path) {
  *  success - return 0
  *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
  */
-int fs_rmdir(const char *c_path) {
+int fs_rmdir(struct txn *tx, const char *c_path) {
     char *path = strdup(c_path);
     char *pathv[MAX_PATH_LEN];
     int pathc = parse(path, pathv);
@@ -691,38 +1483,54 @@ int fs_rmdir(const char *c_path) {
         parent_inum = 2;
     }
 
-    int dir_inum = translate(pathc, pathv);
+    int err;
+    struct inode *parent_inode = op_get(tx, parent_inum, &err);
+    if (parent_inode == NULL) {
+        free(path);
+        return err;
+    }
+
+    if (!S_ISDIR(parent_inode->mode)) {
+        fprintf(stderr, "Not a directory: %s\n", c_path);
+        free(path);
+        return -ENOTDIR;
+    }
+
+    int dir_inum = dir_child(parent_inode, pathv[pathc - 1]);
     if (dir_inum < 0) {
-        fprintf(stderr, "Error translating path: %s\n", c_path);
+        fprintf(stderr, "Directory not found: %s\n", c_path);
         free(path);
         return dir_inum;
     }
 
-    struct fs_inode dir_inode;
-    if (block_read(&dir_inode, dir_inum, 1) < 0) {
-        fprintf(stderr, "Error reading directory inode %d\n", dir_inum);
+    struct inode *dir_inode = op_get(tx, dir_inum, &err);
+    if (dir_inode == NULL) {
         free(path);
-        return -EIO;
+        return err;
     }
 
-    if (!S_ISDIR(dir_inode.mode)) {
+    if (!S_ISDIR(dir_inode->mode)) {
         fprintf(stderr, "Not a directory: %s\n", c_path);
         free(path);
         return -ENOTDIR;
     }
 
-    struct fs_dirent dirent[128];
-    if (block_read(dirent, dir_inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error reading directory entries\n");
-        free(path);
-        return -EIO;
-    }
-
+    int nblocks = dir_nblocks(dir_inode);
     bool empty = true;
-    for (int i = 0; i < 128; i++) {
-        if (dirent[i].valid) {
-            empty = false;
-            break;
+    for (int b = 0; b < nblocks && empty; b++) {
+        struct fs_dirent dirent_buf[128];
+        const struct fs_dirent *dirent = block_get(bmap(dir_inode, b, NULL), dirent_buf);
+        if (dirent == NULL) {
+            fprintf(stderr, "Error reading directory entries\n");
+            free(path);
+            return -EIO;
+        }
+
+        for (int i = 0; i < 128; i++) {
+            if (dirent[i].valid) {
+                empty = false;
+                break;
+            }
         }
     }
 
@@ -732,52 +1540,32 @@ int fs_rmdir(const char *c_path) {
         return -ENOTEMPTY;
     }
 
-    struct fs_inode parent_inode;
-    if (block_read(&parent_inode, parent_inum, 1) < 0) {
-        free(path);
-        return -EIO;
-    }
-
-    printf("Root inode mode: %o\n", parent_inode.mode);
+    printf("Root inode mode: %o\n", parent_inode->mode);
 
-    struct fs_dirent parent_dirent[128];
-    if (block_read(parent_dirent, parent_inode.ptrs[0], 1) < 0) {
-        free(path);
-        return -EIO;
-    }
-
-    bool removed = false;
-    for (int i = 0; i < 128; i++) {
-        if (parent_dirent[i].valid &&
-            strcmp(parent_dirent[i].name, pathv[pathc - 1]) == 0) {
-            parent_dirent[i].valid = 0;
-            removed = true;
-            break;
-        }
-    }
-
-    if (!removed) {
+    int removed = dir_remove(tx, parent_inode, pathv[pathc - 1]);
+    if (removed < 0) {
         fprintf(stderr, "Directory not found: %s\n", c_path);
         free(path);
-        return -ENOENT;
+        return removed;
     }
+    dcache_remove(parent_inum, pathv[pathc - 1], dir_inum);
 
-    if (block_write(parent_dirent, parent_inode.ptrs[0], 1) < 0) {
-        fprintf(stderr, "Error writing parent directory entries\n");
-        free(path);
-        return -EIO;
+    // clear the bitmap for the directory blocks
+    struct freelist freed = {.tx = tx, .lba = freelist_alloc(dir_inode)};
+    bmap_truncate(dir_inode, 0, free_block, &freed);
+    if (!compact && freed.lba != NULL) {
+        freed.lba[freed.n++] = dir_inum; // the inode's own block
     }
 
-    bit_clear(bitmap, dir_inode.ptrs[0]); // clear the bitmap for the directory block
-
-    bit_clear(bitmap, dir_inum); // clear the bitmap for the inode itself
+    inode_free(tx, dir_inum);
 
-    if (block_write(bitmap, 1, 1) < 0) {
-        fprintf(stderr, "Error writing bitmap\n");
+    if (txn_release(tx, freed.lba, freed.n) < 0) {
+        free(freed.lba);
         free(path);
-        return -EIO;
+        return -ENOMEM;
     }
 
+    free(freed.lba);
     free(path);
     return 0;
 }
@@ -795,7 +1583,7 @@ int fs_rmdir(const char *c_path) {
  * particular, the full version can move across directories, replace a
  * destination file, and replace an empty directory with a full one.
  */
-int fs_rename(const char *src_path, const char *dst_path) {
+int fs_rename(struct txn *tx, const char *src_path, const char *dst_path) {
     char *src = strdup(src_path);
     char *dst = strdup(dst_path);
 
@@ -820,58 +1608,45 @@ int fs_rename(const char *src_path, const char *dst_path) {
         return parent_inum;
     }
 
-    struct fs_inode parent_inode;
-    if (block_read(&parent_inode, parent_inum, 1) < 0) {
+    int err;
+    struct inode *parent_inode = op_get(tx, parent_inum, &err);
+    if (parent_inode == NULL) {
         free(src);
         free(dst);
-        fprintf(stderr, "Error reading parent inode %d\n", parent_inum);
-        return -EIO;
+        return err;
     }
 
-    struct fs_dirent dirent[128];
-    if (block_read(&dirent, parent_inode.ptrs[0], 1) < 0) {
+    int src_inum = dir_lookup(parent_inode, srcv[src_pathc - 1]);
+    int dst_inum = dir_lookup(parent_inode, dstv[dst_pathc - 1]);
+    if (src_inum == -EIO || dst_inum == -EIO) {
         free(src);
         free(dst);
         fprintf(stderr, "Error reading directory entries\n");
         return -EIO;
     }
 
-    bool found_src = false;
-    bool found_dst = false;
-    int src_idx = -1;
-
-    for (int i = 0; i < 128; i++) {
-        if (dirent[i].valid && strcmp(srcv[src_pathc - 1], dirent[i].name) == 0) {
-            found_src = true;
-            src_idx = i;
-        }
-        if (dirent[i].valid && strcmp(dstv[dst_pathc - 1], dirent[i].name) == 0) {
-            found_dst = true;
-        }
-    }
-
-    if (!found_src) {
+    if (src_inum < 0) {
         free(src);
         free(dst);
         fprintf(stderr, "Source file not found: %s\n", srcv[src_pathc - 1]);
         return -ENOENT;
     }
-    if (found_dst) {
+    if (dst_inum >= 0) {
         free(src);
         free(dst);
         fprintf(stderr, "Destination file already exists: %s\n", dstv[dst_pathc - 1]);
         return -EEXIST;
     }
 
-    strncpy(dirent[src_idx].name, dstv[dst_pathc - 1], MAX_NAME_LEN);
-    dirent[src_idx].name[MAX_NAME_LEN] = '\0';
-
-    if (block_write(&dirent, parent_inode.ptrs[0], 1) < 0) {
+    int rv = dir_rename(tx, parent_inode, srcv[src_pathc - 1], dstv[dst_pathc - 1]);
+    if (rv < 0) {
         free(src);
         free(dst);
         fprintf(stderr, "Error writing directory entries\n");
-        return -EIO;
+        return rv;
     }
+    dcache_remove(parent_inum, srcv[src_pathc - 1], src_inum);
+    dcache_add(parent_inum, dstv[dst_pathc - 1], src_inum);
 
     free(src);
     free(dst);
@@ -885,7 +1660,7 @@ int fs_rename(const char *src_path, const char *dst_path) {
  * success - return 0
  * Errors - path resolution, ENOENT.
  */
-int fs_chmod(const char *c_path, mode_t mode) {
+int fs_chmod(struct txn *tx, const char *c_path, mode_t mode) {
     char *path = strdup(c_path);
     char *pathv[MAX_PATH_LEN];
     int pathc = parse(path, pathv);
@@ -896,20 +1671,15 @@ int fs_chmod(const char *c_path, mode_t mode) {
         return inum;
     }
 
-    struct fs_inode inode;
-    if (block_read(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error reading inode %d\n", inum);
-        return -EIO;
+    int err;
+    struct inode *inode = op_get(tx, inum, &err);
+    if (inode == NULL) {
+        return err;
     }
 
-    inode.mode = (inode.mode & S_IFMT) | (mode & ~S_IFMT);
-
-    if (block_write(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error writing inode %d\n", inum);
-        return -EIO;
-    }
+    inode->mode = (inode->mode & S_IFMT) | (mode & ~S_IFMT);
 
-    return 0;
+    return txn_inode(tx, inode);
 }
 
 /* utime - change access and modification times
@@ -917,7 +1687,7 @@ int fs_chmod(const char *c_path, mode_t mode) {
  * Errors - path resolution, ENOENT
  *          EINVAL if the file is a directory.
  */
-int fs_utime(const char *c_path, struct utimbuf *ut) {
+int fs_utime(struct txn *tx, const char *c_path, struct utimbuf *ut) {
     char *path = strdup(c_path);
     char *pathv[MAX_PATH_LEN];
     int pathc = parse(path, pathv);
@@ -928,21 +1698,16 @@ int fs_utime(const char *c_path, struct utimbuf *ut) {
         return inum;
     }
 
-    struct fs_inode inode;
-    if (block_read(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error reading inode %d\n", inum);
-        return -EIO;
+    int err;
+    struct inode *inode = op_get(tx, inum, &err);
+    if (inode == NULL) {
+        return err;
     }
 
-    inode.mtime = ut->modtime;
-    inode.ctime = ut->actime;
-
-    if (block_write(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error writing inode %d\n", inum);
-        return -EIO;
-    }
+    inode->mtime = ut->modtime;
+    inode->ctime = ut->actime;
 
-    return 0;
+    return txn_inode(tx, inode);
 }
 
 /* truncate - truncate file to exactly 'len' bytes
@@ -950,7 +1715,7 @@ int fs_utime(const char *c_path, struct utimbuf *ut) {
  * Errors - path resolution, ENOENT, EISDIR, EINVAL
  *    return EINVAL if len > 0.
  */
-int fs_truncate(const char *c_path, off_t len) {
+int fs_truncate(struct txn *tx, const char *c_path, off_t len) {
     /* you can cheat by only implementing this for the case of len==0,
      * and an error otherwise.
      */
@@ -967,43 +1732,129 @@ int fs_truncate(const char *c_path, off_t len) {
         return inum;
     }
 
-    struct fs_inode inode;
-    if (block_read(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error reading inode %d\n", inum);
-        return -EIO;
+    int err;
+    struct inode *inode = op_get(tx, inum, &err);
+    if (inode == NULL) {
+        return err;
     }
 
-    if (S_ISDIR(inode.mode)) {
+    if (S_ISDIR(inode->mode)) {
         fprintf(stderr, "Not a file: %s\n", c_path);
         return -EISDIR;
     }
 
-    int block_num = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    for (int i = 0; i < block_num; i++) {
-        bit_clear(bitmap, inode.ptrs[i]);
+    struct freelist freed = {.tx = tx, .lba = freelist_alloc(inode)};
+    bmap_truncate(inode, 0, free_block, &freed);
+
+    /* empty again, so it can go back to keeping its data inline */
+    if (inode->flags & FS_INLINE) {
+        memset(inode->data, 0, inode->size);
+    } else {
+        inline_begin(inode); // stays block mapped if out of memory
     }
+    inode->size = 0;
+    ra_forget(inum);
 
-    if (block_write(bitmap, 1, 1) < 0) {
-        fprintf(stderr, "Error writing bitmap\n");
-        return -EIO;
+    /* the blocks are released once the operation has ended */
+    int rv = txn_inode(tx, inode);
+    if (rv == 0 && txn_release(tx, freed.lba, freed.n) < 0) {
+        rv = -ENOMEM;
     }
 
-    inode.size = 0;
-    memset(inode.ptrs, 0, sizeof(inode.ptrs));
+    free(freed.lba);
+    return rv;
+}
 
-    if (block_write(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error writing inode %d\n", inum);
-        return -EIO;
+/* fs_read for the file 'inode', locked */
+static int file_read(const struct inode *inode, char *buf, size_t len, off_t offset) {
+    int inum = inode->inum;
+
+    if (offset >= inode->size) {
+        return -EINVAL;
+    }
+
+    size_t bytes_to_read = len;
+    if (offset + len > inode->size) {
+        bytes_to_read = inode->size - offset;
+    }
+
+    /* small file: the data came in with the inode */
+    if (inode->flags & FS_INLINE) {
+        memcpy(buf, inode->data + offset, bytes_to_read);
+        return bytes_to_read;
+    }
+
+    int first = offset / BLOCK_SIZE;
+    int nblks = (offset + bytes_to_read - 1) / BLOCK_SIZE - first + 1;
+
+    /* mmap'd image: copy straight from the mapping into the caller's
+     * buffer, no bounce buffer and no system calls - one memcpy per
+     * run of blocks that are contiguous on disk (unless checksums are
+     * on: then each block is read and verified)
+     */
+    if (block_map_read(0) != NULL) {
+        size_t bytes_read = 0;
+        int block_offset = offset % BLOCK_SIZE;
+
+        for (int i = 0; i < nblks;) {
+            int run = nblks - i;
+            uint32_t lba = bmap(inode, first + i, &run);
+            const char *data = lba != 0 ? block_map_read(lba) : NULL;
+            if (data == NULL || block_map_read(lba + run - 1) == NULL) {
+                fprintf(stderr, "Error reading block %u\n", lba);
+                return -EIO;
+            }
+
+            size_t bytes_to_copy = (size_t)run * BLOCK_SIZE - block_offset;
+            if (bytes_read + bytes_to_copy > bytes_to_read) {
+                bytes_to_copy = bytes_to_read - bytes_read;
+            } // adjust for partial read
+
+            memcpy(buf + bytes_read, data + block_offset, bytes_to_copy);
+            bytes_read += bytes_to_copy;
+            i += run;
+            block_offset = 0;
+        }
+        return bytes_read;
+    }
+
+    /* fetch every block the request touches with one vectored read,
+     * one entry per run of blocks that are contiguous on disk. If the
+     * file is being read sequentially, the blocks after it are read
+     * into the cache in the same request.
+     */
+    int ra_start, ahead[RA_MAX_BLOCKS];
+    int nahead = ra_update(inum, first, nblks,
+                           DIV_ROUND_UP(inode->size, BLOCK_SIZE), &ra_start);
+    for (int i = 0; i < nahead; i++) {
+        ahead[i] = bmap(inode, ra_start + i, NULL);
+    }
+
+    char *file_buf = malloc((size_t)nblks * BLOCK_SIZE);
+    struct block_iov *iov = malloc(nblks * sizeof(*iov));
+    if (file_buf == NULL || iov == NULL) {
+        fprintf(stderr, "Error allocating memory\n");
+        free(file_buf);
+        free(iov);
+        return -ENOMEM;
     }
 
-    if (block_write(bitmap, 1, 1) < 0) {
-        fprintf(stderr, "Error writing bitmap\n");
+    int niov = map_iov(inode, first, nblks, file_buf, iov);
+
+    if (niov < 0 || block_preadv_ahead(iov, niov, ahead, nahead) < 0) {
+        fprintf(stderr, "Error reading blocks %d..%d of inode %d\n",
+                first, first + nblks - 1, inum);
+        free(file_buf);
+        free(iov);
         return -EIO;
     }
 
-    return 0;
-}
+    memcpy(buf, file_buf + offset % BLOCK_SIZE, bytes_to_read);
 
+    free(file_buf);
+    free(iov);
+    return bytes_to_read;
+}
 
 /* read - read data from an open file.
  * success: should return exactly the number of bytes requested, except:
@@ -1024,57 +1875,21 @@ int fs_read(const char *c_path, char *buf, size_t len, off_t offset,
         return inum;
     }
 
-    struct fs_inode inode;
-    if (block_read(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error reading inode %d\n", inum);
-        return -EIO;
+    int rv;
+    struct inode *inode = read_get(inum, &rv);
+    if (inode == NULL) {
+        return rv;
     }
 
-    if (S_ISDIR(inode.mode)) {
+    if (S_ISDIR(inode->mode)) {
         fprintf(stderr, "Not a file: %s\n", c_path);
-        return -EISDIR;
-    }
-
-    if (offset >= inode.size) {
-        return -EINVAL;
-    }
-
-    size_t bytes_to_read = len;
-    if (offset + len > inode.size) {
-        bytes_to_read = inode.size - offset;
-    }
-
-    char *file_buf = malloc(BLOCK_SIZE);
-    if (file_buf == NULL) {
-        fprintf(stderr, "Error allocating memory\n");
-        return -ENOMEM;
-    }
-
-    int block_num = offset / BLOCK_SIZE;
-    int block_offset = offset % BLOCK_SIZE;
-    size_t bytes_read = 0;
-
-    while (bytes_read < bytes_to_read) {
-
-        if (block_read(file_buf, inode.ptrs[block_num], 1) < 0) {
-            fprintf(stderr, "Error reading block %d\n", inode.ptrs[block_num]);
-            free(file_buf);
-            return -EIO;
-        }
-
-        size_t bytes_to_copy = BLOCK_SIZE - block_offset;
-        if (bytes_read + bytes_to_copy > bytes_to_read) {
-            bytes_to_copy = bytes_to_read - bytes_read;
-        } // adjust for partial read
-
-        memcpy(buf + bytes_read, file_buf + block_offset, bytes_to_copy);
-        bytes_read += bytes_to_copy;
-        block_num++;
-        block_offset = 0;
+        rv = -EISDIR;
+    } else {
+        rv = file_read(inode, buf, len, offset);
     }
 
-    free(file_buf);
-    return bytes_read;
+    read_put(inode);
+    return rv;
 }
 
 /* write - write data to a file
@@ -1085,7 +1900,7 @@ int fs_read(const char *c_path, char *buf, size_t len, off_t offset,
  *  (POSIX semantics support the creation of files with "holes" in them, 
  *   but we don't)
  */
-int fs_write(const char *c_path, const char *buf, size_t len,
+int fs_write(struct txn *tx, const char *c_path, const char *buf, size_t len,
              off_t offset, struct fuse_file_info *fi) {
     char *path = strdup(c_path);
     char *pathv[MAX_PATH_LEN];
@@ -1097,76 +1912,130 @@ int fs_write(const char *c_path, const char *buf, size_t len,
         return inum;
     }
 
-    struct fs_inode inode;
-    if (block_read(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error reading inode %d\n", inum);
-        return -EIO;
+    int err;
+    struct inode *inode = op_get(tx, inum, &err);
+    if (inode == NULL) {
+        return err;
     }
 
-    if (S_ISDIR(inode.mode)) {
+    if (S_ISDIR(inode->mode)) {
         return -EISDIR;
     }
 
-    if (offset > inode.size) {
+    if (offset > inode->size) {
         return -EINVAL;
     }
 
+    if (len == 0) {
+        return 0;
+    }
+    if (offset + len > INT32_MAX - BLOCK_SIZE) {
+        return -EFBIG; // sizes are 32 bits
+    }
+
     int end_offset = offset + len;
     int needed_blocks = (end_offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int current_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    for (int i = current_blocks; i < needed_blocks; i++) {
-        for (int j = 0; j < MAX_BLOCKS; j++) {
-            if (!bit_test(bitmap, j)) {
-                bit_set(bitmap, j);
-                inode.ptrs[i] = j;
-                block_write(bitmap, 1, 1);
-                break;
-            }
-        }
-    } // allocate new blocks if needed
+    int current_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-    int block_num = offset / BLOCK_SIZE;
-    int block_offset = offset % BLOCK_SIZE;
-    size_t bytes_written = 0;
+    /* a small file's data stays in its inode until a write makes it
+     * too big; then it moves to the file's first block along with that
+     * write (offset <= size, so the write covers block 0)
+     */
+    bool moving = (inode->flags & FS_INLINE) != 0;
+    if (moving && end_offset <= inline_max()) {
+        memcpy(inode->data + offset, buf, len);
+        if (end_offset > inode->size) {
+            inode->size = end_offset;
+        }
+        int rv = txn_inode(tx, inode);
+        return rv < 0 ? rv : (int)len;
+    }
+    if (moving) {
+        current_blocks = 0; // nothing to read back
+    }
 
-    while (bytes_written < len) {
-        char *file_buf = malloc(BLOCK_SIZE);
+    int old_blocks = inode->nblocks;
+    int rv = grow(tx, inode, needed_blocks);
+    if (rv < 0) {
+        return rv;
+    }
 
-        if (block_read(file_buf, inode.ptrs[block_num], 1) < 0) {
-            fprintf(stderr, "Error reading block %d\n", inode.ptrs[block_num]);
-            free(file_buf);
-            return -EIO;
-        }
+    int first = offset / BLOCK_SIZE;
+    int nblks = needed_blocks - first;
 
-        size_t bytes_to_copy = BLOCK_SIZE - block_offset;
-        if (bytes_written + bytes_to_copy > len) {
-            bytes_to_copy = len - bytes_written;
-        } // adjust for partial write
+    char *file_buf = malloc((size_t)nblks * BLOCK_SIZE);
+    struct block_iov *iov = malloc(nblks * sizeof(*iov));
+    if (file_buf == NULL || iov == NULL) {
+        fprintf(stderr, "Error allocating memory\n");
+        free(file_buf);
+        free(iov);
+        shrink(tx, inode, old_blocks);
+        return -ENOMEM;
+    }
 
-        memcpy(file_buf + block_offset, buf + bytes_written, bytes_to_copy);
+    int niov = map_iov(inode, first, nblks, file_buf, iov);
 
-        if (block_write(file_buf, inode.ptrs[block_num], 1) < 0) {
-            fprintf(stderr, "Error writing block %d\n", inode.ptrs[block_num]);
-            free(file_buf);
-            return -EIO;
+    /* read-modify-write: only a partially covered first or last
+     * block needs its old contents, everything in between is
+     * overwritten completely. Blocks allocated just now have no old
+     * contents - they start out as zeroes without a read.
+     */
+    struct block_iov edge[2];
+    int nedge = 0;
+    char *last_buf = file_buf + (size_t)(nblks - 1) * BLOCK_SIZE;
+    if (offset % BLOCK_SIZE != 0) {
+        if (first < current_blocks) {
+            edge[nedge++] = (struct block_iov){
+                .lba = bmap(inode, first, NULL), .buf = file_buf, .nblks = 1};
+        } else {
+            memset(file_buf, 0, BLOCK_SIZE);
         }
+    }
+    if (end_offset % BLOCK_SIZE != 0 && (nblks > 1 || nedge == 0)) {
+        if (first + nblks - 1 < current_blocks) {
+            edge[nedge++] = (struct block_iov){
+                .lba = bmap(inode, first + nblks - 1, NULL), .buf = last_buf, .nblks = 1};
+        } else {
+            memset(last_buf, 0, BLOCK_SIZE);
+        }
+    }
 
-        bytes_written += bytes_to_copy;
-        block_num++;
-        block_offset = 0;
-    } // similar to fs_read, but writing instead of reading
+    if (niov < 0 || (nedge > 0 && block_preadv(edge, nedge) < 0)) {
+        fprintf(stderr, "Error reading blocks of inode %d\n", inum);
+        free(file_buf);
+        free(iov);
+        shrink(tx, inode, old_blocks);
+        return -EIO;
+    }
 
-    if (offset + len > inode.size) {
-        inode.size = offset + len;
+    if (moving) {
+        memcpy(file_buf, inode->data, inode->size);
     }
+    memcpy(file_buf + offset % BLOCK_SIZE, buf, len);
 
-    if (block_write(&inode, inum, 1) < 0) {
-        fprintf(stderr, "Error writing inode %d\n", inum);
+    /* the file is as it was if the data can't be written: the blocks
+     * just added go back, and inline data stays in the inode
+     */
+    if (block_pwritev(iov, niov) < 0) {
+        fprintf(stderr, "Error writing blocks of inode %d\n", inum);
+        free(file_buf);
+        free(iov);
+        shrink(tx, inode, old_blocks);
         return -EIO;
     }
 
-    return bytes_written;
+    free(file_buf);
+    free(iov);
+    if (moving) {
+        inline_end(inode);
+    }
+
+    if (offset + len > inode->size) {
+        inode->size = offset + len;
+    }
+
+    rv = txn_inode(tx, inode);
+    return rv < 0 ? rv : (int)len;
 }
 
 /* statfs - get file system statistics
@@ -1181,52 +2050,131 @@ int fs_statfs(const char *path, struct statvfs *st) {
      *   f_bavail = f_bfree
      *   f_namemax = <whatever your max namelength is>
      *
-     * it's OK to calculate this dynamically on the rare occasions
-     * when this function is called.
+     * df and the like call this often, so it doesn't touch the disk:
+     * the free counts are kept in memory as blocks and inodes are
+     * allocated and freed.
      */
 
     memset(st, 0, sizeof(struct statvfs));
-    struct fs_super sb;
-    if (block_read(&sb, 0, 1) < 0) {
-        fprintf(stderr, "Error reading superblock\n");
-        return -EIO;
-    }
-    int disk_size = sb.disk_size;
     st->f_bsize = BLOCK_SIZE;
-    st->f_blocks = disk_size - 2;
+    st->f_blocks = disk_size - 1 - FS_BITMAP_BLOCKS(disk_size);
 
-    int used = 0;
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (bit_test(bitmap, i)) {
-            used++;
-        }
-    }
-    printf("Used blocks: %d\n", used);
-
-    st->f_bfree = st->f_blocks - (used - 2);
+    int nfree = balloc_count();
+    st->f_bfree = nfree;
     st->f_bavail = st->f_bfree;
     st->f_namemax = MAX_NAME_LEN;
 
+    st->f_files = itable_size(&nfree);
+    st->f_ffree = nfree;
+    st->f_favail = nfree;
+
     return 0;
 }
 
+/* fsync - make everything written so far durable. Dirty blocks are
+ * not tracked per file, so this flushes the whole cache and syncs the
+ * image.
+ */
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    return block_flush(1);
+}
+
+/* flush - called on every close(); hand dirty blocks to the image
+ * file so they are visible to anything reading it, without waiting
+ * for them to reach the disk
+ */
+int fs_flush(const char *path, struct fuse_file_info *fi) {
+    return block_flush(0);
+}
+
+/* destroy - called at unmount; leaves the free counts in the
+ * superblock for tools reading the image
+ */
+void fs_destroy(void *private_data) {
+    super_update();
+    block_exit();
+}
+
+/* the write operations each run as one transaction (see op_begin): a
+ * metadata block is written once however often the operation changes
+ * it, and with the journal on their changes reach the image together
+ * or not at all
+ */
+static int op_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_create(&tx, path, mode, fi));
+}
+
+static int op_mkdir(const char *path, mode_t mode) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_mkdir(&tx, path, mode));
+}
+
+static int op_unlink(const char *path) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_unlink(&tx, path));
+}
+
+static int op_rmdir(const char *path) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_rmdir(&tx, path));
+}
+
+static int op_rename(const char *src_path, const char *dst_path) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_rename(&tx, src_path, dst_path));
+}
+
+static int op_chmod(const char *path, mode_t mode) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_chmod(&tx, path, mode));
+}
+
+static int op_utime(const char *path, struct utimbuf *ut) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_utime(&tx, path, ut));
+}
+
+static int op_truncate(const char *path, off_t len) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_truncate(&tx, path, len));
+}
+
+static int op_write(const char *path, const char *buf, size_t len,
+                    off_t offset, struct fuse_file_info *fi) {
+    struct txn tx;
+    op_begin(&tx);
+    return op_end(&tx, fs_write(&tx, path, buf, len, offset, fi));
+}
+
 /* operations vector. Please don't rename it, or else you'll break things
  */
 struct fuse_operations fs_ops = {
         .init = fs_init,            /* read-mostly operations */
         .getattr = fs_getattr,
         .readdir = fs_readdir,
-        .rename = fs_rename,
-        .chmod = fs_chmod,
+        .rename = op_rename,
+        .chmod = op_chmod,
         .read = fs_read,
         .statfs = fs_statfs,
 
-        .create = fs_create,        /* write operations */
-        .mkdir = fs_mkdir,
-        .unlink = fs_unlink,
-        .rmdir = fs_rmdir,
-        .utime = fs_utime,
-        .truncate = fs_truncate,
-        .write = fs_write,
+        .create = op_create,        /* write operations */
+        .mkdir = op_mkdir,
+        .unlink = op_unlink,
+        .rmdir = op_rmdir,
+        .utime = op_utime,
+        .truncate = op_truncate,
+        .write = op_write,
+        .fsync = fs_fsync,
+        .flush = fs_flush,
+        .destroy = fs_destroy,
 };
 
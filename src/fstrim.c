@@ -0,0 +1,100 @@
+/*
+ * file:        fstrim.c
+ * description: offline trim. Discards every block the bitmap marks
+ *              free, so the image file only keeps host storage for
+ *              blocks the file system uses. Run on an unmounted image.
+ *
+ *  usage: ./fstrim [-v] disk.img
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "../include/fs.h"
+#include "../include/block.h"
+
+static int bit_test(const unsigned char *map, int i)
+{
+    return map[i / 8] & (1 << (i % 8));
+}
+
+int main(int argc, char **argv)
+{
+    struct fs_super sb;
+    int verbose = 0, nranges = 0;
+    long trimmed = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        verbose = 1;
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s [-v] disk.img\n", argv[0]);
+        exit(1);
+    }
+
+    block_init(argv[1]);
+    if (block_read(&sb, 0, 1) < 0) {
+        fprintf(stderr, "%s: cannot read superblock\n", argv[1]);
+        exit(1);
+    }
+    if (sb.magic != FS_MAGIC) {
+        fprintf(stderr, "%s: not a file system image\n", argv[1]);
+        exit(1);
+    }
+    if (sb.csum_start != 0 &&
+        block_csum_init(sb.csum_start, sb.csum_blocks, 0) < 0)
+        exit(1);
+    /* the bitmap may have changes still in the journal */
+    if (sb.journal_start != 0 &&
+        block_journal_init(sb.journal_start, sb.journal_blocks, 0) < 0)
+        exit(1);
+    int nmap = FS_BITMAP_BLOCKS(sb.disk_size);
+    unsigned char *bitmap = malloc((size_t)nmap * FS_BLOCK_SIZE);
+    if (bitmap == NULL || block_read(bitmap, 1, nmap) < 0) {
+        fprintf(stderr, "%s: cannot read bitmap\n", argv[1]);
+        exit(1);
+    }
+
+    int nblks = sb.disk_size;
+    for (int i = 1 + nmap; i < nblks; ) {
+        if (bit_test(bitmap, i)) {
+            i++;
+            continue;
+        }
+        int j = i;
+        while (j < nblks && !bit_test(bitmap, j))
+            j++;
+
+        int rv = block_discard(i, j - i);
+        if (rv == -EOPNOTSUPP) {
+            fprintf(stderr, "%s: discard not supported by the host file system\n",
+                    argv[1]);
+            exit(1);
+        }
+        if (rv < 0) {
+            fprintf(stderr, "%s: discard of blocks %d-%d failed\n", argv[1], i, j - 1);
+            exit(1);
+        }
+        if (verbose)
+            printf("blocks %d-%d\n", i, j - 1);
+        trimmed += j - i;
+        nranges++;
+        i = j;
+    }
+
+    if (block_flush(1) < 0) {
+        fprintf(stderr, "%s: sync failed\n", argv[1]);
+        exit(1);
+    }
+    printf("%s: %ld bytes (%ld blocks) trimmed in %d ranges\n", argv[1],
+           trimmed * FS_BLOCK_SIZE, trimmed, nranges);
+    free(bitmap);
+    return 0;
+}
@@ -8,35 +8,88 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #include <fuse.h>
 
 #include "../include/fs.h"
-
-extern void block_init(char *file);
+#include "../include/block.h"
 
 /* All homework functions are accessed through the operations
  * structure.  
  */
 extern struct fuse_operations fs_ops;
+extern int fs_mkfs(int nblks);
+extern void fs_set_csum(int on);
+extern void fs_set_journal(int on);
 
 struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   uring;
+    int   mmap;
+    int   cache_mb;
+    char *durability;
+    int   flush_secs;
+    int   ram;
+    int   ram_blocks;
+    int   checkpoint;
+    int   csum;
+    int   scrub_kbs;
+    int   discard;
+    int   journal;
 } _data;
 
+#define URING_DEPTH 64
+#define DEFAULT_CACHE_MB 16
+#define DEFAULT_FLUSH_SECS 5
+
 /**************/
 
 /*
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img directory
+ *  usage: ./homework -image disk.img [-uring] [-mmap] [-cache MB]
+ *                    [-durability sync|periodic|lazy] [-flush SECS]
+ *                    [-ram [-blocks N] [-checkpoint]] [-csum [-scrub KB/s]]
+ *                    [-discard] [-journal] directory
  *              disk.img  - name of the image file to mount
+ *              -uring    - submit block I/O through io_uring
+ *              -mmap     - map the image and serve reads from memory
+ *              -cache    - block cache size in MB (default 16, 0 = off)
+ *              -durability - sync: write-through (default); periodic:
+ *                          write-back every -flush seconds (default 5);
+ *                          lazy: write-back on fsync/close/unmount only
+ *              -ram      - hold the image in memory; without -image, or
+ *                          if the image doesn't exist, start from an
+ *                          empty file system of -blocks blocks
+ *              -checkpoint - with -ram, write changes back to the
+ *                          image on fsync and unmount
+ *              -csum     - add a block checksum region if the image has
+ *                          none (images that have one are always checked)
+ *              -scrub    - verify the whole image in the background at
+ *                          this many KB/s
+ *              -discard  - punch freed blocks out of the image file
+ *              -journal  - add a metadata journal if the image has none
+ *                          (images that have one always use it, except
+ *                          with -ram, -mmap or write-back durability)
  *              directory - directory to mount it on
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-uring", offsetof(struct data, uring), 1},
+    {"-mmap", offsetof(struct data, mmap), 1},
+    {"-cache %d", offsetof(struct data, cache_mb), 0},
+    {"-durability %s", offsetof(struct data, durability), 0},
+    {"-flush %d", offsetof(struct data, flush_secs), 0},
+    {"-ram", offsetof(struct data, ram), 1},
+    {"-blocks %d", offsetof(struct data, ram_blocks), 0},
+    {"-checkpoint", offsetof(struct data, checkpoint), 1},
+    {"-csum", offsetof(struct data, csum), 1},
+    {"-scrub %d", offsetof(struct data, scrub_kbs), 0},
+    {"-discard", offsetof(struct data, discard), 1},
+    {"-journal", offsetof(struct data, journal), 1},
     FUSE_OPT_END
 };
 
@@ -45,10 +98,43 @@ int main(int argc, char **argv)
     /* Argument processing and checking
      */
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    _data.cache_mb = DEFAULT_CACHE_MB;
+    _data.flush_secs = DEFAULT_FLUSH_SECS;
     if (fuse_opt_parse(&args, &_data, opts, NULL) == -1)
 	exit(1);
 
-    block_init(_data.image_name);
+    int durability = BLOCK_SYNC;
+    if (_data.durability != NULL) {
+        if (strcmp(_data.durability, "periodic") == 0)
+            durability = BLOCK_PERIODIC;
+        else if (strcmp(_data.durability, "lazy") == 0)
+            durability = BLOCK_LAZY;
+        else if (strcmp(_data.durability, "sync") != 0) {
+            fprintf(stderr, "bad -durability: %s\n", _data.durability);
+            exit(1);
+        }
+    }
+
+    if (_data.ram) {
+        if (block_init_ram(_data.image_name, _data.ram_blocks,
+                           _data.checkpoint) && fs_mkfs(_data.ram_blocks) < 0)
+            exit(1);
+    } else {
+        block_init(_data.image_name);
+    }
+    if (_data.uring)
+        block_uring_init(URING_DEPTH);
+    if (_data.mmap)
+        block_mmap_init();
+    if (_data.cache_mb > 0)
+        block_cache_init((size_t)_data.cache_mb << 20);
+    if (durability != BLOCK_SYNC)
+        block_durability(durability, _data.flush_secs);
+    block_set_discard(_data.discard);
+    fs_set_csum(_data.csum);
+    fs_set_journal(_data.journal);
+    if (_data.scrub_kbs > 0)
+        block_scrub((long)_data.scrub_kbs * 1024);
 
     return fuse_main(args.argc, args.argv, &fs_ops, NULL);
 }
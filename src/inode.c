@@ -0,0 +1,1297 @@
+/*
+ * file:        inode.c
+ * description: resident inode cache. An operation needs a few
+ *              attribute fields and the part of the block map the
+ *              file uses, so that is what is kept. getattr, path
+ *              lookup and the read/write paths then stop reading
+ *              inode blocks.
+ *
+ *              Changes are made to the cached copy. In sync mode they
+ *              are written through at once; in write-back mode dirty
+ *              inodes go out when the block layer flushes (flush hook),
+ *              so a run of writes to one file updates its inode once.
+ *
+ *              Two on-disk formats: the original one inode per block,
+ *              with the inode number being the block number, and the
+ *              compact inode table (see fs.h). Reading a table block
+ *              loads every inode in it, so listing a directory costs
+ *              one read per 32 inodes. Writing an inode puts only it
+ *              in its table block: another cached inode there that has
+ *              changed is written by its own update.
+ *
+ *              An operation holds the inodes it uses with iget/iput,
+ *              so a freed inode isn't released under it, and locks
+ *              them (ilock): shared to read, exclusive to change, the
+ *              exclusive ones until its transaction has committed (see
+ *              txn_lock).
+ *
+ *              The block map is either block pointers or (FS_EXTENTS)
+ *              an extent list; bmap() hides which, and tells callers
+ *              how far a run of contiguous blocks goes so that they can
+ *              move it with one request. Pointers past the ones in the
+ *              inode are in indirect and double-indirect blocks, which
+ *              are not loaded with it: they go through a cache of the
+ *              most used ones (clock replacement), so opening a big file
+ *              reads nothing extra and random reads into it stop paying
+ *              a read for the pointer once its block is hot. Changed
+ *              ones are written out with their inode.
+ *
+ *              A file small enough to fit in that space instead
+ *              (FS_INLINE) has its data cached along with the inode,
+ *              so reading it costs no I/O once the inode is loaded.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../include/fs.h"
+#include "../include/block.h"
+#include "../include/inode.h"
+#include "../include/txn.h"
+
+#define IHASH 1024
+#define IPB   ((int)FS_INODES_PER_BLOCK)
+#define EPB   ((int)FS_EXTENTS_PER_BLOCK)
+#define PPB   FS_PTRS_PER_BLOCK
+#define NIND  256               /* cached indirect blocks */
+#define MAX_MAPPED (INT32_MAX / FS_BLOCK_SIZE) /* blocks; sizes are 32 bits */
+#define BITS_PER_BLOCK (FS_BLOCK_SIZE * 8)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode *hash[IHASH];
+static int count;
+
+/* compact format: where the table and its bitmap are, 0 if none */
+static int itab_start, itab_blocks;
+static int imap_start, imap_blocks;
+static unsigned char *imap;
+static struct txn_map imap_bits; /* imap as committed (see txn_bits) */
+static int ifree_count;         /* clear bits in imap, read without the lock */
+
+/* a cached indirect or double-indirect block */
+struct ind {
+    uint32_t lba;               /* 0 if unused */
+    int      owner;             /* the inode whose map it is part of */
+    int      dirty;
+    int      ref;               /* used since the clock hand passed */
+    struct ind *hnext;
+    uint32_t p[PPB];
+};
+
+static struct ind *ind_cache;   /* NIND entries, allocated on first use */
+static struct ind *ind_hash[NIND];
+static int ind_hand;
+
+/* an extent block (FS_EXTENTS, more than FS_NEXTENT extents) */
+union extent_block {
+    struct {
+        struct fs_extent_hdr eh;
+        struct fs_extent ext[EPB];
+    };
+    char data[FS_BLOCK_SIZE];
+};
+
+/* block pointers held in the inode itself */
+static int ndirect(const struct inode *ip)
+{
+    if (itab_start != 0)
+        return FS_NDIRECT;
+    return (ip->flags & FS_INDIRECT) ? FS_NDIRECT_ORIG : INODE_NPTRS;
+}
+
+static int blocks_used(const struct inode *ip)
+{
+    int n = DIV_ROUND_UP(ip->size, FS_BLOCK_SIZE);
+    if (S_ISDIR(ip->mode) && n == 0)
+        n = 1;
+    if (itab_start == 0 && !(ip->flags & FS_INDIRECT) && n > INODE_NPTRS)
+        n = INODE_NPTRS;
+    return n;
+}
+
+static struct inode *lookup(int inum)
+{
+    struct inode *ip = hash[inum % IHASH];
+
+    while (ip != NULL && ip->inum != inum)
+        ip = ip->hnext;
+    return ip;
+}
+
+static void insert(struct inode *ip)
+{
+    ip->hnext = hash[ip->inum % IHASH];
+    hash[ip->inum % IHASH] = ip;
+    count++;
+}
+
+/* a zeroed inode 'inum', or NULL if out of memory */
+static struct inode *alloc_inode(int inum)
+{
+    struct inode *ip = calloc(1, sizeof(*ip));
+
+    if (ip == NULL)
+        return NULL;
+    ip->inum = inum;
+    pthread_rwlock_init(&ip->rwlock, NULL);
+    return ip;
+}
+
+static void release(struct inode *ip)
+{
+    pthread_rwlock_destroy(&ip->rwlock);
+    free(ip->ptrs);
+    free(ip->ext);
+    free(ip->data);
+    free(ip);
+}
+
+/* take 'inum' out of the cache: freed now if nobody holds it, else by
+ * the last iput
+ */
+static void unhash(int inum)
+{
+    for (struct inode **pp = &hash[inum % IHASH]; *pp != NULL;
+         pp = &(*pp)->hnext) {
+        if ((*pp)->inum == inum) {
+            struct inode *ip = *pp;
+            *pp = ip->hnext;
+            count--;
+            ip->gone = 1;
+            if (ip->ref == 0)
+                release(ip);
+            break;
+        }
+    }
+}
+
+/* inode 'inum' has been freed. It stays in the cache, marked gone, so
+ * that an operation that looked it up first finds that out instead of
+ * reading the stale copy on disk again (see txn_lock); its slot being
+ * allocated again replaces it (inew)
+ */
+static void drop(int inum)
+{
+    struct inode *ip = lookup(inum);
+
+    if (ip != NULL) {
+        ip->gone = 1;
+        ip->dirty = 0;
+    }
+}
+
+static int imap_test(int inum)
+{
+    return imap[inum / 8] & (1 << (inum % 8));
+}
+
+/* the table block holding inode 'inum' */
+static int itab_lba(int inum)
+{
+    return itab_start + inum / IPB;
+}
+
+static struct ind *ind_lookup(uint32_t lba)
+{
+    struct ind *b = ind_hash[lba % NIND];
+
+    while (b != NULL && b->lba != lba)
+        b = b->hnext;
+    return b;
+}
+
+static void ind_unhash(struct ind *b)
+{
+    struct ind **pp = &ind_hash[b->lba % NIND];
+
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+    b->lba = 0;
+}
+
+/* an entry for map block 'lba' of inode 'owner', in place of one that
+ * hasn't been used lately (written back first if it has changed).
+ * Called with the lock held; NULL on error
+ */
+static struct ind *ind_slot(uint32_t lba, int owner)
+{
+    if (ind_cache == NULL && (ind_cache = calloc(NIND, sizeof(*ind_cache))) == NULL)
+        return NULL;
+
+    for (;;) {
+        struct ind *b = &ind_cache[ind_hand];
+        ind_hand = (ind_hand + 1) % NIND;
+        if (b->lba != 0 && b->ref) {
+            b->ref = 0;
+            continue;
+        }
+        if (b->lba != 0) {
+            struct block_iov iov = {.lba = b->lba, .buf = b->p, .nblks = 1};
+            if (b->dirty && block_commit(&iov, 1) < 0)
+                return NULL;
+            ind_unhash(b);
+        }
+        b->lba = lba;
+        b->owner = owner;
+        b->dirty = 0;
+        b->ref = 1;
+        b->hnext = ind_hash[lba % NIND];
+        ind_hash[lba % NIND] = b;
+        return b;
+    }
+}
+
+/* map block 'lba' of inode 'owner', read if it isn't cached. Called
+ * with the lock held; NULL on error
+ */
+static struct ind *ind_get(uint32_t lba, int owner)
+{
+    struct ind *b;
+
+    if (lba == 0)
+        return NULL;
+    if ((b = ind_lookup(lba)) != NULL) {
+        b->ref = 1;
+        return b;
+    }
+    if ((b = ind_slot(lba, owner)) != NULL && block_read(b->p, lba, 1) < 0) {
+        ind_unhash(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* the map block of 'ip' that '*slot' (a pointer in 'parent', if that
+ * isn't NULL) points to goes in '*bp', allocated with 'alloc' if there
+ * is none yet. Called with the lock held; returns 0, -ENOSPC, -ENOMEM
+ * or -EIO
+ */
+static int map_block(struct inode *ip, uint32_t *slot, struct ind *parent,
+                     int (*alloc)(const struct inode *ip, void *arg), void *arg,
+                     struct ind **bp)
+{
+    if (*slot != 0) {
+        *bp = ind_get(*slot, ip->inum);
+        return *bp != NULL ? 0 : -EIO;
+    }
+
+    int lba = alloc(ip, arg);
+    if (lba < 0)
+        return lba;
+    *slot = lba;
+    if (parent != NULL)
+        parent->dirty = 1;
+    if ((*bp = ind_slot(lba, ip->inum)) == NULL)
+        return -EIO;
+    memset((*bp)->p, 0, FS_BLOCK_SIZE);
+    (*bp)->dirty = 1;
+    return 0;
+}
+
+/* a map block that has been freed: forget it without writing it */
+static void ind_drop(uint32_t lba)
+{
+    struct ind *b = ind_lookup(lba);
+
+    if (b != NULL)
+        ind_unhash(b);
+}
+
+/* 'iov' entries for the changed map blocks of inode 'inum' (of every
+ * inode if 'inum' is -1), which are then taken to be clean; see
+ * ind_redirty. Returns how many, at most NIND
+ */
+static int ind_flush(int inum, struct block_iov *iov)
+{
+    int n = 0;
+
+    for (int i = 0; ind_cache != NULL && i < NIND; i++) {
+        struct ind *b = &ind_cache[i];
+        if (b->lba != 0 && b->dirty && (inum == -1 || b->owner == inum)) {
+            iov[n++] = (struct block_iov){.lba = b->lba, .buf = b->p, .nblks = 1};
+            b->dirty = 0;
+        }
+    }
+    return n;
+}
+
+/* the write of blocks ind_flush handed out failed */
+static void ind_redirty(const struct block_iov *iov, int n)
+{
+    for (int i = 0; i < n; i++) {
+        struct ind *b = ind_lookup(iov[i].lba);
+        if (b != NULL)
+            b->dirty = 1;
+    }
+}
+
+/* make room for the first 'n' block pointers in the inode. Returns 0
+ * or -ENOMEM
+ */
+static int imap_reserve(struct inode *ip, int n)
+{
+    int max = ndirect(ip);
+
+    if (n > max)
+        n = max;
+    if (n <= ip->nptrs)
+        return 0;
+
+    /* grow geometrically, files are usually written by appending */
+    int cap = ip->nptrs > 0 ? ip->nptrs : 1;
+    while (cap < n)
+        cap *= 2;
+    if (cap > max)
+        cap = max;
+
+    uint32_t *p = realloc(ip->ptrs, cap * sizeof(uint32_t));
+    if (p == NULL)
+        return -ENOMEM;
+    memset(p + ip->nptrs, 0, (cap - ip->nptrs) * sizeof(uint32_t));
+    ip->ptrs = p;
+    ip->nptrs = cap;
+    return 0;
+}
+
+/* a cached inode from the fields common to both formats. Returns NULL
+ * if out of memory
+ */
+static struct inode *decode(int inum, uint16_t uid, uint16_t gid,
+                            uint32_t mode, uint32_t ctime, uint32_t mtime,
+                            int32_t size, uint32_t flags)
+{
+    struct inode *ip = alloc_inode(inum);
+
+    if (ip == NULL)
+        return NULL;
+    ip->uid = uid;
+    ip->gid = gid;
+    ip->mode = mode;
+    ip->ctime = ctime;
+    ip->mtime = mtime;
+    ip->size = size;
+    ip->flags = flags;
+    if (!(flags & (FS_EXTENTS | FS_INLINE))) {
+        ip->nblocks = blocks_used(ip);
+        if (imap_reserve(ip, ip->nblocks) < 0) {
+            release(ip);
+            return NULL;
+        }
+    }
+    return ip;
+}
+
+static int ext_reserve(struct inode *ip, int n)
+{
+    if (n <= ip->ext_cap)
+        return 0;
+
+    int cap = ip->ext_cap > 0 ? ip->ext_cap : FS_NEXTENT;
+    while (cap < n)
+        cap *= 2;
+    struct fs_extent *e = realloc(ip->ext, cap * sizeof(*e));
+    if (e == NULL)
+        return -ENOMEM;
+    ip->ext = e;
+    ip->ext_cap = cap;
+    return 0;
+}
+
+/* add 'n' extents read from disk to the end of 'ip's list */
+static int ext_load(struct inode *ip, const struct fs_extent *e, int n)
+{
+    if (ext_reserve(ip, ip->next + n) < 0)
+        return -ENOMEM;
+    memcpy(ip->ext + ip->next, e, n * sizeof(*e));
+    ip->next += n;
+    if (ip->next > 0)
+        ip->nblocks = ip->ext[ip->next - 1].lblk + ip->ext[ip->next - 1].len;
+    return 0;
+}
+
+/* extent blocks 'ip' needs for its list */
+static int ext_blocks(const struct inode *ip)
+{
+    return ip->next > FS_NEXTENT ? DIV_ROUND_UP(ip->next, EPB) : 0;
+}
+
+/* extent blocks holding 'ip's map (indirect blocks are written from
+ * the cache instead)
+ */
+static int map_blocks(const struct inode *ip)
+{
+    if (ip->flags & FS_EXTENTS)
+        return ip->next > FS_NEXTENT ? ip->nleaf : 0;
+    return 0;
+}
+
+int inline_max(void)
+{
+    return itab_start != 0 ? FS_INLINE_COMPACT : FS_INLINE_ORIG;
+}
+
+/* the data of an FS_INLINE inode, from the on-disk copy at 'src' */
+static int decode_inline(struct inode *ip, const void *src)
+{
+    if ((ip->data = malloc(inline_max())) == NULL)
+        return -ENOMEM;
+    memcpy(ip->data, src, inline_max());
+    return 0;
+}
+
+static void decode_ptrs(struct inode *ip, const struct fs_cinode *d)
+{
+    int n = ip->nblocks;
+
+    memcpy(ip->ptrs, d->ptrs, (n < FS_NDIRECT ? n : FS_NDIRECT) * sizeof(uint32_t));
+    ip->indirect = d->indirect;
+    ip->dindirect = d->dindirect;
+}
+
+/* the extents of a compact inode; at depth 1 they are in extent
+ * blocks, which are only read if 'extra' is set
+ */
+static int decode_extents(struct inode *ip, const struct fs_cinode *d, int extra)
+{
+    int n = d->eh.count;
+
+    if (n > FS_NEXTENT || d->eh.depth > 1)
+        return -EIO;
+    if (d->eh.depth == 0)
+        return ext_load(ip, d->ext, n);
+    if (!extra)
+        return -EIO;
+
+    for (int i = 0; i < n; i++) {
+        union extent_block blk;
+        if (block_read(&blk, d->ext[i].pblk, 1) < 0 || blk.eh.count > EPB)
+            return -EIO;
+        ip->leaf[ip->nleaf++] = d->ext[i].pblk;
+        if (ext_load(ip, blk.ext, blk.eh.count) < 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/* a compact inode's cached form. Returns NULL if its map has blocks
+ * outside the slot and 'extra' (may read them) isn't set, or on error
+ */
+static struct inode *decode_slot(int inum, const struct fs_cinode *d,
+                                 int extra)
+{
+    struct inode *ip = decode(inum, d->uid, d->gid, d->mode, d->ctime,
+                              d->mtime, d->size, d->flags);
+    if (ip == NULL)
+        return NULL;
+
+    int rv = 0;
+    if (ip->flags & FS_INLINE)
+        rv = decode_inline(ip, d->data);
+    else if (!(ip->flags & FS_EXTENTS))
+        decode_ptrs(ip, d);
+    else
+        rv = decode_extents(ip, d, extra);
+    if (rv < 0) {
+        release(ip);
+        return NULL;
+    }
+    return ip;
+}
+
+static void encode_slot(const struct inode *ip, struct fs_cinode *d)
+{
+    int n = ip->nblocks;
+
+    memset(d, 0, sizeof(*d));
+    d->uid = ip->uid;
+    d->gid = ip->gid;
+    d->mode = ip->mode;
+    d->ctime = ip->ctime;
+    d->mtime = ip->mtime;
+    d->size = ip->size;
+    d->flags = ip->flags;
+    if (ip->flags & FS_INLINE) {
+        memcpy(d->data, ip->data, sizeof(d->data));
+    } else if (!(ip->flags & FS_EXTENTS)) {
+        memcpy(d->ptrs, ip->ptrs, (n < FS_NDIRECT ? n : FS_NDIRECT) * sizeof(uint32_t));
+        d->indirect = ip->indirect;
+        d->dindirect = ip->dindirect;
+    } else if (ip->next <= FS_NEXTENT) {
+        d->eh.count = ip->next;
+        memcpy(d->ext, ip->ext, ip->next * sizeof(d->ext[0]));
+    } else {
+        /* one entry per extent block (see ext_append) */
+        d->eh.depth = 1;
+        d->eh.count = ip->nleaf;
+        for (int i = 0; i < ip->nleaf; i++) {
+            int first = i * EPB;
+            d->ext[i].lblk = ip->ext[first].lblk;
+            d->ext[i].pblk = ip->leaf[i];
+            d->ext[i].len = ip->next - first < EPB ? ip->next - first : EPB;
+        }
+    }
+}
+
+/* the extent blocks of 'ip' go in 'iov', with their contents in 'buf'
+ * (room for map_blocks(ip) of them). Returns how many
+ */
+static int encode_map(const struct inode *ip, struct block_iov *iov, char *buf)
+{
+    int n = map_blocks(ip);
+
+    for (int i = 0; i < n; i++) {
+        iov[i].buf = buf + (size_t)i * FS_BLOCK_SIZE;
+        iov[i].nblks = 1;
+        memset(iov[i].buf, 0, FS_BLOCK_SIZE);
+    }
+    for (int i = 0; i < n; i++) {
+        union extent_block *blk = iov[i].buf;
+        int first = i * EPB;
+        blk->eh.count = ip->next - first < EPB ? ip->next - first : EPB;
+        memcpy(blk->ext, ip->ext + first, blk->eh.count * sizeof(blk->ext[0]));
+        iov[i].lba = ip->leaf[i];
+    }
+    return n;
+}
+
+/* read table block 'lba' into 'blk' with the inodes in 'ips' (those
+ * of 'n' in it) put in their slots. The other slots are as they were:
+ * any other inode in the block that has changed is written by its own
+ * iupdate, or the next isync. Called with the lock held. Returns 0 or
+ * -EIO
+ */
+static int table_block(int lba, struct fs_cinode *blk, struct inode **ips, int n)
+{
+    if (block_read(blk, lba, 1) < 0)
+        return -EIO;
+    for (int i = 0; i < n; i++)
+        if (itab_lba(ips[i]->inum) == lba)
+            encode_slot(ips[i], &blk[ips[i]->inum % IPB]);
+    return 0;
+}
+
+static struct inode *iget_legacy(int inum)
+{
+    struct fs_inode d;
+
+    if (block_read(&d, inum, 1) < 0)
+        return NULL;
+    struct inode *ip = decode(inum, d.uid, d.gid,
+                              d.mode & ((1 << FS_FLAGS_SHIFT) - 1),
+                              d.ctime, d.mtime, d.size, d.mode >> FS_FLAGS_SHIFT);
+    if (ip == NULL)
+        return NULL;
+    if (ip->flags & FS_INLINE) {
+        if (decode_inline(ip, d.ptrs) < 0) {
+            release(ip);
+            return NULL;
+        }
+        return ip;
+    }
+    int n = ip->nblocks < ndirect(ip) ? ip->nblocks : ndirect(ip);
+    memcpy(ip->ptrs, d.ptrs, n * sizeof(uint32_t));
+    if (ip->flags & FS_INDIRECT) {
+        ip->indirect = d.ptrs[FS_NDIRECT_ORIG];
+        ip->dindirect = d.ptrs[FS_NDIRECT_ORIG + 1];
+    }
+    return ip;
+}
+
+/* the rest of the table block comes in with 'inum': every inode in
+ * use whose block map is all in its slot
+ */
+static void prefetch(const struct fs_cinode *blk, int first)
+{
+    for (int i = 0; i < IPB; i++) {
+        int n = first + i;
+        if (!imap_test(n) || lookup(n) != NULL)
+            continue;
+        struct inode *ip = decode_slot(n, &blk[i], 0);
+        if (ip != NULL)
+            insert(ip);
+    }
+}
+
+struct inode *iget(int inum)
+{
+    struct fs_cinode blk[IPB];
+    struct inode *ip;
+
+    pthread_mutex_lock(&lock);
+    ip = lookup(inum);
+    if (ip != NULL)
+        ip->ref++;
+    pthread_mutex_unlock(&lock);
+    if (ip != NULL)
+        return ip;
+
+    if (itab_start == 0) {
+        ip = iget_legacy(inum);
+    } else if (inum < 2 || inum >= itab_blocks * IPB ||
+               block_read(blk, itab_lba(inum), 1) < 0) {
+        return NULL;
+    } else {
+        ip = decode_slot(inum, &blk[inum % IPB], 1);
+    }
+    if (ip == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    struct inode *other = lookup(inum);     /* lost a race to load it */
+    if (other != NULL) {
+        other->ref++;
+        pthread_mutex_unlock(&lock);
+        release(ip);
+        return other;
+    }
+    ip->ref = 1;
+    insert(ip);
+    if (itab_start != 0)
+        prefetch(blk, inum - inum % IPB);
+    pthread_mutex_unlock(&lock);
+    return ip;
+}
+
+struct inode *inew(int inum, uint32_t mode)
+{
+    struct inode *ip = alloc_inode(inum);
+
+    if (ip == NULL)
+        return NULL;
+    ip->mode = mode;
+    ip->ref = 1;
+    if (imap_reserve(ip, 1) < 0) {
+        release(ip);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    unhash(inum);               /* the freed inode that had the slot */
+    insert(ip);
+    pthread_mutex_unlock(&lock);
+    return ip;
+}
+
+void iput(struct inode *ip)
+{
+    pthread_mutex_lock(&lock);
+    if (--ip->ref == 0 && ip->gone && lookup(ip->inum) != ip)
+        release(ip);
+    pthread_mutex_unlock(&lock);
+}
+
+void ilock(struct inode *ip)
+{
+    pthread_rwlock_wrlock(&ip->rwlock);
+}
+
+void ilock_shared(struct inode *ip)
+{
+    pthread_rwlock_rdlock(&ip->rwlock);
+}
+
+void iunlock(struct inode *ip)
+{
+    pthread_rwlock_unlock(&ip->rwlock);
+}
+
+/* where the pointer to block 'lblk' of 'ip' is - in the inode or in a
+ * cached indirect block - and in '*n' how many pointers from there on
+ * are in the same place. Called with the lock held; NULL on error
+ */
+static const uint32_t *find_ptr(const struct inode *ip, int lblk, int *n)
+{
+    int i = lblk - ndirect(ip);
+    uint32_t lba = ip->indirect;
+
+    if (i < 0) {
+        *n = -i;
+        return ip->ptrs + lblk;
+    }
+    if (i >= PPB) {
+        i -= PPB;
+        struct ind *d = ind_get(ip->dindirect, ip->inum);
+        if (d == NULL)
+            return NULL;
+        lba = d->p[i / PPB];
+        i %= PPB;
+    }
+    struct ind *b = ind_get(lba, ip->inum);
+    if (b == NULL)
+        return NULL;
+    *n = PPB - i;
+    return b->p + i;
+}
+
+/* point block 'lblk' of 'ip' at 'pblk', allocating indirect blocks
+ * with 'alloc' as needed. Called with the lock held; returns 0,
+ * -ENOSPC, -ENOMEM or -EIO
+ */
+static int set_ptr(struct inode *ip, int lblk, uint32_t pblk,
+                   int (*alloc)(const struct inode *ip, void *arg), void *arg)
+{
+    int i = lblk - ndirect(ip), rv;
+    uint32_t *slot = &ip->indirect;
+    struct ind *parent = NULL, *b;
+
+    if (i < 0) {
+        if ((rv = imap_reserve(ip, lblk + 1)) < 0)
+            return rv;
+        ip->ptrs[lblk] = pblk;
+        return 0;
+    }
+    if (i >= PPB) {
+        i -= PPB;
+        if ((rv = map_block(ip, &ip->dindirect, NULL, alloc, arg, &parent)) < 0)
+            return rv;
+        slot = &parent->p[i / PPB];
+        i %= PPB;
+    }
+    if ((rv = map_block(ip, slot, parent, alloc, arg, &b)) < 0)
+        return rv;
+    b->p[i] = pblk;
+    b->dirty = 1;
+    return 0;
+}
+
+/* bmap for extent-mapped inodes */
+static uint32_t ext_map(const struct inode *ip, int lblk, int *run)
+{
+    /* the last extent starting at or before 'lblk'; the list has no
+     * holes, so it holds it
+     */
+    int lo = 0, hi = ip->next - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (ip->ext[mid].lblk <= (uint32_t)lblk)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    const struct fs_extent *e = &ip->ext[lo];
+    int off = lblk - e->lblk;
+    if (run != NULL && *run > (int)e->len - off)
+        *run = e->len - off;
+    return e->pblk + off;
+}
+
+/* bmap with the lock held */
+static uint32_t map(const struct inode *ip, int lblk, int *run)
+{
+    if (lblk < 0 || lblk >= ip->nblocks)
+        return 0;
+    if (ip->flags & FS_EXTENTS)
+        return ext_map(ip, lblk, run);
+
+    int n;
+    const uint32_t *p = find_ptr(ip, lblk, &n);
+    if (p == NULL)
+        return 0;
+    if (run != NULL) {
+        int max = *run, k = 1;
+        if (max > n)
+            max = n;
+        if (max > ip->nblocks - lblk)
+            max = ip->nblocks - lblk;
+        while (k < max && p[k] == p[0] + k)
+            k++;
+        *run = k;
+    }
+    return p[0];
+}
+
+uint32_t bmap(const struct inode *ip, int lblk, int *run)
+{
+    pthread_mutex_lock(&lock);
+    uint32_t lba = map(ip, lblk, run);
+    pthread_mutex_unlock(&lock);
+    return lba;
+}
+
+static int ext_append(struct inode *ip, uint32_t pblk, int n,
+                      int (*alloc)(const struct inode *ip, void *arg), void *arg)
+{
+    struct fs_extent *last = ip->next > 0 ? &ip->ext[ip->next - 1] : NULL;
+
+    if (last != NULL && last->pblk + last->len == pblk) {
+        last->len += n;
+    } else {
+        if (ip->next == FS_NEXTENT * EPB)
+            return -EFBIG;
+        if (ext_reserve(ip, ip->next + 1) < 0)
+            return -ENOMEM;
+        ip->ext[ip->next++] = (struct fs_extent){
+            .lblk = ip->nblocks, .pblk = pblk, .len = n};
+    }
+    ip->nblocks += n;
+
+    while (ip->nleaf < ext_blocks(ip)) {
+        int lba = alloc(ip, arg);
+        if (lba < 0)
+            return lba;
+        ip->leaf[ip->nleaf++] = lba;
+    }
+    return 0;
+}
+
+int bmap_append(struct inode *ip, uint32_t pblk, int n,
+                int (*alloc)(const struct inode *ip, void *arg), void *arg)
+{
+    int rv = 0;
+
+    if (ip->nblocks + (int64_t)n > MAX_MAPPED)
+        return -EFBIG;
+    pthread_mutex_lock(&lock);
+    if (ip->flags & FS_EXTENTS) {
+        rv = ext_append(ip, pblk, n, alloc, arg);
+        goto out;
+    }
+
+    /* an original-format inode outgrowing its pointers: the last two
+     * become the indirect block pointers (FS_INDIRECT), and the blocks
+     * they held are mapped again through those
+     */
+    if (itab_start == 0 && !(ip->flags & FS_INDIRECT) && ip->nblocks + n > INODE_NPTRS) {
+        uint32_t moved[INODE_NPTRS - FS_NDIRECT_ORIG];
+        int nmoved = 0;
+        while (ip->nblocks > FS_NDIRECT_ORIG)
+            moved[nmoved++] = ip->ptrs[--ip->nblocks];
+        ip->flags |= FS_INDIRECT;
+        while (rv == 0 && nmoved > 0) {
+            if ((rv = set_ptr(ip, ip->nblocks, moved[--nmoved], alloc, arg)) == 0)
+                ip->nblocks++;
+        }
+    }
+    for (int i = 0; rv == 0 && i < n; i++) {
+        if ((rv = set_ptr(ip, ip->nblocks, pblk + i, alloc, arg)) == 0)
+            ip->nblocks++;
+    }
+out:
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+/* free 'ip's indirect blocks that no pointer to its first 'n' blocks
+ * is in
+ */
+static void trim_ptrs(struct inode *ip, int n,
+                      void (*free_block)(uint32_t lba, void *arg), void *arg)
+{
+    int keep = n - ndirect(ip) - PPB;   /* pointers kept past the indirect block */
+
+    if (ip->dindirect != 0) {
+        struct ind *d = ind_get(ip->dindirect, ip->inum);
+        for (int i = keep > 0 ? DIV_ROUND_UP(keep, PPB) : 0; d != NULL && i < PPB; i++) {
+            if (d->p[i] != 0) {
+                ind_drop(d->p[i]);
+                free_block(d->p[i], arg);
+                d->p[i] = 0;
+                d->dirty = 1;
+            }
+        }
+        if (keep <= 0) {
+            ind_drop(ip->dindirect);
+            free_block(ip->dindirect, arg);
+            ip->dindirect = 0;
+        }
+    }
+    if (n <= ndirect(ip) && ip->indirect != 0) {
+        ind_drop(ip->indirect);
+        free_block(ip->indirect, arg);
+        ip->indirect = 0;
+    }
+}
+
+void bmap_truncate(struct inode *ip, int n,
+                   void (*free_block)(uint32_t lba, void *arg), void *arg)
+{
+    pthread_mutex_lock(&lock);
+    for (int b = n; b < ip->nblocks;) {
+        int run = ip->nblocks - b;
+        uint32_t lba = map(ip, b, &run);
+        for (int i = 0; lba != 0 && i < run; i++)
+            free_block(lba + i, arg);
+        b += run;
+    }
+
+    if (ip->flags & FS_EXTENTS) {
+        while (ip->next > 0 && ip->ext[ip->next - 1].lblk >= (uint32_t)n)
+            ip->next--;
+        struct fs_extent *last = ip->next > 0 ? &ip->ext[ip->next - 1] : NULL;
+        if (last != NULL && last->lblk + last->len > (uint32_t)n)
+            last->len = n - last->lblk;
+        while (ip->nleaf > ext_blocks(ip))
+            free_block(ip->leaf[--ip->nleaf], arg);
+    } else {
+        int nd = ndirect(ip), end = ip->nblocks < nd ? ip->nblocks : nd;
+        if (n < end)
+            memset(ip->ptrs + n, 0, (end - n) * sizeof(uint32_t));
+        trim_ptrs(ip, n, free_block, arg);
+    }
+    if (n < ip->nblocks)
+        ip->nblocks = n;
+    pthread_mutex_unlock(&lock);
+}
+
+int inline_begin(struct inode *ip)
+{
+    char *data = calloc(1, inline_max());
+
+    if (data == NULL)
+        return -ENOMEM;
+    pthread_mutex_lock(&lock);
+    ip->data = data;
+    ip->flags |= FS_INLINE;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void inline_end(struct inode *ip)
+{
+    pthread_mutex_lock(&lock);
+    free(ip->data);
+    ip->data = NULL;
+    ip->flags &= ~FS_INLINE;
+    pthread_mutex_unlock(&lock);
+}
+
+static void encode_legacy(const struct inode *ip, struct fs_inode *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->uid = ip->uid;
+    d->gid = ip->gid;
+    d->mode = ip->mode | ip->flags << FS_FLAGS_SHIFT;
+    d->ctime = ip->ctime;
+    d->mtime = ip->mtime;
+    d->size = ip->size;
+    if (ip->flags & FS_INLINE) {
+        memcpy(d->ptrs, ip->data, sizeof(d->ptrs));
+        return;
+    }
+    int n = ip->nblocks < ndirect(ip) ? ip->nblocks : ndirect(ip);
+    memcpy(d->ptrs, ip->ptrs, n * sizeof(uint32_t));
+    if (ip->flags & FS_INDIRECT) {
+        d->ptrs[FS_NDIRECT_ORIG] = ip->indirect;
+        d->ptrs[FS_NDIRECT_ORIG + 1] = ip->dindirect;
+    }
+}
+
+int iupdate(struct inode *ip)
+{
+    return icommit(&ip, 1, NULL, 0);
+}
+
+static int cmp_lba(const void *a, const void *b)
+{
+    const struct block_iov *x = a, *y = b;
+    return x->lba < y->lba ? -1 : x->lba > y->lba;
+}
+
+/* like isync, but for the given inodes (not freed) only, each table
+ * block once however many of them it holds, and their indirect blocks
+ * from the cache; sorted in with 'iov'. In write-back mode the inodes
+ * are left dirty for isync
+ */
+int icommit(struct inode **ips, int n, const struct block_iov *iov, int iovcnt)
+{
+    struct block_iov ind[NIND];
+    struct block_iov *all = NULL;
+    struct inode **live = NULL;
+    char *buf = NULL;
+    int nlive = 0, nmap = 0, nio = 0, nind = 0, rv = 0;
+
+    pthread_mutex_lock(&lock);
+    if (n > 0 && (live = malloc(n * sizeof(*live))) == NULL) {
+        rv = -EIO;
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!ips[i]->gone) {
+            ips[i]->dirty = 1;
+            live[nlive++] = ips[i];
+            nmap += itab_start != 0 ? map_blocks(ips[i]) : 0;
+        }
+    }
+    if (block_writeback())
+        nlive = nmap = 0;
+
+    all = malloc((nlive + nmap + NIND + iovcnt + 1) * sizeof(*all));
+    if (nlive + nmap > 0)
+        buf = malloc((size_t)(nlive + nmap) * FS_BLOCK_SIZE);
+    if (all == NULL || (nlive + nmap > 0 && buf == NULL)) {
+        rv = -EIO;
+        goto out;
+    }
+    for (int i = 0; i < nlive; i++) {
+        all[nio].lba = itab_start == 0 ? live[i]->inum : itab_lba(live[i]->inum);
+        all[nio].buf = live[i];
+        all[nio++].nblks = 1;
+    }
+    if (itab_start != 0) {
+        qsort(all, nio, sizeof(*all), cmp_lba);
+        int k = 0;
+        for (int i = 0; i < nio; i++)
+            if (k == 0 || all[i].lba != all[k - 1].lba)
+                all[k++] = all[i];
+        nio = k;
+    }
+    for (int i = 0; i < nio; i++) {
+        struct inode *ip = all[i].buf;
+        all[i].buf = buf + (size_t)i * FS_BLOCK_SIZE;
+        if (itab_start == 0) {
+            encode_legacy(ip, all[i].buf);
+        } else if (table_block(all[i].lba, all[i].buf, live, nlive) < 0) {
+            rv = -EIO;
+            goto out;
+        }
+    }
+    for (int i = 0; i < nlive && itab_start != 0; i++)
+        nio += encode_map(live[i], all + nio, buf + (size_t)nio * FS_BLOCK_SIZE);
+    for (int i = 0; i < nlive; i++)
+        nind += ind_flush(live[i]->inum, ind + nind);
+    memcpy(all + nio, ind, nind * sizeof(*ind));
+    nio += nind;
+    if (iovcnt > 0)
+        memcpy(all + nio, iov, iovcnt * sizeof(*iov));
+    nio += iovcnt;
+
+    qsort(all, nio, sizeof(*all), cmp_lba);
+    if (nio > 0 && block_commit(all, nio) < 0) {
+        ind_redirty(ind, nind);
+        rv = -EIO;
+    }
+    for (int i = 0; i < nlive; i++)
+        live[i]->dirty = rv < 0;
+
+out:
+    pthread_mutex_unlock(&lock);
+    free(all);
+    free(live);
+    free(buf);
+    return rv;
+}
+
+/* dirty inodes are written in one batch: in the original format one
+ * block each, otherwise every table block holding one (once) and their
+ * extent blocks, plus every changed indirect block. One an operation
+ * is changing (see ilock) is left for the next time
+ */
+int isync(void)
+{
+    struct block_iov *iov = NULL;
+    struct inode **dirty = NULL;
+    char *buf = NULL;
+    int n = 0, nmap = 0, nio = 0, rv = 0, locked = 0;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < IHASH; i++) {
+        for (struct inode *ip = hash[i]; ip != NULL; ip = ip->hnext) {
+            if (ip->dirty) {
+                n++;
+                nmap += itab_start != 0 ? map_blocks(ip) : 0;
+            }
+        }
+    }
+    if (n == 0)
+        goto out;
+
+    iov = malloc((n + nmap + NIND) * sizeof(*iov));
+    dirty = malloc(n * sizeof(*dirty));
+    buf = malloc((size_t)(n + nmap) * FS_BLOCK_SIZE);
+    if (iov == NULL || dirty == NULL || buf == NULL) {
+        rv = -EIO;
+        goto out;
+    }
+    n = 0;
+    for (int i = 0; i < IHASH; i++) {
+        for (struct inode *ip = hash[i]; ip != NULL; ip = ip->hnext) {
+            if (!ip->dirty || pthread_rwlock_tryrdlock(&ip->rwlock) != 0)
+                continue;
+            dirty[n++] = ip;
+            iov[nio].lba = itab_start == 0 ? ip->inum : itab_lba(ip->inum);
+            iov[nio].nblks = 1;
+            nio++;
+        }
+    }
+    locked = 1;
+
+    /* one copy of each table block */
+    qsort(iov, nio, sizeof(*iov), cmp_lba);
+    int k = 0;
+    for (int i = 0; i < nio; i++)
+        if (k == 0 || iov[i].lba != iov[k - 1].lba)
+            iov[k++] = iov[i];
+    nio = k;
+
+    for (int i = 0; i < nio; i++) {
+        iov[i].buf = buf + (size_t)i * FS_BLOCK_SIZE;
+        if (itab_start == 0) {
+            encode_legacy(lookup(iov[i].lba), iov[i].buf);
+        } else if (table_block(iov[i].lba, iov[i].buf, dirty, n) < 0) {
+            rv = -EIO;
+            goto out;
+        }
+    }
+    for (int i = 0; i < n && itab_start != 0; i++)
+        nio += encode_map(dirty[i], iov + nio, buf + (size_t)nio * FS_BLOCK_SIZE);
+    int nind = ind_flush(-1, iov + nio);
+    nio += nind;
+
+    for (int i = 0; i < n; i++) {
+        dirty[i]->dirty = 0;
+        pthread_rwlock_unlock(&dirty[i]->rwlock);
+    }
+    locked = 0;
+    if (block_pwritev(iov, nio) < 0) {
+        /* still dirty, the next flush tries again */
+        for (int i = 0; i < n; i++)
+            dirty[i]->dirty = 1;
+        ind_redirty(iov + nio - nind, nind);
+        rv = -EIO;
+    }
+
+out:
+    for (int i = 0; i < n && locked; i++)
+        pthread_rwlock_unlock(&dirty[i]->rwlock);
+    pthread_mutex_unlock(&lock);
+    free(iov);
+    free(dirty);
+    free(buf);
+    return rv;
+}
+
+void iforget(int inum)
+{
+    pthread_mutex_lock(&lock);
+    drop(inum);
+    pthread_mutex_unlock(&lock);
+}
+
+/* the first free slot in 'from'..'to'-1, or -1 */
+static int ifind(int from, int to)
+{
+    for (int i = from; i < to; i++) {
+        if (i % 8 == 0 && imap[i / 8] == 0xff) {
+            i += 7;
+            continue;
+        }
+        if (!imap_test(i))
+            return i;
+    }
+    return -1;
+}
+
+/* slots 'i'..'i'+'n'-1 can be handed out again */
+static void imap_free(int i, int n)
+{
+    pthread_mutex_lock(&lock);
+    for (; n > 0; i++, n--) {
+        if (imap_test(i))
+            __atomic_add_fetch(&ifree_count, 1, __ATOMIC_RELAXED);
+        imap[i / 8] &= ~(1 << (i % 8));
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int ialloc(struct txn *tx, int part, int nparts)
+{
+    int ninodes = itab_blocks * IPB;
+    int start = ((long)part * ninodes + nparts - 1) / nparts;
+
+    pthread_mutex_lock(&lock);
+    int i = ifind(start, ninodes);
+    if (i < 0)
+        i = ifind(0, start);
+    if (i >= 0) {
+        imap[i / 8] |= 1 << (i % 8);
+        __atomic_sub_fetch(&ifree_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&lock);
+    if (i < 0)
+        return -ENOSPC;
+    if (txn_bits(tx, &imap_bits, i, 1, 1) < 0) {
+        imap_free(i, 1);
+        return -ENOMEM;
+    }
+    return i;
+}
+
+void ifree(struct txn *tx, int inum)
+{
+    iforget(inum);
+    if (txn_bits(tx, &imap_bits, inum, 1, 0) < 0)
+        imap_free(inum, 1);     /* on disk it stays in use */
+}
+
+int itable_size(int *nfree)
+{
+    if (nfree != NULL)
+        *nfree = __atomic_load_n(&ifree_count, __ATOMIC_RELAXED);
+    return itab_blocks * IPB;
+}
+
+/* clear bits among the first 'n' of 'map' ('n' a multiple of 8),
+ * counted a 64-bit word at a time with popcount
+ */
+static int count_free(const unsigned char *map, int n)
+{
+    int used = 0, i = 0;
+
+    for (; i + 64 <= n; i += 64) {
+        uint64_t w;
+        memcpy(&w, map + i / 8, sizeof(w));
+        used += __builtin_popcountll(w);
+    }
+    for (; i < n; i += 8)
+        used += __builtin_popcount(map[i / 8]);
+    return n - used;
+}
+
+/* called at mount time: anything still dirty was written back to the
+ * previous image when it was closed
+ */
+int icache_init(const struct fs_super *sb)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < IHASH; i++) {
+        while (hash[i] != NULL) {
+            struct inode *ip = hash[i];
+            hash[i] = ip->hnext;
+            release(ip);
+        }
+    }
+    count = 0;
+    for (int i = 0; ind_cache != NULL && i < NIND; i++)
+        ind_cache[i].lba = 0;
+    memset(ind_hash, 0, sizeof(ind_hash));
+
+    free(imap);
+    imap = NULL;
+    itab_start = sb->itab_start;
+    itab_blocks = sb->itab_blocks;
+    imap_start = sb->imap_start;
+    imap_blocks = sb->imap_blocks;
+    ifree_count = 0;
+    pthread_mutex_unlock(&lock);
+    block_set_flush_hook(isync);
+
+    if (itab_start == 0)
+        return txn_map_init(&imap_bits, 0, 0, NULL, imap_free);
+    imap = malloc((size_t)imap_blocks * FS_BLOCK_SIZE);
+    if (imap == NULL || block_read(imap, imap_start, imap_blocks) < 0) {
+        itab_start = itab_blocks = 0;
+        return -EIO;
+    }
+    ifree_count = count_free(imap, itab_blocks * IPB);
+    return txn_map_init(&imap_bits, imap_start, imap_blocks, imap, imap_free);
+}
+
+int icache_count(void)
+{
+    return count;
+}
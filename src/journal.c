@@ -0,0 +1,670 @@
+/*
+ * file:        journal.c
+ * description: metadata journal (write-ahead log). Operations hand
+ *              the metadata blocks they change to the running
+ *              transaction instead of writing them in place. Every
+ *              operation open at the same time shares it, and the last
+ *              of them to finish writes the whole transaction to the
+ *              log as one record - one sequential write however many
+ *              blocks and operations it holds (group commit). Once an
+ *              operation is waiting to commit no new ones join, so a
+ *              transaction can't be kept open forever.
+ *
+ *              Logged blocks reach their home locations later, when
+ *              the log is checkpointed: by a background thread once it
+ *              is more than half full, by a commit that finds no room,
+ *              and at unmount. Until then reads get them from here. A
+ *              checkpoint writes every logged block home in LBA order,
+ *              syncing before (the records must be durable first) and
+ *              after, then moves the head block's start past them all,
+ *              leaving the log empty - so space is only ever reclaimed
+ *              all at once, and a record never has to wait for part of
+ *              the log to be freed. At mount time whatever records are
+ *              still there are written home again; the first one
+ *              missing or torn (wrong sequence number or CRC) ends the
+ *              log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/fs.h"
+#include "../include/block.h"
+#include "../include/crc32c.h"
+#include "../include/journal.h"
+
+/* the background thread looks at the log this often (seconds) even
+ * if nothing wakes it
+ */
+#define JOURNAL_INTERVAL 5
+
+/* a block the journal holds */
+struct jblock {
+    int            lba;
+    int            running;     /* changed in the running transaction */
+    char          *logged;      /* its copy in the log, until checkpointed */
+    struct jblock *hnext;
+    char           data[FS_BLOCK_SIZE];     /* newest contents */
+};
+
+static int (*dev_read)(const struct block_iov *iov, int iovcnt);
+static int (*dev_write)(const struct block_iov *iov, int iovcnt);
+static int (*dev_sync)(void);
+
+/* the lock covers everything below; read_lock is taken before it */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_rwlock_t read_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int active;
+static int start, nblocks;      /* the region */
+static int head;                /* where the next record goes */
+static uint32_t seq;            /* and its sequence number */
+static int used;                /* region blocks in live records (and ends skipped) */
+
+static struct jblock **hash;    /* 'nblocks' chains */
+static int nheld;
+
+/* the running transaction: its blocks, and the operations in it */
+static unsigned long txn = 1;
+static struct jblock **run;
+static int nrun, run_cap;
+static int nopen;
+static int closing;             /* someone waits to commit it: nobody joins */
+static int writing;             /* a record or a checkpoint is being written */
+static unsigned long done;      /* last transaction committed (or failed) */
+static unsigned long failed;    /* last one that failed */
+
+/* record buffers the logged copies point into, freed by checkpoints */
+static char **bufs;
+static int nbufs, bufs_cap;
+
+static pthread_t tid;
+static int thread_running;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+void journal_set_io(int (*read)(const struct block_iov *iov, int iovcnt),
+                    int (*write)(const struct block_iov *iov, int iovcnt),
+                    int (*sync)(void))
+{
+    dev_read = read;
+    dev_write = write;
+    dev_sync = sync;
+}
+
+static struct jblock **chain(int lba)
+{
+    return &hash[(unsigned)lba % nblocks];
+}
+
+static struct jblock *lookup(int lba)
+{
+    struct jblock *b = *chain(lba);
+
+    while (b != NULL && b->lba != lba)
+        b = b->hnext;
+    return b;
+}
+
+/* forget 'b'. Called with the lock held */
+static void drop(struct jblock *b)
+{
+    struct jblock **pp = chain(b->lba);
+
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+    free(b);
+    nheld--;
+}
+
+/* region blocks a transaction of 'n' blocks takes: its records'
+ * descriptors and the blocks
+ */
+static int rec_blocks(int n)
+{
+    return n + (n + JOURNAL_MAX - 1) / JOURNAL_MAX;
+}
+
+/* CRC of record 'd', with its blocks following it in memory */
+static uint32_t rec_crc(struct journal_desc *d)
+{
+    uint32_t saved = d->crc, crc;
+
+    d->crc = 0;
+    crc = crc32c(0, d, FS_BLOCK_SIZE);
+    d->crc = saved;
+    return crc32c(crc, (char *)d + FS_BLOCK_SIZE, (size_t)d->n * FS_BLOCK_SIZE);
+}
+
+static int write_head(void)
+{
+    struct journal_head h;
+    struct block_iov iov = {.lba = start, .buf = &h, .nblks = 1};
+
+    memset(&h, 0, sizeof(h));
+    h.magic = JOURNAL_MAGIC;
+    h.seq = seq;
+    h.start = head;
+    return dev_write(&iov, 1);
+}
+
+static int cmp_lba(const void *a, const void *b)
+{
+    const struct jblock *x = *(struct jblock *const *)a;
+    const struct jblock *y = *(struct jblock *const *)b;
+    return (x->lba > y->lba) - (x->lba < y->lba);
+}
+
+/* write every logged block home and empty the log. Called by the
+ * holder of 'writing', without the lock. Returns 0 or -EIO (the log
+ * is left as it was)
+ */
+static int checkpoint(void)
+{
+    struct jblock **cp;
+    struct block_iov *iov;
+    int n = 0, rv = 0;
+
+    pthread_mutex_lock(&lock);
+    if (used == 0) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    cp = malloc((nheld + 1) * sizeof(*cp));
+    iov = malloc((nheld + 1) * sizeof(*iov));
+    for (int i = 0; cp != NULL && i < nblocks; i++)
+        for (struct jblock *b = hash[i]; b != NULL; b = b->hnext)
+            if (b->logged != NULL)
+                cp[n++] = b;
+    pthread_mutex_unlock(&lock);
+    if (cp == NULL || iov == NULL) {
+        rv = -EIO;
+        goto out;
+    }
+
+    /* only this thread changes 'logged' pointers, 'head' and 'seq' */
+    qsort(cp, n, sizeof(*cp), cmp_lba);
+    for (int i = 0; i < n; i++)
+        iov[i] = (struct block_iov){.lba = cp[i]->lba, .buf = cp[i]->logged, .nblks = 1};
+    if (dev_sync() < 0 || (n > 0 && dev_write(iov, n) < 0) ||
+        dev_sync() < 0 || write_head() < 0) {
+        rv = -EIO;
+        goto out;
+    }
+
+    pthread_rwlock_wrlock(&read_lock);
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < n; i++) {
+        cp[i]->logged = NULL;
+        if (!cp[i]->running)
+            drop(cp[i]);
+    }
+    for (int i = 0; i < nbufs; i++)
+        free(bufs[i]);
+    nbufs = 0;
+    used = 0;
+    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&read_lock);
+
+out:
+    free(cp);
+    free(iov);
+    return rv;
+}
+
+/* write blocks of a transaction too big for the log straight home,
+ * after emptying the log (so nothing logged can land on them later)
+ */
+static int write_home(struct jblock **blk, int n, char *buf)
+{
+    struct block_iov *iov = malloc(n * sizeof(*iov));
+    int rv = -EIO;
+
+    if (iov != NULL && checkpoint() == 0) {
+        for (int i = 0; i < n; i++)
+            iov[i] = (struct block_iov){.lba = blk[i]->lba,
+                                        .buf = buf + (size_t)i * FS_BLOCK_SIZE, .nblks = 1};
+        rv = dev_write(iov, n);
+    }
+    free(iov);
+    return rv;
+}
+
+/* commit transaction 't' (no operation open in it): write it to the
+ * log as the next record, or records if it has more than JOURNAL_MAX
+ * blocks, making room first if the log is too full. If someone else
+ * is already writing, wait for them; if they take 't' too, just wait
+ * for it. Called and returns with the lock held
+ */
+static void commit(unsigned long t)
+{
+    while (writing && txn == t) {
+        closing = 1;
+        pthread_cond_wait(&changed, &lock);
+    }
+    if (txn != t) {
+        while (done < t)
+            pthread_cond_wait(&changed, &lock);
+        return;
+    }
+    writing = 1;
+    closing = 1;
+
+    int size = rec_blocks(nrun);
+    int gap = head + size > nblocks ? nblocks - head : 0;
+    if (size < nblocks && used + gap + size >= nblocks) {
+        pthread_mutex_unlock(&lock);
+        checkpoint();           /* if it fails, so does the write below */
+        pthread_mutex_lock(&lock);
+    }
+
+    /* copy the blocks into the record, and let new operations in */
+    int n = nrun, rv = 0, big = 0;
+    struct jblock **blk = malloc((n + 1) * sizeof(*blk));
+    size = rec_blocks(n);
+    char *buf = malloc((size_t)(size + 1) * FS_BLOCK_SIZE);
+    if (blk == NULL || buf == NULL) {
+        rv = -EIO;
+    }
+    if (rv == 0) {
+        memcpy(blk, run, n * sizeof(*blk));
+        big = size >= nblocks;
+    }
+    uint32_t s = seq;
+    for (int i = 0, k = 0; rv == 0 && i < n; ) {
+        int m = n - i < (int)JOURNAL_MAX ? n - i : (int)JOURNAL_MAX;
+        struct journal_desc *d = (struct journal_desc *)(buf + (size_t)k * FS_BLOCK_SIZE);
+        memset(d, 0, sizeof(*d));
+        d->magic = JOURNAL_MAGIC;
+        d->seq = s++;
+        d->n = m;
+        for (int j = 0; j < m; j++) {
+            d->lba[j] = blk[i + j]->lba;
+            memcpy((char *)d + (size_t)(j + 1) * FS_BLOCK_SIZE, blk[i + j]->data, FS_BLOCK_SIZE);
+        }
+        d->crc = rec_crc(d);
+        i += m;
+        k += m + 1;
+    }
+    for (int i = 0; i < nrun; i++)
+        run[i]->running = 0;
+    nrun = 0;
+    txn++;
+    closing = 0;
+    pthread_cond_broadcast(&changed);
+
+    /* where it goes: at the head, or at the start if it doesn't fit
+     * before the end
+     */
+    int off = head + size > nblocks ? 1 : head;
+    int skip = off == head ? 0 : nblocks - head;
+    pthread_mutex_unlock(&lock);
+
+    if (rv == 0 && n > 0 && big) {
+        rv = write_home(blk, n, buf);   /* not atomic, but in order */
+    } else if (rv == 0 && n > 0) {
+        struct block_iov iov = {.lba = start + off, .buf = buf, .nblks = size};
+        if (used + skip + size >= nblocks)
+            rv = -EIO;                  /* no room: the checkpoint failed */
+        else
+            rv = dev_write(&iov, 1);
+    }
+
+    if (rv == 0 && n > 0 && big) {
+        pthread_rwlock_wrlock(&read_lock);
+        pthread_mutex_lock(&lock);
+        for (int i = 0; i < n; i++)
+            if (!blk[i]->running)
+                drop(blk[i]);
+        pthread_rwlock_unlock(&read_lock);
+    } else {
+        pthread_mutex_lock(&lock);
+    }
+    if (rv == 0 && n > 0 && !big && nbufs == bufs_cap) {
+        char **p = realloc(bufs, (bufs_cap * 2 + 8) * sizeof(*bufs));
+        if (p == NULL)
+            rv = -EIO;          /* logged, but not trusted: done again */
+        else {
+            bufs = p;
+            bufs_cap = bufs_cap * 2 + 8;
+        }
+    }
+    if (rv == 0 && n > 0 && !big) {
+        for (int i = 0, k = 0; i < n; k++) {
+            int m = n - i < (int)JOURNAL_MAX ? n - i : (int)JOURNAL_MAX;
+            for (int j = 0; j < m; j++)
+                blk[i + j]->logged = buf + (size_t)(k + 1 + j) * FS_BLOCK_SIZE;
+            i += m;
+            k += m;
+        }
+        bufs[nbufs++] = buf;
+        buf = NULL;
+        head = off + size;
+        used += skip + size;
+        seq = s;
+        if (used * 2 > nblocks)
+            pthread_cond_signal(&wake);
+    }
+    if (rv < 0) {
+        failed = t;
+    }
+    done = t;
+    writing = 0;
+    pthread_cond_broadcast(&changed);
+    free(blk);
+    free(buf);
+}
+
+void journal_begin(void)
+{
+    pthread_mutex_lock(&lock);
+    while (closing)
+        pthread_cond_wait(&changed, &lock);
+    nopen++;
+    pthread_mutex_unlock(&lock);
+}
+
+int journal_end(void)
+{
+    pthread_mutex_lock(&lock);
+    unsigned long t = txn;
+    if (--nopen > 0) {
+        closing = 1;
+        while (done < t)
+            pthread_cond_wait(&changed, &lock);
+    } else {
+        commit(t);
+    }
+    int rv = failed == t ? -EIO : 0;
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+int journal_add(const struct block_iov *iov, int iovcnt)
+{
+    int rv = 0;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < iovcnt && rv == 0; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            int lba = iov[i].lba + j;
+            struct jblock *b = lookup(lba);
+            if (nrun == run_cap) {
+                struct jblock **p = realloc(run, (run_cap * 2 + 16) * sizeof(*run));
+                if (p == NULL) {
+                    rv = -ENOMEM;
+                    break;
+                }
+                run = p;
+                run_cap = run_cap * 2 + 16;
+            }
+            if (b == NULL) {
+                if ((b = malloc(sizeof(*b))) == NULL) {
+                    rv = -ENOMEM;
+                    break;
+                }
+                b->lba = lba;
+                b->running = 0;
+                b->logged = NULL;
+                b->hnext = *chain(lba);
+                *chain(lba) = b;
+                nheld++;
+            }
+            if (!b->running) {
+                run[nrun++] = b;
+                b->running = 1;
+            }
+            memcpy(b->data, (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+/* does the journal hold any of these blocks? Called with the lock held */
+static int held(const struct block_iov *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt && nheld > 0; i++)
+        for (int j = 0; j < iov[i].nblks; j++)
+            if (lookup(iov[i].lba + j) != NULL)
+                return 1;
+    return 0;
+}
+
+int journal_forget(const struct block_iov *iov, int iovcnt)
+{
+    int logged = 0, rv = 0;
+
+    /* a record being written may still point at them */
+    pthread_mutex_lock(&lock);
+    while (writing && held(iov, iovcnt))
+        pthread_cond_wait(&changed, &lock);
+    for (int i = 0; i < iovcnt && nheld > 0; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            struct jblock *b = lookup(iov[i].lba + j);
+            if (b == NULL)
+                continue;
+            if (b->running) {
+                int k = 0;
+                while (run[k] != b)
+                    k++;
+                run[k] = run[--nrun];
+                b->running = 0;
+            }
+            if (b->logged != NULL)
+                logged = 1;     /* the checkpoint drops it */
+            else
+                drop(b);
+        }
+    }
+    if (logged) {
+        while (writing)
+            pthread_cond_wait(&changed, &lock);
+        writing = 1;
+        pthread_mutex_unlock(&lock);
+        rv = checkpoint();
+        pthread_mutex_lock(&lock);
+        writing = 0;
+        pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+void journal_read_lock(void)
+{
+    pthread_rwlock_rdlock(&read_lock);
+}
+
+void journal_read_unlock(void)
+{
+    pthread_rwlock_unlock(&read_lock);
+}
+
+void journal_overlay(const struct block_iov *iov, int iovcnt)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < iovcnt && nheld > 0; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            struct jblock *b = lookup(iov[i].lba + j);
+            if (b != NULL)
+                memcpy((char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE, b->data, FS_BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* the record at region block 'pos', read into 'buf' (descriptor, then
+ * its blocks). Returns it, or NULL if there is no valid record there
+ * with sequence number 'seq'
+ */
+static struct journal_desc *read_record(int pos, char *buf)
+{
+    struct journal_desc *d = (struct journal_desc *)buf;
+    struct block_iov iov = {.lba = start + pos, .buf = buf, .nblks = 1};
+
+    if (dev_read(&iov, 1) < 0 || d->magic != JOURNAL_MAGIC || d->seq != seq ||
+        d->n == 0 || d->n > JOURNAL_MAX || pos + 1 + (int)d->n > nblocks)
+        return NULL;
+    iov = (struct block_iov){.lba = start + pos + 1, .buf = buf + FS_BLOCK_SIZE, .nblks = d->n};
+    if (dev_read(&iov, 1) < 0 || rec_crc(d) != d->crc)
+        return NULL;
+    return d;
+}
+
+int journal_replay(int first, int n, int fresh)
+{
+    struct journal_head h;
+    struct block_iov iov = {.lba = first, .buf = &h, .nblks = 1};
+    struct block_iov *home = malloc(JOURNAL_MAX * sizeof(*home));
+    char *buf = malloc((JOURNAL_MAX + 1) * FS_BLOCK_SIZE);
+    int count = 0, rv = 0;
+
+    start = first;
+    nblocks = n;
+    used = 0;
+    if (home == NULL || buf == NULL || n < 2) {
+        rv = -EIO;
+        goto out;
+    }
+    if (fresh) {
+        head = 1;
+        seq = 1;
+        rv = write_head() < 0 ? -EIO : 0;
+        goto out;
+    }
+    if (dev_read(&iov, 1) < 0 || h.magic != JOURNAL_MAGIC ||
+        h.start < 1 || (int)h.start >= n) {
+        fprintf(stderr, "journal head block is unreadable\n");
+        rv = -EIO;
+        goto out;
+    }
+    head = h.start;
+    seq = h.seq;
+
+    for (;;) {
+        struct journal_desc *d = read_record(head, buf);
+        if (d == NULL && head != 1 && (d = read_record(1, buf)) != NULL)
+            head = 1;           /* it didn't fit before the end */
+        if (d == NULL)
+            break;
+        for (int i = 0; i < (int)d->n; i++)
+            home[i] = (struct block_iov){.lba = d->lba[i],
+                                         .buf = buf + (size_t)(i + 1) * FS_BLOCK_SIZE, .nblks = 1};
+        if (dev_write(home, d->n) < 0) {
+            rv = -EIO;
+            goto out;
+        }
+        head += 1 + d->n;
+        seq++;
+        count++;
+    }
+    if (count > 0 && (dev_sync() < 0 || write_head() < 0))
+        rv = -EIO;
+
+out:
+    free(home);
+    free(buf);
+    return rv < 0 ? rv : count;
+}
+
+/* background checkpoints: when a commit leaves the log more than half
+ * full, or now and then, also committing blocks added outside any
+ * operation
+ */
+static void *checkpointer(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    while (thread_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += JOURNAL_INTERVAL;
+        pthread_cond_timedwait(&wake, &lock, &ts);
+        if (!thread_running)
+            break;
+        if (nopen == 0 && nrun > 0)
+            commit(txn);
+        if (used * 2 > nblocks && !writing) {
+            writing = 1;
+            pthread_mutex_unlock(&lock);
+            if (checkpoint() < 0)
+                fprintf(stderr, "journal checkpoint failed\n");
+            pthread_mutex_lock(&lock);
+            writing = 0;
+            pthread_cond_broadcast(&changed);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int journal_open(void)
+{
+    if ((hash = calloc(nblocks, sizeof(*hash))) == NULL)
+        return -ENOMEM;
+    nheld = nrun = nopen = 0;
+    closing = writing = 0;
+    txn = 1;
+    done = failed = 0;
+    active = 1;
+    thread_running = 1;
+    if (pthread_create(&tid, NULL, checkpointer, NULL) != 0)
+        thread_running = 0;     /* checkpoints only when the log fills */
+    return 0;
+}
+
+int journal_active(void)
+{
+    return active;
+}
+
+void journal_close(void)
+{
+    if (!active)
+        return;
+
+    pthread_mutex_lock(&lock);
+    int running = thread_running;
+    thread_running = 0;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    if (running)
+        pthread_join(tid, NULL);
+
+    pthread_mutex_lock(&lock);
+    commit(txn);
+    while (writing)
+        pthread_cond_wait(&changed, &lock);
+    writing = 1;
+    pthread_mutex_unlock(&lock);
+    if (checkpoint() < 0)
+        fprintf(stderr, "journal checkpoint failed, replayed at next mount\n");
+
+    /* blocks whose record couldn't be written go home as they are */
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < nblocks; i++) {
+        while (hash[i] != NULL) {
+            struct jblock *b = hash[i];
+            struct block_iov iov = {.lba = b->lba, .buf = b->data, .nblks = 1};
+            if (b->logged == NULL && dev_write(&iov, 1) < 0)
+                fprintf(stderr, "cannot write block %d\n", b->lba);
+            drop(b);
+        }
+    }
+    for (int i = 0; i < nbufs; i++)
+        free(bufs[i]);
+    nbufs = 0;
+    free(hash);
+    hash = NULL;
+    nrun = 0;
+    used = 0;
+    active = 0;
+    writing = 0;
+    pthread_mutex_unlock(&lock);
+}
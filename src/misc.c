@@ -1,72 +1,935 @@
 /*
  * file:        misc.c
- * description: various support functions for file system
- *              startup argument parsing and checking, etc.
+ * description: block layer: block cache, write-back and I/O
+ *              statistics on top of a pluggable backend (filedev.c,
+ *              ramdisk.c), and image startup.
  *
  */
 
+#define _DEFAULT_SOURCE
 #define _XOPEN_SOURCE 500
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
-#include <fcntl.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "../include/fs.h"        /* only for FS_BLOCK_SIZE */
+#include "../include/block.h"
+#include "../include/blockdev.h"
+#include "../include/cache.h"
+#include "../include/csum.h"
+#include "../include/journal.h"
 
-/*********** DO NOT MODIFY THIS FILE *************/
+/* runs handled on the stack before falling back to malloc
+ */
+#define IOV_BATCH 64
+
+/* All disk I/O goes through the backend in 'dev'
+ */
+static struct blockdev *dev;
+
+static struct block_stats stats;
+
+static int uring_depth;         /* non-zero once io_uring was requested */
+static int map_requested;       /* -mmap */
+static int discard_on;          /* -discard */
+static int journal_lba, journal_nblks;  /* the journal region, if any */
+
+/* write-back state (-durability periodic|lazy). The flusher thread
+ * cleans the cache every 'flush_interval' seconds (periodic mode
+ * only) or as soon as more than DIRTY_RATIO percent of it is dirty.
+ */
+#define DIRTY_RATIO 50
+
+static int durability = BLOCK_SYNC;
+static int flush_interval;
+static int cache_nbufs;
+static int flusher_running;
+static pthread_t flusher_tid;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+
+/* run before the cache is cleaned (block_set_flush_hook) */
+static int (*flush_hook)(void);
+
+/* shared by all device I/O, exclusive for a scrub batch
+ */
+static pthread_rwlock_t io_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* background scrub (-scrub): 'scrub_rate' bytes per second
+ */
+#define SCRUB_BATCH 16
+
+static long scrub_rate;
+static int scrub_running;
+static pthread_t scrub_tid;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wake = PTHREAD_COND_INITIALIZER;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/* checksummed write: record the new checksums and write the region
+ * blocks holding them in the same device request as the data
+ */
+static int csum_write(const struct block_iov *iov, int iovcnt)
+{
+    int ncs = csum_nblocks(), n = iovcnt, rv = -EIO;
+    struct block_iov *all = malloc((iovcnt + ncs) * sizeof(*all));
+    unsigned char *touched = calloc(ncs, 1);
+    char *cbuf = malloc((size_t)ncs * FS_BLOCK_SIZE);
+
+    if (all == NULL || touched == NULL || cbuf == NULL)
+        goto out;
+
+    memcpy(all, iov, iovcnt * sizeof(*iov));
+    for (int i = 0; i < iovcnt; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            int idx = csum_update(iov[i].lba + j,
+                                  (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE);
+            if (idx >= 0)
+                touched[idx] = 1;
+        }
+    }
+    for (int idx = 0; idx < ncs; idx++) {
+        if (!touched[idx])
+            continue;
+        char *b = cbuf + (size_t)idx * FS_BLOCK_SIZE;
+        csum_save_block(idx, b);
+        all[n].lba = csum_start() + idx;
+        all[n].buf = b;
+        all[n].nblks = 1;
+        n++;
+    }
+    rv = dev->ops->write(dev, all, n);
+
+out:
+    free(all);
+    free(touched);
+    free(cbuf);
+    return rv;
+}
+
+/* check every block of a completed read against its checksum
+ */
+static int csum_check(const struct block_iov *iov, int iovcnt)
+{
+    int rv = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            int lba = iov[i].lba + j;
+            if (csum_verify(lba, (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE) < 0) {
+                fprintf(stderr, "checksum error in block %d\n", lba);
+                STAT_ADD(csum_errors, 1);
+                rv = -EIO;
+            }
+        }
+    }
+    return rv;
+}
+
+/* hand a run list to the backend, keeping checksums in step, and
+ * count the blocks moved. The scrubber takes io_lock exclusively so
+ * it never sees data and checksum halfway through an update.
+ */
+static int dev_io(int write, const struct block_iov *iov, int iovcnt)
+{
+    unsigned long nblks = 0;
+    int rv;
 
-/* All disk I/O is accessed through these functions
+    for (int i = 0; i < iovcnt; i++)
+        nblks += iov[i].nblks;
+
+    pthread_rwlock_rdlock(&io_lock);
+    if (!csum_active())
+        rv = write ? dev->ops->write(dev, iov, iovcnt) :
+                     dev->ops->read(dev, iov, iovcnt);
+    else if (write)
+        rv = csum_write(iov, iovcnt);
+    else if ((rv = dev->ops->read(dev, iov, iovcnt)) == 0)
+        rv = csum_check(iov, iovcnt);
+    pthread_rwlock_unlock(&io_lock);
+
+    if (rv == 0) {
+        if (write)
+            STAT_ADD(writes, nblks);
+        else
+            STAT_ADD(reads, nblks);
+    }
+    return rv;
+}
+
+static int dev_rw(int write, const struct block_iov *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+        assert(!write || iov[i].lba > 0);  /* write to 0 is *always* an error */
+    return dev_io(write, iov, iovcnt);
+}
+
+/* device write used by the cache to clean dirty buffers
  */
-static int disk_fd;
+static int dev_write(const struct block_iov *iov, int iovcnt)
+{
+    return dev_rw(1, iov, iovcnt);
+}
+
+/* cached read: copy whatever the cache has, then fetch the remaining
+ * blocks - plus any uncached readahead blocks in 'ahead' - from the
+ * device in one vectored call and remember them
+ */
+static int cached_read(const struct block_iov *iov, int iovcnt,
+                       const int *ahead, int nahead)
+{
+    struct block_iov mbuf[IOV_BATCH], *miss = mbuf;
+    char *ra_buf = NULL;
+    int nblks = nahead, nmiss = 0, ndemand, rv = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        nblks += iov[i].nblks;
+    if (nblks > IOV_BATCH && (miss = malloc(nblks * sizeof(*miss))) == NULL)
+        return -EIO;
+
+    unsigned long seq = cache_seq();
+    for (int i = 0; i < iovcnt; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            char *buf = (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE;
+            if (!cache_read(iov[i].lba + j, buf)) {
+                miss[nmiss].lba = iov[i].lba + j;
+                miss[nmiss].buf = buf;
+                miss[nmiss].nblks = 1;
+                nmiss++;
+            }
+        }
+    }
+    ndemand = nmiss;
+
+    /* readahead is best effort: no memory, no readahead, and never
+     * more than a quarter of the cache so it can't flush itself out
+     */
+    if (nahead > cache_nbufs / 4)
+        nahead = cache_nbufs / 4;
+    if (nahead > 0 && (ra_buf = malloc((size_t)nahead * FS_BLOCK_SIZE)) != NULL) {
+        for (int i = 0; i < nahead; i++) {
+            if (ahead[i] <= 0 || cache_contains(ahead[i]))
+                continue;
+            miss[nmiss].lba = ahead[i];
+            miss[nmiss].buf = ra_buf + (size_t)i * FS_BLOCK_SIZE;
+            miss[nmiss].nblks = 1;
+            nmiss++;
+        }
+    }
+
+    if (nmiss > 0 && (rv = dev_rw(0, miss, nmiss)) == 0) {
+        for (int i = 0; i < nmiss; i++)
+            cache_fill(miss[i].lba, miss[i].buf, seq, i >= ndemand);
+    }
+
+    free(ra_buf);
+    if (miss != mbuf)
+        free(miss);
+    return rv;
+}
+
+/* the cache is bypassed when the device is addressable memory (a
+ * mapped image, the RAM disk) - the device already is the cache
+ */
+static int use_cache(void)
+{
+    return block_map(0) == NULL && cache_enabled();
+}
+
+/* read a list of block runs from disk image. Returns -EIO if error,
+ * 0 otherwise
+ */
+int block_preadv(const struct block_iov *iov, int iovcnt)
+{
+    return block_preadv_ahead(iov, iovcnt, NULL, 0);
+}
+
+/* block_preadv, and also bring the blocks in 'ahead' into the cache
+ * in the same device request. Readahead needs the cache; without it
+ * (or when the device is memory) 'ahead' is ignored.
+ */
+int block_preadv_ahead(const struct block_iov *iov, int iovcnt,
+                       const int *ahead, int nahead)
+{
+    int rv;
+
+    if (!journal_active()) {
+        if (use_cache())
+            return cached_read(iov, iovcnt, ahead, nahead);
+        return dev_rw(0, iov, iovcnt);
+    }
+
+    /* blocks committed but not yet checkpointed are newer in the
+     * journal than on the device (or in the cache)
+     */
+    journal_read_lock();
+    if (use_cache())
+        rv = cached_read(iov, iovcnt, ahead, nahead);
+    else
+        rv = dev_rw(0, iov, iovcnt);
+    if (rv == 0)
+        journal_overlay(iov, iovcnt);
+    journal_read_unlock();
+    return rv;
+}
+
+/* write-back: dirty the cached copies and leave the device write to
+ * the flusher, waking it early if too much of the cache is dirty
+ */
+static int write_back(const struct block_iov *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        assert(iov[i].lba > 0);     /* write to 0 is *always* an error */
+        for (int j = 0; j < iov[i].nblks; j++)
+            cache_write(iov[i].lba + j,
+                        (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE);
+    }
+    if (cache_dirty() * 100 > cache_nbufs * DIRTY_RATIO) {
+        pthread_mutex_lock(&flusher_lock);
+        pthread_cond_signal(&flusher_wake);
+        pthread_mutex_unlock(&flusher_lock);
+    }
+    return 0;
+}
+
+/* write a list of block runs to disk image. In sync mode this is
+ * write-through (cached copies are updated once the device write
+ * succeeded); otherwise the blocks only go to the cache. Returns -EIO
+ * if error, 0 otherwise
+ */
+static int write_through(const struct block_iov *iov, int iovcnt)
+{
+    int rv = dev_rw(1, iov, iovcnt);
+
+    if (rv == 0 && use_cache()) {
+        for (int i = 0; i < iovcnt; i++)
+            for (int j = 0; j < iov[i].nblks; j++)
+                cache_update(iov[i].lba + j,
+                             (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE);
+    }
+    return rv;
+}
+
+int block_pwritev(const struct block_iov *iov, int iovcnt)
+{
+    if (journal_active() && journal_forget(iov, iovcnt) < 0)
+        return -EIO;
+    if (durability != BLOCK_SYNC && use_cache())
+        return write_back(iov, iovcnt);
+    return write_through(iov, iovcnt);
+}
+
+/* metadata: part of the running operation's transaction when the
+ * journal is on, a plain write otherwise
+ */
+int block_commit(const struct block_iov *iov, int iovcnt)
+{
+    if (!journal_active() || block_writeback())
+        return block_pwritev(iov, iovcnt);
+    for (int i = 0; i < iovcnt; i++)
+        assert(iov[i].lba > 0);     /* write to 0 is *always* an error */
+    return journal_add(iov, iovcnt);
+}
+
+void block_op_begin(void)
+{
+    if (journal_active())
+        journal_begin();
+}
+
+int block_op_end(void)
+{
+    return journal_active() ? journal_end() : 0;
+}
 
 /* read blocks from disk image. Returns -EIO if error, 0 otherwise
  */
-int block_read(char *buf, int lba, int nblks)
+int block_read(void *buf, int lba, int nblks)
+{
+    struct block_iov iov = {.lba = lba, .buf = buf, .nblks = nblks};
+    return block_preadv(&iov, 1);
+}
+
+/* write blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int block_write(void *buf, int lba, int nblks)
+{
+    struct block_iov iov = {.lba = lba, .buf = buf, .nblks = nblks};
+    return block_pwritev(&iov, 1);
+}
+
+/* the superblock is the one block block_write refuses; updating it
+ * is explicit. Written through (and synced with the rest of the
+ * image) in every durability mode.
+ */
+int block_write_super(void *buf)
+{
+    struct block_iov iov = {.lba = 0, .buf = buf, .nblks = 1};
+    int rv = dev_io(1, &iov, 1);
+
+    if (rv == 0) {
+        if (use_cache())
+            cache_update(0, buf);
+    }
+    return rv;
+}
+
+void block_get_stats(struct block_stats *st)
+{
+    struct cache_stats cs;
+
+    *st = stats;
+    st->syscalls = dev != NULL ? dev->syscalls : 0;
+    cache_get_stats(&cs);
+    st->cache_hits = cs.hits;
+    st->cache_misses = cs.misses;
+    st->cache_evictions = cs.evictions;
+    st->cache_writebacks = cs.writebacks;
+    st->readahead = cs.ra_fills;
+    st->readahead_hits = cs.ra_hits;
+}
+
+void block_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    if (dev != NULL)
+        dev->syscalls = 0;
+    cache_reset_stats();
+}
+
+/* size the block cache; 0 turns it off. Returns 0, or -1 if the
+ * memory could not be allocated (caching is then off)
+ */
+int block_cache_init(size_t bytes)
+{
+    cache_flush();              /* resizing drops the cached blocks */
+    cache_set_writeback(dev_write);
+    int rv = cache_init(bytes);
+    if (rv < 0)
+        fprintf(stderr, "cannot allocate %zu byte block cache\n", bytes);
+    cache_nbufs = rv < 0 ? 0 : bytes / FS_BLOCK_SIZE;
+    return rv;
+}
+
+static int start_scrub(void);
+
+/* write the whole checksum region. Concurrent writers each write
+ * the region blocks they touched, but not necessarily in order; this
+ * puts the current table on disk at a sync point.
+ */
+static int csum_write_region(void)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    int n = csum_nblocks(), rv = -EIO;
+    struct block_iov iov = {.lba = csum_start(), .nblks = n};
 
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
+    if ((iov.buf = malloc((size_t)n * FS_BLOCK_SIZE)) == NULL)
         return -EIO;
-    if (read(disk_fd, buf, len) != len)
+    for (int i = 0; i < n; i++)
+        csum_save_block(i, (char *)iov.buf + (size_t)i * FS_BLOCK_SIZE);
+    pthread_rwlock_rdlock(&io_lock);
+    rv = dev->ops->write(dev, &iov, 1);
+    pthread_rwlock_unlock(&io_lock);
+    free(iov.buf);
+    return rv;
+}
+
+/* start checksumming with the region at [start, start + nblocks).
+ * 'fresh' means the region was just allocated: checksum every block
+ * of the device and write it out; otherwise load it. Returns 0, or
+ * -EIO (checksums stay off)
+ */
+int block_csum_init(int start, int nblocks, int fresh)
+{
+    long size = block_size();
+    char *buf = malloc((size_t)SCRUB_BATCH * FS_BLOCK_SIZE);
+    int rv = -EIO;
+
+    if (buf == NULL || size < 0 || start <= 0 || start + nblocks > size ||
+        (size_t)nblocks * CSUM_PER_BLOCK < (size_t)size ||
+        csum_init(start, nblocks) < 0)
+        goto out;
+
+    if (!fresh) {
+        for (int i = 0; i < nblocks; i++) {
+            struct block_iov iov = {.lba = start + i, .buf = buf, .nblks = 1};
+            if (dev->ops->read(dev, &iov, 1) < 0)
+                goto fail;
+            csum_load_block(i, buf);
+        }
+        rv = 0;
+        goto out;
+    }
+
+    for (long lba = 0; lba < size; lba += SCRUB_BATCH) {
+        struct block_iov iov = {.lba = lba, .buf = buf, .nblks = SCRUB_BATCH};
+        if (lba + SCRUB_BATCH > size)
+            iov.nblks = size - lba;
+        if (dev->ops->read(dev, &iov, 1) < 0)
+            goto fail;
+        for (int j = 0; j < iov.nblks; j++)
+            csum_update(lba + j, buf + (size_t)j * FS_BLOCK_SIZE);
+    }
+    if (csum_write_region() == 0) {
+        rv = 0;
+        goto out;
+    }
+
+fail:
+    csum_exit();
+out:
+    if (rv < 0)
+        fprintf(stderr, "cannot set up block checksums\n");
+    else
+        start_scrub();
+    free(buf);
+    return rv;
+}
+
+/* the journal's device access. Its records don't go in the cache;
+ * blocks it writes home do, like any other write
+ */
+static int journal_dev_read(const struct block_iov *iov, int iovcnt)
+{
+    return dev_rw(0, iov, iovcnt);
+}
+
+static int journal_dev_write(const struct block_iov *iov, int iovcnt)
+{
+    int rv = dev_rw(1, iov, iovcnt);
+
+    if (rv == 0 && use_cache()) {
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].lba >= journal_lba && iov[i].lba < journal_lba + journal_nblks)
+                continue;
+            for (int j = 0; j < iov[i].nblks; j++)
+                cache_update(iov[i].lba + j,
+                             (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE);
+        }
+    }
+    return rv;
+}
+
+static int journal_dev_sync(void)
+{
+    return dev->ops->flush(dev);
+}
+
+/* replay the journal in [start, start + nblocks) (or set up a 'fresh'
+ * one), then journal metadata from now on - unless the device is
+ * memory or writes are deferred, where there is nothing to gain.
+ * Returns the number of records replayed, or -EIO
+ */
+int block_journal_init(int start, int nblocks, int fresh)
+{
+    long size = block_size();
+    int rv;
+
+    journal_close();
+    if (start <= 0 || start + nblocks > size) {
+        fprintf(stderr, "bad journal region %d+%d\n", start, nblocks);
         return -EIO;
+    }
+    journal_lba = start;
+    journal_nblks = nblocks;
+    journal_set_io(journal_dev_read, journal_dev_write, journal_dev_sync);
+    if ((rv = journal_replay(start, nblocks, fresh)) < 0) {
+        fprintf(stderr, "cannot replay journal\n");
+        return rv;
+    }
+    if (block_map(0) == NULL && !block_writeback() && journal_open() < 0)
+        fprintf(stderr, "cannot start journal, writing metadata in place\n");
+    return rv;
+}
+
+/* background scrub: read the whole device over and over, SCRUB_BATCH
+ * blocks at a time, checking every block against its checksum and
+ * sleeping between batches to stay under scrub_rate bytes/second
+ */
+static void *scrubber(void *arg)
+{
+    char *buf = malloc((size_t)SCRUB_BATCH * FS_BLOCK_SIZE);
+    long size = block_size(), lba = 0;
+    double pause = (double)SCRUB_BATCH * FS_BLOCK_SIZE / scrub_rate;
+
+    pthread_mutex_lock(&scrub_lock);
+    while (scrub_running && buf != NULL && size > 0) {
+        pthread_mutex_unlock(&scrub_lock);
+
+        struct block_iov iov = {.lba = lba, .buf = buf, .nblks = SCRUB_BATCH};
+        if (lba + SCRUB_BATCH > size)
+            iov.nblks = size - lba;
+        pthread_rwlock_wrlock(&io_lock);
+        int rv = dev->ops->read(dev, &iov, 1);
+        for (int j = 0; rv == 0 && j < iov.nblks; j++) {
+            if (csum_verify(lba + j, buf + (size_t)j * FS_BLOCK_SIZE) < 0) {
+                fprintf(stderr, "scrub: checksum error in block %ld\n", lba + j);
+                STAT_ADD(csum_errors, 1);
+            }
+        }
+        pthread_rwlock_unlock(&io_lock);
+        if (rv < 0)
+            fprintf(stderr, "scrub: cannot read block %ld\n", lba);
+        STAT_ADD(scrubbed, iov.nblks);
+        lba = lba + iov.nblks < size ? lba + iov.nblks : 0;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long ns = ts.tv_nsec + (long)(pause * 1e9);
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pthread_mutex_lock(&scrub_lock);
+        if (scrub_running)
+            pthread_cond_timedwait(&scrub_wake, &scrub_lock, &ts);
+    }
+    pthread_mutex_unlock(&scrub_lock);
+    free(buf);
+    return NULL;
+}
+
+static void stop_scrub(void)
+{
+    pthread_mutex_lock(&scrub_lock);
+    int running = scrub_running;
+    scrub_running = 0;
+    pthread_cond_signal(&scrub_wake);
+    pthread_mutex_unlock(&scrub_lock);
+    if (running)
+        pthread_join(scrub_tid, NULL);
+}
+
+static int start_scrub(void)
+{
+    if (scrub_rate <= 0 || !csum_active())
+        return 0;
+    scrub_running = 1;
+    if (pthread_create(&scrub_tid, NULL, scrubber, NULL) != 0) {
+        scrub_running = 0;
+        return -1;
+    }
     return 0;
 }
 
-/* write blocks from disk image. Returns -EIO if error, 0 otherwise
+/* scrub the device in the background at up to 'rate' bytes/second
+ * (0 stops it). Scrubbing needs checksums; if they are not set up
+ * yet it starts once block_csum_init() succeeds. Returns 0 or -1
  */
-int block_write(char *buf, int lba, int nblks)
+int block_scrub(long rate)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    stop_scrub();
+    scrub_rate = rate;
+    return start_scrub();
+}
 
-    assert(lba > 0);		/* write to 0 is *always* an error */
-    
-    /* Seek to the *end* of the region being written, to make sure it
-     * all fits on the disk image. Then seek to write location.
-     */
-    if (lseek(disk_fd, start + len, SEEK_SET) < 0)
+/* background flusher: in periodic mode wake up every flush_interval
+ * seconds, in both write-back modes when write_back() finds the cache
+ * too dirty
+ */
+static void *flusher(void *arg)
+{
+    pthread_mutex_lock(&flusher_lock);
+    while (flusher_running) {
+        if (durability == BLOCK_PERIODIC) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += flush_interval;
+            pthread_cond_timedwait(&flusher_wake, &flusher_lock, &ts);
+        } else {
+            pthread_cond_wait(&flusher_wake, &flusher_lock);
+        }
+        if (!flusher_running)
+            break;
+        pthread_mutex_unlock(&flusher_lock);
+        if ((flush_hook != NULL && flush_hook() < 0) || cache_flush() < 0)
+            fprintf(stderr, "background flush failed\n");
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+static void stop_flusher(void)
+{
+    pthread_mutex_lock(&flusher_lock);
+    int running = flusher_running;
+    flusher_running = 0;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+    if (running)
+        pthread_join(flusher_tid, NULL);
+}
+
+/* select sync (write-through), periodic or lazy write-back. Write-back
+ * needs the block cache; without one writes stay synchronous. Returns
+ * 0, or -1 if the flusher thread could not be started
+ */
+int block_durability(int mode, int interval)
+{
+    stop_flusher();
+    block_flush(0);
+    durability = mode;
+    flush_interval = interval > 0 ? interval : 1;
+    if (mode == BLOCK_SYNC)
+        return 0;
+
+    flusher_running = 1;
+    if (pthread_create(&flusher_tid, NULL, flusher, NULL) != 0) {
+        fprintf(stderr, "cannot start flusher, using sync writes\n");
+        flusher_running = 0;
+        durability = BLOCK_SYNC;
+        return -1;
+    }
+    return 0;
+}
+
+/* write back all dirty blocks; with 'sync' also force the image to
+ * stable storage. Returns -EIO if error, 0 otherwise
+ */
+int block_flush(int sync)
+{
+    if (flush_hook != NULL && flush_hook() < 0)
         return -EIO;
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
+    if (cache_flush() < 0)
         return -EIO;
-    if (write(disk_fd, buf, len) != len)
+    if (!sync || dev == NULL)
+        return 0;
+    if (csum_active() && csum_write_region() < 0)
         return -EIO;
-    return 0;
+    return dev->ops->flush(dev);
+}
+
+void block_set_flush_hook(int (*fn)(void))
+{
+    flush_hook = fn;
+}
+
+/* nonzero if writes are currently left in the cache for the flusher
+ * rather than written through
+ */
+int block_writeback(void)
+{
+    return durability != BLOCK_SYNC && use_cache();
+}
+
+/* unmount: stop the flusher and make everything durable
+ */
+void block_exit(void)
+{
+    journal_close();
+    stop_scrub();
+    stop_flusher();
+    if (block_flush(1) < 0)
+        fprintf(stderr, "final flush failed, image may be stale\n");
+    durability = BLOCK_SYNC;
+}
+
+/* switch to io_uring submission. Returns 0 on success, or -errno
+ * when io_uring is unavailable, in which case I/O stays on
+ * preadv/pwritev
+ */
+int block_uring_init(int depth)
+{
+    uring_depth = depth;
+    int rv = filedev_uring(dev, depth);
+    if (rv < 0)
+        fprintf(stderr, "io_uring unavailable (%s), using preadv/pwritev\n",
+                strerror(-rv));
+    return rv;
+}
+
+/* map the whole image into memory. Block reads and writes become
+ * memcpy, and block_map() hands out pointers straight into the image.
+ * Returns 0 or -errno (in which case normal I/O is used)
+ */
+int block_mmap_init(void)
+{
+    map_requested = 1;
+    int rv = filedev_mmap(dev);
+    if (rv < 0)
+        fprintf(stderr, "cannot mmap image (%s), using read/write\n",
+                strerror(-rv));
+    return rv;
+}
+
+void block_io_reset(void)
+{
+    uring_depth = 0;
+    map_requested = 0;
+}
+
+/* pointer to block 'lba' inside the image if the device is memory
+ * (mapped image or RAM disk), NULL otherwise (or if lba is out of
+ * range)
+ */
+void *block_map(int lba)
+{
+    if (dev == NULL || dev->ops->map == NULL)
+        return NULL;
+    return dev->ops->map(dev, lba);
+}
+
+const void *block_map_read(int lba)
+{
+    return csum_active() ? NULL : block_map(lba);
+}
+
+/* give blocks back to the device. They read back as zeroes, so that
+ * is what their checksums now describe. Returns 0, -EOPNOTSUPP if
+ * the backend can't discard, or -EIO
+ */
+int block_discard(int lba, int nblks)
+{
+    static const char zero[FS_BLOCK_SIZE];
+    int rv;
+
+    assert(lba > 0);
+    for (int i = 0; i < nblks; i++)
+        cache_discard(lba + i);
+
+    pthread_rwlock_rdlock(&io_lock);
+    if ((rv = dev->ops->discard(dev, lba, nblks)) == 0 && csum_active()) {
+        int ncs = csum_nblocks();
+        unsigned char *touched = calloc(ncs, 1);
+        char *cbuf = malloc(FS_BLOCK_SIZE);
+
+        if (touched == NULL || cbuf == NULL)
+            rv = -EIO;
+        for (int i = 0; rv == 0 && i < nblks; i++) {
+            int idx = csum_update(lba + i, zero);
+            if (idx >= 0)
+                touched[idx] = 1;
+        }
+        for (int idx = 0; rv == 0 && idx < ncs; idx++) {
+            if (!touched[idx])
+                continue;
+            struct block_iov iov = {.lba = csum_start() + idx, .buf = cbuf, .nblks = 1};
+            csum_save_block(idx, cbuf);
+            rv = dev->ops->write(dev, &iov, 1);
+        }
+        free(touched);
+        free(cbuf);
+    }
+    pthread_rwlock_unlock(&io_lock);
+
+    if (rv == 0)
+        STAT_ADD(discards, nblks);
+    return rv;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* the file system freed these blocks. Cached copies are dropped (a
+ * dirty one would only be written back for nothing) and, with online
+ * discard on, they are discarded in as few ranges as possible.
+ * 'lbas' is sorted in place. Returns 0, or the first error from
+ * block_discard (other than -EOPNOTSUPP)
+ */
+int block_release(int *lbas, int n)
+{
+    int rv = 0;
+
+    if (!discard_on || n == 0) {
+        for (int i = 0; i < n; i++)
+            cache_discard(lbas[i]);
+        return 0;
+    }
+
+    qsort(lbas, n, sizeof(*lbas), cmp_int);
+    for (int i = 0; i < n; ) {
+        int j = i + 1;
+        while (j < n && lbas[j] <= lbas[j - 1] + 1)
+            j++;
+        int err = block_discard(lbas[i], lbas[j - 1] - lbas[i] + 1);
+        if (err == -EOPNOTSUPP) {
+            discard_on = 0;     /* don't keep trying */
+            for (int k = i; k < n; k++)
+                cache_discard(lbas[k]);
+            break;
+        }
+        if (err < 0 && rv == 0)
+            rv = err;
+        i = j;
+    }
+    return rv;
+}
+
+/* discard freed blocks as they are released (-discard)
+ */
+void block_set_discard(int on)
+{
+    discard_on = on;
+}
+
+/* device size in blocks
+ */
+long block_size(void)
+{
+    return dev->ops->size(dev);
+}
+
+/* switch to a new device, writing back anything still dirty for the
+ * old one first
+ */
+static void set_dev(struct blockdev *d)
+{
+    journal_close();
+    stop_scrub();
+    if (dev != NULL) {
+        block_flush(0);         /* dirty blocks belong to the old image */
+        dev->ops->close(dev);
+    }
+    csum_exit();
+    cache_invalidate();
+    dev = d;
 }
 
 void block_init(char *file)
 {
+    struct blockdev *d;
+
     if (strlen(file) < 4 || strcmp(file+strlen(file)-4, ".img") != 0) {
         printf("bad image file (must end in .img): %s\n", file);
         exit(1);
     }
-    if ((disk_fd = open(file, O_RDWR)) < 0) {
+    set_dev(NULL);
+    if ((d = filedev_open(file)) == NULL) {
         printf("cannot open image file '%s': %s\n", file, strerror(errno));
         exit(1);
     }
+    set_dev(d);
+    if (uring_depth > 0)
+        filedev_uring(dev, uring_depth);
+    if (map_requested)
+        filedev_mmap(dev);
 }
 
+/* hold the image in memory (-ram): load 'file', or create an empty
+ * 'nblks' block device if it doesn't exist. With 'checkpoint', flushes
+ * write changed blocks back to 'file'. Returns 1 if the device was
+ * created (and needs formatting), 0 if it was loaded
+ */
+int block_init_ram(char *file, int nblks, int checkpoint)
+{
+    struct blockdev *d;
+    int created;
+
+    set_dev(NULL);
+    if ((d = ramdev_open(file, nblks, checkpoint, &created)) == NULL) {
+        printf("cannot load image '%s' into memory: %s\n",
+               file ? file : "(none)", strerror(errno));
+        exit(1);
+    }
+    set_dev(d);
+    return created;
+}
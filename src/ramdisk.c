@@ -0,0 +1,248 @@
+/*
+ * file:        ramdisk.c
+ * description: in-memory block backend. The whole image is held in
+ *              one allocation, so block I/O costs a memcpy and no
+ *              system calls - handy for benchmarking the file system
+ *              logic on its own and for scratch mounts. Optionally
+ *              checkpoints changed blocks back to the image file on
+ *              flush.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../include/fs.h"        /* only for FS_BLOCK_SIZE */
+#include "../include/block.h"
+#include "../include/blockdev.h"
+
+struct ramdev {
+    struct blockdev dev;
+    char          *mem;
+    long           nblks;
+    char          *file;        /* checkpoint target, NULL if none */
+    unsigned char *dirty;       /* blocks changed since the last checkpoint */
+    pthread_mutex_t lock;       /* protects 'dirty' */
+};
+
+static int ram_read(struct blockdev *dev, const struct block_iov *iov,
+                    int iovcnt)
+{
+    struct ramdev *r = (struct ramdev *)dev;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].lba < 0 || iov[i].lba + iov[i].nblks > r->nblks)
+            return -EIO;
+        memcpy(iov[i].buf, r->mem + (size_t)iov[i].lba * FS_BLOCK_SIZE,
+               (size_t)iov[i].nblks * FS_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+static void mark_dirty(struct ramdev *r, int lba, int nblks)
+{
+    if (r->dirty == NULL)
+        return;
+    pthread_mutex_lock(&r->lock);
+    for (int i = lba; i < lba + nblks; i++)
+        r->dirty[i / 8] |= 1 << (i % 8);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int ram_write(struct blockdev *dev, const struct block_iov *iov,
+                     int iovcnt)
+{
+    struct ramdev *r = (struct ramdev *)dev;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].lba < 0 || iov[i].lba + iov[i].nblks > r->nblks)
+            return -EIO;
+        memcpy(r->mem + (size_t)iov[i].lba * FS_BLOCK_SIZE, iov[i].buf,
+               (size_t)iov[i].nblks * FS_BLOCK_SIZE);
+        mark_dirty(r, iov[i].lba, iov[i].nblks);
+    }
+    return 0;
+}
+
+/* checkpoint: write each run of changed blocks back to the image
+ * file and fsync it. Without a checkpoint file there is nothing to
+ * make durable.
+ */
+static int ram_flush(struct blockdev *dev)
+{
+    struct ramdev *r = (struct ramdev *)dev;
+    int fd, rv = 0;
+
+    if (r->file == NULL)
+        return 0;
+    if ((fd = open(r->file, O_WRONLY | O_CREAT, 0666)) < 0)
+        return -EIO;
+
+    pthread_mutex_lock(&r->lock);
+    for (long i = 0; i < r->nblks && rv == 0; ) {
+        if (!(r->dirty[i / 8] & (1 << (i % 8)))) {
+            i++;
+            continue;
+        }
+        long j = i;
+        while (j < r->nblks && (r->dirty[j / 8] & (1 << (j % 8))))
+            r->dirty[j / 8] &= ~(1 << (j % 8)), j++;
+
+        size_t len = (size_t)(j - i) * FS_BLOCK_SIZE;
+        off_t off = (off_t)i * FS_BLOCK_SIZE;
+        char *p = r->mem + off;
+        while (len > 0) {
+            ssize_t n = pwrite(fd, p, len, off);
+            r->dev.syscalls++;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                rv = -EIO;
+                break;
+            }
+            p += n;
+            off += n;
+            len -= n;
+        }
+        i = j;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    if (rv == 0 && fsync(fd) < 0)
+        rv = -EIO;
+    close(fd);
+    return rv;
+}
+
+static int ram_discard(struct blockdev *dev, int lba, int nblks)
+{
+    struct ramdev *r = (struct ramdev *)dev;
+
+    if (lba < 0 || lba + nblks > r->nblks)
+        return -EIO;
+    memset(r->mem + (size_t)lba * FS_BLOCK_SIZE, 0,
+           (size_t)nblks * FS_BLOCK_SIZE);
+    mark_dirty(r, lba, nblks);
+    return 0;
+}
+
+static long ram_size(struct blockdev *dev)
+{
+    return ((struct ramdev *)dev)->nblks;
+}
+
+static void *ram_map(struct blockdev *dev, int lba)
+{
+    struct ramdev *r = (struct ramdev *)dev;
+
+    if (lba < 0 || lba >= r->nblks)
+        return NULL;
+    return r->mem + (size_t)lba * FS_BLOCK_SIZE;
+}
+
+static void ram_close(struct blockdev *dev)
+{
+    struct ramdev *r = (struct ramdev *)dev;
+
+    if (r->dirty != NULL)
+        pthread_mutex_destroy(&r->lock);
+    free(r->mem);
+    free(r->dirty);
+    free(r->file);
+    free(r);
+}
+
+static const struct blockdev_ops ram_ops = {
+    .name = "ram",
+    .read = ram_read,
+    .write = ram_write,
+    .flush = ram_flush,
+    .discard = ram_discard,
+    .size = ram_size,
+    .map = ram_map,
+    .close = ram_close,
+};
+
+/* read the whole image file into r->mem. Returns 0, or -1 with errno
+ * set
+ */
+static int load(struct ramdev *r, int fd)
+{
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0)
+        return -1;
+    r->nblks = sb.st_size / FS_BLOCK_SIZE;
+    if ((r->mem = malloc((size_t)r->nblks * FS_BLOCK_SIZE)) == NULL)
+        return -1;
+
+    size_t len = (size_t)r->nblks * FS_BLOCK_SIZE, done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, r->mem + done, len - done, done);
+        r->dev.syscalls++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            errno = n < 0 ? errno : EIO;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+struct blockdev *ramdev_open(const char *file, int nblks, int checkpoint,
+                             int *created)
+{
+    struct ramdev *r = calloc(1, sizeof(*r));
+    int fd = -1;
+
+    if (r == NULL)
+        return NULL;
+    r->dev.ops = &ram_ops;
+    *created = 0;
+
+    if (file != NULL && (fd = open(file, O_RDONLY)) >= 0) {
+        int rv = load(r, fd);
+        close(fd);
+        if (rv < 0)
+            goto fail;
+    } else if (file != NULL && errno != ENOENT) {
+        goto fail;
+    } else {
+        if (nblks <= 0) {
+            errno = ENOENT;
+            goto fail;
+        }
+        r->nblks = nblks;
+        if ((r->mem = calloc(nblks, FS_BLOCK_SIZE)) == NULL)
+            goto fail;
+        *created = 1;
+    }
+
+    if (checkpoint && file != NULL) {
+        r->file = strdup(file);
+        r->dirty = calloc((r->nblks + 7) / 8, 1);
+        if (r->file == NULL || r->dirty == NULL)
+            goto fail;
+        pthread_mutex_init(&r->lock, NULL);
+        if (*created)               /* nothing on disk yet */
+            memset(r->dirty, 0xff, (r->nblks + 7) / 8);
+    }
+    return &r->dev;
+
+fail:
+    free(r->mem);
+    free(r->dirty);
+    free(r->file);
+    free(r);
+    return NULL;
+}
@@ -0,0 +1,84 @@
+/*
+ * file:        readahead.c
+ * description: sequential readahead for fs_read. Each recently read
+ *              inode has a window that opens at RA_MIN_BLOCKS when a
+ *              read continues where the previous one ended, doubles
+ *              on every further sequential read up to RA_MAX_BLOCKS,
+ *              and closes on the first random one. Readahead is issued
+ *              in half-window batches, so a steady stream of small
+ *              reads turns into a few large device reads.
+ */
+
+#include <pthread.h>
+
+#include "../include/readahead.h"
+
+/* direct-mapped by inode number; a collision just restarts detection */
+#define RA_SLOTS 64
+
+struct ra_state {
+    int inum;                   /* 0 = unused (inode 0 is the super) */
+    int next;                   /* block a sequential read starts at */
+    int win;                    /* current window, 0 = not sequential */
+    int ahead;                  /* first block not read ahead yet */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ra_state tab[RA_SLOTS];
+
+int ra_update(int inum, int first, int nblks, int file_blks, int *start)
+{
+    struct ra_state *s = &tab[inum % RA_SLOTS];
+    int n = 0;
+
+    pthread_mutex_lock(&lock);
+    if (s->inum != inum) {
+        s->inum = inum;
+        s->next = 0;            /* a first read from the start counts */
+        s->win = 0;
+        s->ahead = 0;
+    }
+
+    /* reads that aren't block aligned start in the block the last
+     * one ended in
+     */
+    if (first == s->next || first == s->next - 1) {
+        s->win = s->win == 0 ? RA_MIN_BLOCKS : s->win * 2;
+        if (s->win > RA_MAX_BLOCKS)
+            s->win = RA_MAX_BLOCKS;
+    } else {
+        s->win = 0;
+        s->ahead = 0;
+    }
+    s->next = first + nblks;
+
+    if (s->win > 0 && s->ahead - s->next < s->win / 2) {
+        int from = s->ahead > s->next ? s->ahead : s->next;
+        int to = s->next + s->win;
+        if (to > file_blks)
+            to = file_blks;
+        if (to > from) {
+            *start = from;
+            n = to - from;
+            s->ahead = to;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void ra_forget(int inum)
+{
+    pthread_mutex_lock(&lock);
+    if (tab[inum % RA_SLOTS].inum == inum)
+        tab[inum % RA_SLOTS].inum = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+void ra_reset(void)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < RA_SLOTS; i++)
+        tab[i].inum = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,336 @@
+/*
+ * file:        txn.c
+ * description: per-operation metadata transactions (see txn.h). A
+ *              transaction holds a copy of each block it was given -
+ *              the latest one - and the inodes to encode when it
+ *              commits, the bitmap bits it changed and the inodes it
+ *              has locked. It belongs to one operation in one thread;
+ *              the only lock of its own here is the one the bitmaps
+ *              are committed under.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../include/fs.h"
+#include "../include/block.h"
+#include "../include/inode.h"
+#include "../include/txn.h"
+
+/* held while a transaction changes and writes the committed bitmaps */
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct txn_map *maps;
+
+int txn_map_init(struct txn_map *map, int lba, int nblks,
+                 const unsigned char *bits, void (*release)(int i, int n))
+{
+    struct txn_map *m = maps;
+    while (m != NULL && m != map)
+        m = m->next;
+    if (m == NULL) {
+        map->next = maps;
+        maps = map;
+    }
+
+    map->release = release;
+    if (nblks == 0) {
+        free(map->bits);
+        map->bits = NULL;
+        map->lba = map->nblks = 0;
+        return 0;
+    }
+    unsigned char *p = realloc(map->bits, (size_t)nblks * FS_BLOCK_SIZE);
+    if (p == NULL)
+        return -ENOMEM;
+    memcpy(p, bits, (size_t)nblks * FS_BLOCK_SIZE);
+    map->bits = p;
+    map->lba = lba;
+    map->nblks = nblks;
+    return 0;
+}
+
+/* is block 'lba' part of a bitmap? */
+static int map_block(int lba)
+{
+    for (struct txn_map *m = maps; m != NULL; m = m->next)
+        if (lba >= m->lba && lba < m->lba + m->nblks)
+            return 1;
+    return 0;
+}
+
+void txn_begin(struct txn *tx)
+{
+    memset(tx, 0, sizeof(*tx));
+}
+
+static struct txn_block *lookup(struct txn *tx, int lba)
+{
+    for (int i = 0; i < tx->nblk; i++)
+        if (tx->blk[i].lba == lba)
+            return &tx->blk[i];
+    return NULL;
+}
+
+/* the entry for block 'lba', added if it is new. NULL if out of
+ * memory
+ */
+static struct txn_block *get(struct txn *tx, int lba)
+{
+    struct txn_block *b = lookup(tx, lba);
+    if (b == NULL) {
+        if (tx->nblk == tx->blk_cap) {
+            int cap = tx->blk_cap * 2 + 8;
+            struct txn_block *p = realloc(tx->blk, cap * sizeof(*p));
+            if (p == NULL)
+                return NULL;
+            tx->blk = p;
+            tx->blk_cap = cap;
+        }
+        b = &tx->blk[tx->nblk];
+        if ((b->data = malloc(FS_BLOCK_SIZE)) == NULL)
+            return NULL;
+        b->lba = lba;
+        tx->nblk++;
+    }
+    return b;
+}
+
+int txn_add(struct txn *tx, const struct block_iov *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            if (map_block(iov[i].lba + j))
+                return -EINVAL;
+            struct txn_block *b = get(tx, iov[i].lba + j);
+            if (b == NULL)
+                return -ENOMEM;
+            memcpy(b->data, (char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+int txn_bits(struct txn *tx, struct txn_map *map, int i, int n, int set)
+{
+    if (n == 0)
+        return 0;
+    if (tx->nbits == tx->bits_cap) {
+        int cap = tx->bits_cap * 2 + 4;
+        struct txn_bits *p = realloc(tx->bits, cap * sizeof(*p));
+        if (p == NULL)
+            return -ENOMEM;
+        tx->bits = p;
+        tx->bits_cap = cap;
+    }
+    tx->bits[tx->nbits++] = (struct txn_bits){.map = map, .i = i, .n = n, .set = set};
+    return 0;
+}
+
+int txn_preadv(struct txn *tx, const struct block_iov *iov, int iovcnt)
+{
+    if (block_preadv(iov, iovcnt) < 0)
+        return -EIO;
+    for (int i = 0; i < iovcnt && tx->nblk > 0; i++) {
+        for (int j = 0; j < iov[i].nblks; j++) {
+            struct txn_block *b = lookup(tx, iov[i].lba + j);
+            if (b != NULL)
+                memcpy((char *)iov[i].buf + (size_t)j * FS_BLOCK_SIZE, b->data, FS_BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+int txn_read(struct txn *tx, void *buf, int lba)
+{
+    struct block_iov iov = {.lba = lba, .buf = buf, .nblks = 1};
+    return txn_preadv(tx, &iov, 1);
+}
+
+int txn_inode(struct txn *tx, struct inode *ip)
+{
+    for (int i = 0; i < tx->ninodes; i++)
+        if (tx->inodes[i] == ip)
+            return 0;
+    if (tx->ninodes == tx->inodes_cap) {
+        int cap = tx->inodes_cap * 2 + 4;
+        struct inode **p = realloc(tx->inodes, cap * sizeof(*p));
+        if (p == NULL)
+            return -ENOMEM;
+        tx->inodes = p;
+        tx->inodes_cap = cap;
+    }
+    tx->inodes[tx->ninodes++] = ip;
+    return 0;
+}
+
+int txn_lock(struct txn *tx, struct inode *ip)
+{
+    for (int i = 0; i < tx->nlocked; i++) {
+        if (tx->locked[i] == ip) {
+            iput(ip);
+            return ip->gone ? -ENOENT : 0;
+        }
+    }
+    if (tx->nlocked == tx->locked_cap) {
+        int cap = tx->locked_cap * 2 + 4;
+        struct inode **p = realloc(tx->locked, cap * sizeof(*p));
+        if (p == NULL) {
+            iput(ip);
+            return -ENOMEM;
+        }
+        tx->locked = p;
+        tx->locked_cap = cap;
+    }
+    ilock(ip);
+    tx->locked[tx->nlocked++] = ip;
+    return ip->gone ? -ENOENT : 0;
+}
+
+int txn_release(struct txn *tx, const int *lbas, int n)
+{
+    if (n == 0)
+        return 0;
+    if (tx->nfreed + n > tx->freed_cap) {
+        int cap = tx->nfreed + n + tx->freed_cap;
+        int *p = realloc(tx->freed, cap * sizeof(*p));
+        if (p == NULL)
+            return -ENOMEM;
+        tx->freed = p;
+        tx->freed_cap = cap;
+    }
+    memcpy(tx->freed + tx->nfreed, lbas, n * sizeof(*lbas));
+    tx->nfreed += n;
+    return 0;
+}
+
+static int cmp_lba(const void *a, const void *b)
+{
+    const struct block_iov *x = a, *y = b;
+    return (x->lba > y->lba) - (x->lba < y->lba);
+}
+
+static int cmp_bits(const void *a, const void *b)
+{
+    const struct txn_bits *x = a, *y = b;
+    if (x->map != y->map)
+        return (x->map > y->map) - (x->map < y->map);
+    return (x->i > y->i) - (x->i < y->i);
+}
+
+#define BITS_PER_BLOCK (FS_BLOCK_SIZE * 8)
+
+/* hand the bits 'tx' cleared back to their allocators, each once */
+static void bits_free(struct txn *tx)
+{
+    int n = 0;
+
+    for (int k = 0; k < tx->nbits; k++)
+        if (!tx->bits[k].set)
+            tx->bits[n++] = tx->bits[k];
+    qsort(tx->bits, n, sizeof(*tx->bits), cmp_bits);
+    for (int k = 0; k < n;) {
+        struct txn_bits c = tx->bits[k++];
+        while (k < n && tx->bits[k].map == c.map && tx->bits[k].i <= c.i + c.n) {
+            int end = tx->bits[k].i + tx->bits[k].n;
+            if (end > c.i + c.n)
+                c.n = end - c.i;
+            k++;
+        }
+        c.map->release(c.i, c.n);
+    }
+}
+
+/* make 'tx's bitmap changes to the committed copies, with the lock
+ * held
+ */
+static void bits_apply(struct txn *tx)
+{
+    for (int k = 0; k < tx->nbits; k++) {
+        struct txn_bits *c = &tx->bits[k];
+        for (int i = c->i; i < c->i + c->n; i++) {
+            if (c->set)
+                c->map->bits[i / 8] |= 1 << (i % 8);
+            else
+                c->map->bits[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
+
+/* 'iov' entries for the blocks of the committed bitmaps 'tx' changed,
+ * each once (room for one per block each change spans). Returns how
+ * many
+ */
+static int bits_blocks(struct txn *tx, struct block_iov *iov)
+{
+    int n = 0, m = 0;
+
+    for (int k = 0; k < tx->nbits; k++) {
+        struct txn_bits *c = &tx->bits[k];
+        for (int b = c->i / BITS_PER_BLOCK; b <= (c->i + c->n - 1) / BITS_PER_BLOCK; b++)
+            iov[n++] = (struct block_iov){.lba = c->map->lba + b, .nblks = 1,
+                                          .buf = c->map->bits + (size_t)b * FS_BLOCK_SIZE};
+    }
+    qsort(iov, n, sizeof(*iov), cmp_lba);
+    for (int i = 0; i < n; i++)
+        if (m == 0 || iov[i].lba != iov[m - 1].lba)
+            iov[m++] = iov[i];
+    return m;
+}
+
+/* everything goes out in one write (see icommit), the inodes encoded
+ * under the inode cache's lock: their table blocks are shared with
+ * inodes other operations are changing, so a copy taken earlier could
+ * put old contents back. The bitmaps are written from their committed
+ * copies (see txn_bits), under the bitmap lock
+ */
+int txn_commit(struct txn *tx)
+{
+    int n = tx->nblk, rv = 0;
+
+    for (int k = 0; k < tx->nbits; k++) {
+        struct txn_bits *c = &tx->bits[k];
+        n += (c->i + c->n - 1) / BITS_PER_BLOCK - c->i / BITS_PER_BLOCK + 1;
+    }
+    struct block_iov *iov = malloc((n + 1) * sizeof(*iov));
+
+    pthread_mutex_lock(&bitmap_lock);
+    bits_apply(tx);
+    if (iov == NULL) {
+        rv = -EIO;
+    } else {
+        for (int i = 0; i < tx->nblk; i++)
+            iov[i] = (struct block_iov){.lba = tx->blk[i].lba, .buf = tx->blk[i].data,
+                                        .nblks = 1};
+        n = tx->nblk + bits_blocks(tx, iov + tx->nblk);
+        rv = icommit(tx->inodes, tx->ninodes, iov, n);
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    tx->committed = rv == 0;
+
+    while (tx->nlocked > 0) {
+        struct inode *ip = tx->locked[--tx->nlocked];
+        iunlock(ip);
+        iput(ip);
+    }
+    free(iov);
+    return rv < 0 ? -EIO : 0;
+}
+
+void txn_end(struct txn *tx, int durable)
+{
+    if (durable) {
+        bits_free(tx);
+        if (tx->committed && tx->nfreed > 0)
+            block_release(tx->freed, tx->nfreed);
+    }
+    for (int i = 0; i < tx->nblk; i++)
+        free(tx->blk[i].data);
+    free(tx->locked);
+    free(tx->blk);
+    free(tx->inodes);
+    free(tx->freed);
+    free(tx->bits);
+}
@@ -0,0 +1,231 @@
+/*
+ * file:        uring.c
+ * description: io_uring backend for the block layer. Talks to the
+ *              kernel through the raw system calls so that there is
+ *              no dependency on liburing; on systems without io_uring
+ *              everything here reports -ENOSYS and filedev.c stays on
+ *              preadv/pwritev.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "../include/uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* the ring is shared by all FUSE worker threads; submission and
+ * reaping of one batch happen under this lock
+ */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    int fd;                     /* ring fd, -1 if not set up */
+    int io_fd;                  /* file the I/O is issued against */
+    unsigned entries;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz;
+    struct io_uring_sqe *sqes;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} ring = {.fd = -1};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned to_submit, unsigned min_complete)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                   IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+int uring_init(int fd, unsigned depth)
+{
+    struct io_uring_params p;
+
+    uring_exit();
+    memset(&p, 0, sizeof(p));
+    if ((ring.fd = sys_setup(depth, &p)) < 0) {
+        ring.fd = -1;
+        return -errno;
+    }
+
+    ring.io_fd = fd;
+    ring.entries = p.sq_entries;
+    ring.sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_sz > ring.sq_sz)
+            ring.sq_sz = ring.cq_sz;
+        ring.cq_sz = ring.sq_sz;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_sz, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    {
+        int err = -errno;
+        uring_exit();
+        return err;
+    }
+}
+
+void uring_exit(void)
+{
+    if (ring.fd < 0)
+        return;
+    if (ring.sqes != NULL && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    if (ring.cq_ptr != NULL && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_sz);
+    if (ring.sq_ptr != NULL && ring.sq_ptr != MAP_FAILED)
+        munmap(ring.sq_ptr, ring.sq_sz);
+    close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+int uring_active(void)
+{
+    return ring.fd >= 0;
+}
+
+/* fill one submission queue entry per segment, then enter the kernel
+ * once to submit the whole batch and wait for all of it
+ */
+static int submit_batch(int write, struct uring_seg *seg, int nseg)
+{
+    unsigned tail = *ring.sq_tail, mask = *ring.sq_mask;
+    int calls = 0;
+
+    for (int i = 0; i < nseg; i++) {
+        unsigned idx = tail & mask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = ring.io_fd;
+        sqe->addr = (unsigned long)seg[i].iov;
+        sqe->len = seg[i].cnt;
+        sqe->off = seg[i].off;
+        sqe->user_data = i;
+        ring.sq_array[idx] = idx;
+        seg[i].res = -EIO;
+        tail++;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = nseg, done = 0;
+    while (done < (unsigned)nseg) {
+        int rv = sys_enter(to_submit, nseg - done);
+        calls++;
+        if (rv < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -EIO;
+        }
+        to_submit -= (unsigned)rv < to_submit ? (unsigned)rv : to_submit;
+
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            seg[cqe->user_data].res = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return calls;
+}
+
+int uring_submit(int write, struct uring_seg *seg, int nseg)
+{
+    int calls = 0;
+
+    pthread_mutex_lock(&ring_lock);
+    for (int i = 0; i < nseg; i += ring.entries) {
+        int n = nseg - i < (int)ring.entries ? nseg - i : (int)ring.entries;
+        int rv = submit_batch(write, seg + i, n);
+        if (rv < 0) {
+            calls = rv;
+            break;
+        }
+        calls += rv;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return calls;
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_init(int fd, unsigned depth)
+{
+    return -ENOSYS;
+}
+
+void uring_exit(void)
+{
+}
+
+int uring_active(void)
+{
+    return 0;
+}
+
+int uring_submit(int write, struct uring_seg *seg, int nseg)
+{
+    return -EIO;
+}
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * file:        bench-alloc.c
+ * description: allocation scalability benchmark. Threads each create
+ *              files in a directory of their own and append to them a
+ *              block at a time, on a fresh RAM disk image (so what is
+ *              measured is the file system, not the device), at 1 to
+ *              32 threads. The total work is the same at every thread
+ *              count; operations per second and the speedup over one
+ *              thread show how well allocation runs in parallel. The
+ *              image has several allocation groups, and the threads'
+ *              directories - and so their files - are spread over them.
+ *
+ *  usage: ./bench-alloc [files]
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fuse.h>
+#include <pthread.h>
+
+#include "../include/block.h"
+#include "../include/balloc.h"
+
+extern struct fuse_operations fs_ops;
+extern int fs_mkfs(int nblks);
+
+#define NBLOCKS   (16 * BALLOC_GROUP)   /* 2GB image, 16 groups */
+#define APPENDS   8                     /* 4KB writes per file */
+#define MAXTHREAD 32
+
+static char block[4096];
+static int nfiles;                      /* per thread */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what, const char *path)
+{
+    fprintf(stderr, "%s %s failed\n", what, path);
+    exit(1);
+}
+
+static void *worker(void *arg)
+{
+    int t = (int)(long)arg;
+    char path[32];
+
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/t%d/f%d", t, i);
+        if (fs_ops.create(path, S_IFREG | 0666, NULL) != 0)
+            die("create", path);
+        for (int j = 0; j < APPENDS; j++)
+            if (fs_ops.write(path, block, sizeof(block), j * sizeof(block), NULL) != sizeof(block))
+                die("write", path);
+    }
+    return NULL;
+}
+
+/* 'total' files split over 'nthreads' threads; returns ops per second */
+static double run(int nthreads, int total)
+{
+    pthread_t tid[MAXTHREAD];
+    char path[32];
+
+    block_init_ram(NULL, NBLOCKS, 0);
+    if (fs_mkfs(NBLOCKS) < 0) {
+        fprintf(stderr, "mkfs failed\n");
+        exit(1);
+    }
+    fs_ops.init(NULL);
+    for (int t = 0; t < nthreads; t++) {
+        sprintf(path, "/t%d", t);
+        if (fs_ops.mkdir(path, 0777) != 0)
+            die("mkdir", path);
+    }
+
+    nfiles = total / nthreads;
+    double t0 = now();
+    for (int t = 0; t < nthreads; t++)
+        pthread_create(&tid[t], NULL, worker, (void *)(long)t);
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(tid[t], NULL);
+    double t = now() - t0;
+
+    return nthreads * nfiles * (1 + APPENDS) / t;
+}
+
+int main(int argc, char **argv)
+{
+    int total = argc > 1 ? atoi(argv[1]) : 2048;
+    double base = 0;
+
+    memset(block, 'x', sizeof(block));
+    printf("%d files of %d blocks, %d allocation groups\n", total, APPENDS,
+           NBLOCKS / BALLOC_GROUP);
+    for (int n = 1; n <= MAXTHREAD; n *= 2) {
+        double ops = run(n, total);
+        if (n == 1)
+            base = ops;
+        printf("%2d threads %10.0f ops/s  %5.2fx\n", n, ops, ops / base);
+    }
+    block_exit();
+    return 0;
+}
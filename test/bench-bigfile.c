@@ -0,0 +1,146 @@
+/*
+ * file:        bench-bigfile.c
+ * description: large file benchmark. Writes a 64MB file sequentially,
+ *              reads it back, and then reads random 4KB blocks of it,
+ *              once with the file mapped by extents and once by block
+ *              pointers (indirect and double-indirect blocks), on a
+ *              freshly formatted compact image with the block cache
+ *              off. Random reads are timed just after mounting (cold:
+ *              the first few hundred, while the map is being read) and
+ *              again once it is in memory (warm); blocks read per
+ *              operation show what the map costs on top of the one data
+ *              block.
+ *
+ *  usage: ./bench-bigfile [iterations]
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fuse.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../include/block.h"
+
+extern struct fuse_operations fs_ops;
+extern int fs_mkfs(int nblks);
+extern void fs_set_extents(int on);
+
+#define IMAGE     "bench.img"
+#define NBLOCKS   32768         /* 128MB image */
+#define BIG_FILE  "/big"
+#define BIG_SIZE  (64 * 1024 * 1024)
+#define CHUNK     (128 * 1024)
+#define COLD      256           /* random reads right after mounting */
+
+static char chunk[CHUNK];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+/* a blank image, formatted and mounted */
+static void setup(void)
+{
+    block_durability(BLOCK_SYNC, 0);    /* flush the last run's image */
+    int fd = open(IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, (off_t)NBLOCKS * 4096) < 0)
+        die("creating " IMAGE);
+    close(fd);
+    block_init(IMAGE);
+    block_cache_init(0);
+    if (fs_mkfs(NBLOCKS) < 0)
+        die("mkfs");
+    fs_ops.init(NULL);
+}
+
+static void report(const char *mode, const char *name, double t, int ops,
+                   size_t bytes)
+{
+    struct block_stats st;
+
+    block_get_stats(&st);
+    printf("%-9s %-12s %10.0f ops/s %8.2f blocks read/op %9.1f MB/s\n",
+           mode, name, ops / t, (double)st.reads / ops,
+           bytes * (double)ops / t / (1024 * 1024));
+}
+
+static void seq_write(const char *mode)
+{
+    int ops = BIG_SIZE / CHUNK;
+
+    block_reset_stats();
+    double t0 = now();
+    if (fs_ops.create(BIG_FILE, S_IFREG | 0666, NULL) != 0)
+        die("create");
+    for (int i = 0; i < ops; i++)
+        if (fs_ops.write(BIG_FILE, chunk, CHUNK, (off_t)i * CHUNK, NULL) != CHUNK)
+            die("write");
+    if (fs_ops.fsync(BIG_FILE, 0, NULL) != 0)
+        die("fsync");
+    report(mode, "seq write", now() - t0, ops, CHUNK);
+}
+
+static void seq_read(const char *mode)
+{
+    int ops = BIG_SIZE / CHUNK;
+
+    fs_ops.init(NULL);          /* nothing cached */
+    block_reset_stats();
+    double t0 = now();
+    for (int i = 0; i < ops; i++)
+        if (fs_ops.read(BIG_FILE, chunk, CHUNK, (off_t)i * CHUNK, NULL) != CHUNK)
+            die("read");
+    report(mode, "seq read", now() - t0, ops, CHUNK);
+}
+
+static void rand_read(const char *mode, const char *name, int iters)
+{
+    char buf[4096];
+
+    srand(1);
+    block_reset_stats();
+    double t0 = now();
+    for (int i = 0; i < iters; i++) {
+        off_t off = (off_t)(rand() % (BIG_SIZE / 4096)) * 4096;
+        if (fs_ops.read(BIG_FILE, buf, 4096, off, NULL) != 4096)
+            die("read");
+    }
+    report(mode, name, now() - t0, iters, 4096);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 20000;
+    const char *modes[] = {"extents", "pointers"};
+
+    memset(chunk, 'x', sizeof(chunk));
+
+    for (int m = 0; m < 2; m++) {
+        fs_set_extents(m == 0);
+        setup();
+        seq_write(modes[m]);
+        seq_read(modes[m]);
+        fs_ops.init(NULL);
+        rand_read(modes[m], "rand 4K cold", COLD);
+        rand_read(modes[m], "rand 4K warm", iters);
+    }
+    fs_set_extents(1);
+    block_exit();
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * file:        bench-dirent.c
+ * description: directory block search benchmark. Looks names up in
+ *              full 128-entry directory blocks with the strcmp loop the
+ *              file system used to have and with each dirent_find
+ *              implementation this CPU supports, for names spread over
+ *              the block (hits) and names that aren't there (misses,
+ *              which scan all 128 entries).
+ *
+ *  usage: ./bench-dirent [iterations]
+ *         (build with CFLAGS=-O2 for representative numbers)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/fs.h"
+#include "../include/dirscan.h"
+
+#define NBLOCKS 64              /* 256KB of entries, stays in cache */
+#define NNAMES  1024
+
+static struct fs_dirent blocks[NBLOCKS][128];
+static char hit[NNAMES][28];
+static char miss[NNAMES][28];
+static volatile int sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int find_strcmp(const struct fs_dirent *d, int n, const char *name)
+{
+    for (int i = 0; i < n; i++)
+        if (d[i].valid && strcmp(name, d[i].name) == 0)
+            return i;
+    return -1;
+}
+
+static double run(int (*find)(const struct fs_dirent *, int, const char *),
+                  char (*names)[28], int iters)
+{
+    int found = 0;
+    double t0 = now();
+
+    for (int i = 0; i < iters; i++) {
+        int j = i % NNAMES;
+        found += find(blocks[j % NBLOCKS], 128, names[j]) >= 0;
+    }
+    sink = found;
+    return (now() - t0) * 1e9 / iters;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 2000000;
+    const char *impls[] = {"avx2", "sse2", "neon", "scalar"};
+
+    srand(1);
+    for (int b = 0; b < NBLOCKS; b++) {
+        for (int i = 0; i < 128; i++) {
+            blocks[b][i].valid = 1;
+            blocks[b][i].inode = b * 128 + i + 3;
+            sprintf(blocks[b][i].name, "file-%d-%d", b, i);
+        }
+    }
+    for (int j = 0; j < NNAMES; j++) {
+        strcpy(hit[j], blocks[j % NBLOCKS][rand() % 128].name);
+        sprintf(miss[j], "file-%d-%d", j % NBLOCKS, 128 + j);
+    }
+
+    printf("%-8s %12s %12s\n", "", "hit ns", "miss ns");
+    printf("%-8s %12.1f %12.1f\n", "strcmp",
+           run(find_strcmp, hit, iters), run(find_strcmp, miss, iters));
+    for (int k = 0; k < 4; k++) {
+        if (dirent_set_impl(impls[k]) < 0)
+            continue;
+        printf("%-8s %12.1f %12.1f\n", impls[k],
+               run(dirent_find, hit, iters), run(dirent_find, miss, iters));
+    }
+    return 0;
+}
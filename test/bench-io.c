@@ -0,0 +1,132 @@
+/*
+ * file:        bench-io.c
+ * description: block I/O benchmark. Runs the same file system
+ *              operations over the preadv/pwritev path, the
+ *              io_uring path, write-back caching and the RAM disk
+ *              (file system cost alone) and reports syscalls per operation and
+ *              throughput for each.
+ *
+ *  usage: ./bench-io [iterations]
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fuse.h>
+#include <errno.h>
+
+#include "../include/block.h"
+
+extern struct fuse_operations fs_ops;
+
+#define BIG_FILE "/big"
+#define BIG_SIZE (1024 * 1024)
+#define CHUNK    (128 * 1024)
+
+static char chunk[CHUNK];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* create a file, write 16KB to it and delete it again: one batch of
+ * metadata writes for the create, a vectored data write, and the
+ * unlink
+ */
+static void op_create(int i)
+{
+    char path[32];
+    sprintf(path, "/f%d", i);
+    if (fs_ops.create(path, S_IFREG | 0666, NULL) != 0 ||
+        fs_ops.write(path, chunk, 16384, 0, NULL) != 16384 ||
+        fs_ops.unlink(path) != 0) {
+        fprintf(stderr, "create/write/unlink %s failed\n", path);
+        exit(1);
+    }
+}
+
+static void op_read(int i)
+{
+    off_t off = (off_t)(i % (BIG_SIZE / CHUNK)) * CHUNK;
+    if (fs_ops.read(BIG_FILE, chunk, CHUNK, off, NULL) != CHUNK) {
+        fprintf(stderr, "read failed\n");
+        exit(1);
+    }
+}
+
+static void op_write(int i)
+{
+    off_t off = (off_t)(i % (BIG_SIZE / CHUNK)) * CHUNK;
+    if (fs_ops.write(BIG_FILE, chunk, CHUNK, off, NULL) != CHUNK) {
+        fprintf(stderr, "write failed\n");
+        exit(1);
+    }
+}
+
+static void run(const char *mode, const char *name, void (*op)(int),
+                int iters, size_t bytes)
+{
+    struct block_stats st;
+
+    block_reset_stats();
+    double t0 = now();
+    for (int i = 0; i < iters; i++)
+        op(i);
+    double t = now() - t0;
+    block_get_stats(&st);
+
+    printf("%-9s %-20s %10.0f ops/s %8.2f syscalls/op %9.1f MB/s\n",
+           mode, name, iters / t, (double)st.syscalls / iters,
+           bytes ? bytes * (double)iters / t / (1024 * 1024) : 0.0);
+}
+
+static int setup(int mode)
+{
+    block_durability(BLOCK_SYNC, 0);    /* flush the last mode's image */
+    block_io_reset();                   /* and drop its io_uring */
+    system("python gen-disk.py -q disk2.in bench.img");
+    if (mode == 3)
+        block_init_ram("bench.img", 0, 0);
+    else
+        block_init("bench.img");
+    block_cache_init(mode == 2 ? 16 << 20 : 0);
+    if (mode == 1 && block_uring_init(64) < 0)
+        return -1;
+    if (mode == 2 && block_durability(BLOCK_LAZY, 0) < 0)
+        return -1;
+    fs_ops.init(NULL);
+
+    if (fs_ops.create(BIG_FILE, S_IFREG | 0666, NULL) != 0)
+        return -1;
+    for (off_t off = 0; off < BIG_SIZE; off += CHUNK)
+        if (fs_ops.write(BIG_FILE, chunk, CHUNK, off, NULL) != CHUNK)
+            return -1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 2000;
+    const char *modes[] = {"preadv", "io_uring", "writeback", "ram"};
+
+    memset(chunk, 'x', sizeof(chunk));
+
+    for (int m = 0; m < 4; m++) {
+        if (setup(m) < 0) {
+            printf("%-9s skipped (not available)\n", modes[m]);
+            continue;
+        }
+        run(modes[m], "create+write+unlink", op_create, iters, 16384);
+        run(modes[m], "read 128K", op_read, iters, CHUNK);
+        run(modes[m], "overwrite 128K", op_write, iters, CHUNK);
+    }
+    block_exit();
+    return 0;
+}
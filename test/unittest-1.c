@@ -15,8 +15,17 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#include "../include/block.h"
+#include "../include/dcache.h"
+#include "../include/dirscan.h"
+#include "../include/balloc.h"
+#include "../include/inode.h"
+
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
+extern int fs_mkfs(int nblks);
+extern void fs_set_csum(int on);
+extern int translate(int pathc, char **pathv);
 
 /* test data for getattr */
 struct {
@@ -340,6 +349,345 @@ START_TEST(test_rename_directory) {
 }
 END_TEST
 
+/* test that repeated lookups are served from the block cache, and
+ * that a cache far smaller than the working set still returns the
+ * right data. Uses a fresh image, since earlier tests renamed some
+ * of the files.
+ */
+START_TEST(test_cache) {
+    struct block_stats st;
+    struct stat sb;
+
+    system("python gen-disk.py -q disk1.in test.img");
+    block_init("test.img");
+    fs_ops.init(NULL);
+
+    /* path lookups no longer touch blocks once warm (inode and dentry
+     * caches), so the cache is exercised with a small read
+     */
+    char small[100];
+    ck_assert_int_eq(block_cache_init(1024 * 1024), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    ck_assert_int_eq(fs_ops.read("/dir3/subdir/file.12k", small, 100, 0, NULL), 100);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.read("/dir3/subdir/file.12k", small, 100, 0, NULL), 100);
+    block_get_stats(&st);
+    printf("(test_cache) hits %lu misses %lu reads %lu\n",
+           st.cache_hits, st.cache_misses, st.reads);
+    ck_assert_int_eq(st.reads, 0);
+    ck_assert_int_eq(st.cache_misses, 0);
+    ck_assert_int_gt(st.cache_hits, 0);
+
+    ck_assert_int_eq(block_cache_init(8 * 4096), 0);
+    char *buffer = malloc(15000);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; read_test[i].path != NULL; i++) {
+            int bytes_read = fs_ops.read(read_test[i].path, buffer, read_test[i].size, 0, NULL);
+            ck_assert_int_eq(bytes_read, read_test[i].size);
+            ck_assert_int_eq(crc32(0L, (unsigned char *)buffer, bytes_read), read_test[i].cksum);
+        }
+    }
+    free(buffer);
+    block_get_stats(&st);
+    printf("(test_cache) evictions %lu\n", st.cache_evictions);
+    ck_assert_int_gt(st.cache_evictions, 0);
+
+    ck_assert_int_eq(block_cache_init(0), 0);
+}
+END_TEST
+
+/* the inode at '/<dir>/<file>' ('file' NULL: '/<dir>'), held */
+static struct inode *inode_at(const char *dir, const char *file) {
+    char *pathv[2] = {(char *)dir, (char *)file};
+    int inum = translate(file != NULL ? 2 : 1, pathv);
+    ck_assert_int_gt(inum, 0);
+    return iget(inum);
+}
+
+/* test that getattr and read give the same results with the image
+ * mmap'd, where both are served in place from the mapping. Uses a
+ * fresh image, since earlier tests renamed some of the files.
+ */
+START_TEST(test_read_mmap) {
+    system("python gen-disk.py -q disk1.in test.img");
+    block_init("test.img");
+    ck_assert_int_eq(block_mmap_init(), 0);
+    fs_ops.init(NULL);
+
+    for (int i = 0; getattr_test[i].path != NULL; i++) {
+        struct stat sb;
+        ck_assert_int_eq(fs_ops.getattr(getattr_test[i].path, &sb), 0);
+        ck_assert_int_eq(sb.st_size, getattr_test[i].size);
+        ck_assert_int_eq(sb.st_mtime, getattr_test[i].mtime);
+    }
+
+    char *buffer = malloc(15000);
+    for (int i = 0; read_test[i].path != NULL; i++) {
+        int bytes_read = fs_ops.read(read_test[i].path, buffer, read_test[i].size, 0, NULL);
+        printf("(test_read_mmap) read %s: %d bytes\n", read_test[i].path, bytes_read);
+        ck_assert_int_eq(bytes_read, read_test[i].size);
+        ck_assert_int_eq(crc32(0L, (unsigned char *)buffer, bytes_read), read_test[i].cksum);
+
+        /* unaligned chunks crossing block boundaries */
+        for (size_t off = 0; off < read_test[i].size; off += 1970) {
+            size_t n = read_test[i].size - off < 1970 ? read_test[i].size - off : 1970;
+            ck_assert_int_eq(fs_ops.read(read_test[i].path, buffer + off, n, off, NULL), n);
+        }
+        ck_assert_int_eq(crc32(0L, (unsigned char *)buffer, read_test[i].size), read_test[i].cksum);
+    }
+
+    /* with checksums on, blocks aren't read in place: one changed
+     * behind the file system's back fails the read
+     */
+    fs_set_csum(1);
+    fs_ops.init(NULL);
+    fs_set_csum(0);
+    ck_assert_int_eq(fs_ops.read("/file.1k", buffer, 1000, 0, NULL), 1000);
+    struct inode *ip = inode_at("file.1k", NULL);
+    char *data = block_map(bmap(ip, 0, NULL));
+    iput(ip);
+    data[100] ^= 1;
+    ck_assert_int_eq(fs_ops.read("/file.1k", buffer, 1000, 0, NULL), -EIO);
+    data[100] ^= 1;
+    free(buffer);
+}
+END_TEST
+
+/* repeated deep lookups are answered by the dentry cache without any
+ * reads, and renaming a directory on the path drops the old path.
+ * Uses a fresh image.
+ */
+START_TEST(test_dcache) {
+    struct block_stats st;
+    struct dcache_stats ds;
+    struct stat sb;
+
+    system("python gen-disk.py -q disk1.in test.img");
+    block_init("test.img");
+    fs_ops.init(NULL);
+
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    block_reset_stats();
+    for (int i = 0; i < 100; i++) {
+        ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    }
+    block_get_stats(&st);
+    dcache_get_stats(&ds);
+    printf("(test_dcache) reads %lu path hits %lu\n", st.reads, ds.path_hits);
+    ck_assert_int_eq(st.reads, 0);
+    ck_assert_int_ge(ds.path_hits, 100);
+
+    /* a sibling shares the cached directory entries for /dir3/subdir */
+    unsigned long misses = ds.misses;
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.4k-", &sb), 0);
+    dcache_get_stats(&ds);
+    ck_assert_int_eq(ds.misses - misses, 1);
+
+    ck_assert_int_eq(fs_ops.rename("/dir3", "/dir3-renamed"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dir3-renamed/subdir/file.12k", &sb), 0);
+    ck_assert_int_eq(sb.st_size, 12288);
+    ck_assert_int_eq(fs_ops.rename("/dir3-renamed", "/dir3"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dir3-renamed/subdir/file.12k", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+
+    /* a path resolved across a removal isn't cached */
+    char *pathv[] = {"a", "b"};
+    int inums[] = {100, 101};
+    unsigned long gen = dcache_generation();
+    dcache_remove(100, "b", 101);
+    dcache_add_path(2, pathv, inums, gen);
+    ck_assert_int_eq(dcache_path(2, pathv), 0);
+    dcache_add_path(2, pathv, inums, dcache_generation());
+    ck_assert_int_eq(dcache_path(2, pathv), 101);
+}
+END_TEST
+
+/* every directory search implementation the CPU supports finds the
+ * same entries: invalid entries and prefixes don't match, and bytes
+ * after a name's NUL are ignored
+ */
+START_TEST(test_dirscan) {
+    const char *impls[] = {"avx2", "sse2", "neon", "scalar"};
+    const char *dflt = dirent_impl();
+    struct fs_dirent d[128];
+    int tested = 0;
+
+    memset(d, 0, sizeof(d));
+    for (int i = 0; i < 128; i++) {
+        d[i].valid = 1;
+        d[i].inode = 1000 + i;
+        sprintf(d[i].name, "file-%d", i);
+        memset(d[i].name + strlen(d[i].name) + 1, 'x', 26 - strlen(d[i].name));
+    }
+    d[5].valid = 0;
+    strcpy(d[126].name, "twenty-seven-byte-file-name");
+
+    for (int k = 0; k < 4; k++) {
+        if (dirent_set_impl(impls[k]) < 0) {
+            continue;
+        }
+        printf("(test_dirscan) %s\n", impls[k]);
+        tested++;
+        ck_assert_int_eq(dirent_find(d, 128, "file-0"), 0);
+        ck_assert_int_eq(dirent_find(d, 128, "file-127"), 127);
+        ck_assert_int_eq(dirent_find(d, 128, "twenty-seven-byte-file-name"), 126);
+        ck_assert_int_eq(dirent_find(d, 128, "file-5"), -1);
+        ck_assert_int_eq(dirent_find(d, 128, "file-1"), 1);
+        ck_assert_int_eq(dirent_find(d, 128, "file-"), -1);
+        ck_assert_int_eq(dirent_find(d, 128, "file-12x"), -1);
+        ck_assert_int_eq(dirent_find(d, 128, "twenty-seven-byte-file-name!"), -1);
+        ck_assert_int_eq(dirent_find(d, 100, "file-127"), -1);
+    }
+    ck_assert_int_ge(tested, 1);
+    ck_assert_int_eq(dirent_set_impl(dflt), 0);
+}
+END_TEST
+
+/* the block allocator on a bitmap of its own: next fit, runs, and
+ * bulk allocation out of scattered free blocks
+ */
+START_TEST(test_balloc) {
+    static unsigned char map[4096];
+    struct brun runs[8];
+
+    balloc_init(map, 1000, 3);
+    ck_assert_int_eq(balloc(0), 3);
+    ck_assert_int_eq(balloc(0), 4);
+    ck_assert_int_eq(balloc_run(65), 5);
+    balloc_free(10, 3);
+    ck_assert_int_eq(balloc(0), 70);         /* after the last one, not in the hole */
+    ck_assert_int_eq(balloc_run(929), 71);
+    ck_assert_int_eq(balloc(0), 10);         /* then from the start again */
+    ck_assert_int_eq(balloc_run(2), 11);
+    ck_assert_int_eq(balloc(0), -ENOSPC);
+
+    balloc_free(100, 2);
+    balloc_free(200, 4);
+    balloc_free(300, 1);
+    ck_assert_int_eq(balloc_run(7), -ENOSPC);
+    ck_assert_int_eq(balloc_bulk(8, -1, 0, runs), -ENOSPC);
+    ck_assert_int_eq(balloc_bulk(7, -1, 0, runs), 3);
+    ck_assert_int_eq(runs[0].lba, 100);
+    ck_assert_int_eq(runs[0].len, 2);
+    ck_assert_int_eq(runs[1].lba, 200);
+    ck_assert_int_eq(runs[1].len, 4);
+    ck_assert_int_eq(runs[2].lba, 300);
+    ck_assert_int_eq(runs[2].len, 1);
+    ck_assert_int_eq(balloc(0), -ENOSPC);
+
+    balloc_free(500, 2);
+    ck_assert_int_eq(balloc_bulk(3, -1, 0, runs), -ENOSPC);
+    ck_assert_int_eq(balloc_bulk(2, -1, 0, runs), 1);
+    ck_assert_int_eq(runs[0].lba, 500);
+
+    /* a device that ends inside a bitmap word */
+    memset(map, 0, sizeof(map));
+    balloc_init(map, 130, 3);
+    ck_assert_int_eq(balloc_run(128), -ENOSPC);
+    ck_assert_int_eq(balloc_run(127), 3);
+    ck_assert_int_eq(balloc(0), -ENOSPC);
+}
+END_TEST
+
+/* a bitmap many blocks long: free space past stretches of full
+ * bitmap words (found through the summary), counting it, and the bits
+ * allocating and freeing change
+ */
+START_TEST(test_balloc_big) {
+    int nblocks = 1 << 22;
+    unsigned char *map = malloc(nblocks / 8);
+    struct brun runs[4];
+
+    memset(map, 0xff, nblocks / 8);
+    map[3000000 / 8] &= ~(1 << (3000000 % 8));
+    for (int i = nblocks - 100; i < nblocks; i++) {
+        map[i / 8] &= ~(1 << (i % 8));
+    }
+    ck_assert_int_eq(balloc_init(map, nblocks, 3), 0);
+    ck_assert_int_eq(balloc_count(), 101);
+
+    ck_assert_int_eq(balloc(0), 3000000);
+    ck_assert(map[3000000 / 8] & (1 << (3000000 % 8)));
+    ck_assert_int_eq(balloc_run(100), nblocks - 100);
+    ck_assert_int_eq(balloc(0), -ENOSPC);
+    ck_assert_int_eq(balloc_count(), 0);
+
+    balloc_free(5000, 1);
+    balloc_free(nblocks - 1, 1);
+    ck_assert(!(map[5000 / 8] & (1 << (5000 % 8))));
+    ck_assert_int_eq(balloc_count(), 2);
+    ck_assert_int_eq(balloc_bulk(2, -1, 0, runs), 2);
+    ck_assert_int_eq(runs[0].lba + runs[1].lba, 5000 + nblocks - 1);
+    free(map);
+}
+END_TEST
+
+/* the group an inode's blocks should be in: its part of the table */
+static int group_of(int inum, int ngroups) {
+    int nfree;
+    return (long)inum * ngroups / itable_size(&nfree);
+}
+
+/* allocation groups on a file system: new directories go round the
+ * groups, a file's data goes in its inode's group, and once a group
+ * is full the next one round is used
+ */
+START_TEST(test_balloc_groups) {
+    int ngroups = 3, nblks = ngroups * BALLOC_GROUP, size = 16 * 4096;
+    int group[3];
+    char path[32], dir[8];
+    char *data = calloc(1, size);
+
+    ck_assert_int_eq(block_init_ram(NULL, nblks, 0), 1);
+    ck_assert_int_eq(fs_mkfs(nblks), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(balloc_groups(), ngroups);
+
+    for (int i = 0; i < ngroups; i++) {
+        sprintf(dir, "d%d", i);
+        sprintf(path, "/%s", dir);
+        ck_assert_int_eq(fs_ops.mkdir(path, 0777), 0);
+        struct inode *ip = inode_at(dir, NULL);
+        group[i] = group_of(ip->inum, ngroups);
+        ck_assert_int_eq(balloc_group(bmap(ip, 0, NULL)), group[i]);
+        iput(ip);
+        if (i > 0) {
+            ck_assert_int_eq(group[i], (group[i - 1] + 1) % ngroups);
+        }
+
+        sprintf(path, "/%s/f", dir);
+        ck_assert_int_eq(fs_ops.create(path, S_IFREG | 0666, NULL), 0);
+        ck_assert_int_eq(fs_ops.write(path, data, size, 0, NULL), size);
+        ip = inode_at(dir, "f");
+        ck_assert_int_eq(group_of(ip->inum, ngroups), group[i]);
+        for (int b = 0; b < size / 4096; b++) {
+            ck_assert_int_eq(balloc_group(bmap(ip, b, NULL)), group[i]);
+        }
+        iput(ip);
+    }
+
+    /* fill the first directory's group: its next file's data goes in
+     * the group after it
+     */
+    int lba;
+    while ((lba = balloc(group[0])) >= 0 && balloc_group(lba) == group[0])
+        ;
+    ck_assert_int_eq(balloc_group(lba), group[1]);
+    balloc_free(lba, 1);
+
+    ck_assert_int_eq(fs_ops.create("/d0/g", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/d0/g", data, size, 0, NULL), size);
+    struct inode *ip = inode_at("d0", "g");
+    ck_assert_int_eq(group_of(ip->inum, ngroups), group[0]);
+    for (int b = 0; b < size / 4096; b++) {
+        ck_assert_int_eq(balloc_group(bmap(ip, b, NULL)), group[1]);
+    }
+    iput(ip);
+    free(data);
+}
+END_TEST
+
 /* this is an example of a callback function for readdir
  */
 int empty_filler(void *ptr, const char *name, const struct stat *stbuf,
@@ -352,6 +700,60 @@ int empty_filler(void *ptr, const char *name, const struct stat *stbuf,
     return 0;
 }
 
+/* the compact format (gen-disk -c) holds the same tree. Listing a
+ * directory with attributes reads its inode table block once instead
+ * of one block per entry
+ */
+START_TEST(test_itable) {
+    struct block_stats st;
+    struct statvfs sv;
+    struct stat sb;
+    char *buffer = malloc(15000);
+
+    system("python gen-disk.py -q -c disk1.in test.img");
+    block_init("test.img");
+    fs_ops.init(NULL);
+
+    for (int i = 0; getattr_test[i].path != NULL; i++) {
+        ck_assert_int_eq(fs_ops.getattr(getattr_test[i].path, &sb), 0);
+        ck_assert_int_eq(sb.st_size, getattr_test[i].size);
+        ck_assert_int_eq(sb.st_uid, getattr_test[i].uid);
+        ck_assert_int_eq(sb.st_mode & S_IFMT, getattr_test[i].mode & S_IFMT);
+        ck_assert_int_eq(sb.st_mtime, getattr_test[i].mtime);
+    }
+    for (int i = 0; read_test[i].path != NULL; i++) {
+        int n = fs_ops.read(read_test[i].path, buffer, read_test[i].size, 0, NULL);
+        ck_assert_int_eq(n, read_test[i].size);
+        ck_assert_int_eq(crc32(0L, (unsigned char *)buffer, n), read_test[i].cksum);
+    }
+
+    /* "/" has six entries: the original format reads each of their
+     * inodes, the compact one has them from the root's table block
+     */
+    unsigned long reads[2];
+    for (int compact = 0; compact < 2; compact++) {
+        system(compact ? "python gen-disk.py -q -c disk1.in test.img"
+                       : "python gen-disk.py -q disk1.in test.img");
+        block_init("test.img");
+        fs_ops.init(NULL);
+        block_reset_stats();
+        ck_assert_int_eq(fs_ops.readdir("/", NULL, empty_filler, 0, NULL), 0);
+        block_get_stats(&st);
+        reads[compact] = st.reads;
+    }
+    printf("(test_itable) readdir / with attributes: %lu reads, %lu before\n",
+           reads[1], reads[0]);
+    ck_assert_int_eq(reads[0] - reads[1], 6);
+
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    printf("(test_itable) %lu inodes, %lu free\n", (unsigned long)sv.f_files,
+           (unsigned long)sv.f_ffree);
+    ck_assert_int_eq(sv.f_files, 224);
+    ck_assert_int_eq(sv.f_ffree, 224 - 17);
+    free(buffer);
+}
+END_TEST
+
 /* note that your tests will call:
  *  fs_ops.getattr(path, struct stat *sb)
  *  fs_ops.readdir(path, NULL, filler_function, 0, NULL)
@@ -383,6 +785,14 @@ int main(int argc, char **argv)
     tcase_add_test(tc, test_chmod);
     tcase_add_test(tc, test_rename_file);
     tcase_add_test(tc, test_rename_directory);
+    tcase_add_test(tc, test_cache);
+    tcase_add_test(tc, test_read_mmap);
+    tcase_add_test(tc, test_dcache);
+    tcase_add_test(tc, test_dirscan);
+    tcase_add_test(tc, test_balloc);
+    tcase_add_test(tc, test_balloc_big);
+    tcase_add_test(tc, test_balloc_groups);
+    tcase_add_test(tc, test_itable);
 
     suite_add_tcase(s, tc);
     SRunner *sr = srunner_create(s);
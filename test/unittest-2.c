@@ -13,10 +13,27 @@
 #include <zlib.h>
 #include <fuse.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+
+#include "../include/fs.h"
+#include "../include/block.h"
+#include "../include/dcache.h"
+#include "../include/balloc.h"
+#include "../include/txn.h"
 
 extern struct fuse_operations fs_ops;
+extern int fs_mkfs(int nblks);
+extern void fs_set_csum(int on);
+extern void fs_set_extents(int on);
+extern void fs_set_journal(int on);
 extern void block_init(char *file);
+extern int fs_create(struct txn *tx, const char *path, mode_t mode, struct fuse_file_info *fi);
+extern int fs_unlink(struct txn *tx, const char *path);
+extern int fs_write(struct txn *tx, const char *path, const char *buf, size_t len,
+                    off_t offset, struct fuse_file_info *fi);
 
 /* mockup for fuse_get_context. you can change ctx.uid, ctx.gid in
  * tests if you want to test setting UIDs in mknod/mkdir
@@ -59,6 +76,11 @@ int print_filler(void *ptr, const char *name, const struct stat *st, off_t off)
     return 0;
 }
 
+int count_filler(void *ptr, const char *name, const struct stat *st, off_t off) {
+    (*(int *)ptr)++;
+    return 0;
+}
+
 /* create a directory and check that it is visible in readdir
  * then remove it and check that it is no longer visible
  */
@@ -599,10 +621,1112 @@ START_TEST(test_write_error) {
 }
 END_TEST
 
+/* lazy write-back: appends stay in the cache until fsync, repeated
+ * writes to the inode and bitmap are coalesced, and the data is in the
+ * image afterwards (checked by re-opening it with an empty cache)
+ */
+START_TEST(test_writeback) {
+    struct block_stats st;
+    int size = 8 * 1000;
+    char *buf = test_generate(7, size);
+    char *read_buf = malloc(size);
+
+    system("python gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_durability(BLOCK_LAZY, 0), 0);
+
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.create("/wb", S_IFREG | 0777, NULL), 0);
+    for (int off = 0; off < size; off += 1000)
+        ck_assert_int_eq(fs_ops.write("/wb", buf + off, 1000, off, NULL), 1000);
+    block_get_stats(&st);
+    printf("(test_writeback) writes before fsync: %lu\n", st.writes);
+    ck_assert_int_eq(st.writes, 0);
+
+    ck_assert_int_eq(fs_ops.read("/wb", read_buf, size, 0, NULL), size);
+    ck_assert_int_eq(memcmp(buf, read_buf, size), 0);
+
+    ck_assert_int_eq(fs_ops.fsync("/wb", 0, NULL), 0);
+    block_get_stats(&st);
+    printf("(test_writeback) writes after fsync: %lu\n", st.writes);
+    /* inode, bitmap, root directory and 2 data blocks, once each */
+    ck_assert_int_eq(st.writes, 5);
+
+    ck_assert_int_eq(block_durability(BLOCK_SYNC, 0), 0);
+    block_init("test2.img");
+    block_cache_init(32 * 4096);
+    fs_ops.init(NULL);
+    memset(read_buf, 0, size);
+    ck_assert_int_eq(fs_ops.read("/wb", read_buf, size, 0, NULL), size);
+    ck_assert_int_eq(memcmp(buf, read_buf, size), 0);
+
+    free(buf);
+    free(read_buf);
+}
+END_TEST
+
+/* RAM backend: format an empty in-memory device, use it, and check
+ * that a checkpointed RAM disk writes its changes back to the image
+ */
+START_TEST(test_ramdisk) {
+    struct block_stats st;
+    struct statvfs sv;
+    int size = 6000;
+    char *buf = test_generate(8, size);
+    char *read_buf = malloc(size);
+
+    ck_assert_int_eq(block_init_ram(NULL, 400, 0), 1);
+    ck_assert_int_eq(fs_mkfs(400), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_blocks, 398);
+    /* inode table bitmap, 7 table blocks and the root directory */
+    ck_assert_int_eq(sv.f_bfree, 389);
+    ck_assert_int_eq(sv.f_files, 224);
+    ck_assert_int_eq(sv.f_ffree, 221);
+
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.mkdir("/d", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/d/f", S_IFREG | 0777, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/d/f", buf, size, 0, NULL), size);
+    ck_assert_int_eq(fs_ops.read("/d/f", read_buf, size, 0, NULL), size);
+    ck_assert_int_eq(memcmp(buf, read_buf, size), 0);
+    block_get_stats(&st);
+    ck_assert_int_eq(st.syscalls, 0);
+
+    system("python gen-disk.py -q disk2.in test2.img");
+    ck_assert_int_eq(block_init_ram("test2.img", 0, 1), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/ckpt", S_IFREG | 0777, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/ckpt", buf, size, 0, NULL), size);
+    ck_assert_int_eq(fs_ops.fsync("/ckpt", 0, NULL), 0);
+
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    memset(read_buf, 0, size);
+    ck_assert_int_eq(fs_ops.read("/ckpt", read_buf, size, 0, NULL), size);
+    ck_assert_int_eq(memcmp(buf, read_buf, size), 0);
+
+    free(buf);
+    free(read_buf);
+}
+END_TEST
+
+/* streaming a file in small chunks reads ahead into the cache and
+ * most blocks are then served from there; reading it backwards is
+ * not sequential and reads nothing ahead
+ */
+START_TEST(test_readahead) {
+    struct block_stats st;
+    int size = 50 * 4096;
+    char *buf = test_generate(9, size);
+    char *read_buf = malloc(size);
+
+    system("python gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/stream", S_IFREG | 0777, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/stream", buf, size, 0, NULL), size);
+
+    ck_assert_int_eq(block_cache_init(128 * 4096), 0);  /* start cold */
+    block_reset_stats();
+    for (int off = 0; off < size; off += 4096)
+        ck_assert_int_eq(fs_ops.read("/stream", read_buf + off, 4096, off, NULL), 4096);
+    ck_assert_int_eq(memcmp(buf, read_buf, size), 0);
+    block_get_stats(&st);
+    printf("(test_readahead) sequential: %lu read ahead, %lu hits, %lu syscalls\n",
+           st.readahead, st.readahead_hits, st.syscalls);
+    ck_assert_int_gt(st.readahead, 0);
+    ck_assert_int_ge(st.readahead_hits * 10, st.readahead * 9);
+    ck_assert_int_lt(st.syscalls, 25);
+
+    ck_assert_int_eq(block_cache_init(128 * 4096), 0);
+    block_reset_stats();
+    for (int off = 40 * 4096; off >= 0; off -= 4096)
+        ck_assert_int_eq(fs_ops.read("/stream", read_buf, 4096, off, NULL), 4096);
+    block_get_stats(&st);
+    printf("(test_readahead) backwards: %lu read ahead\n", st.readahead);
+    ck_assert_int_eq(st.readahead, 0);
+
+    ck_assert_int_eq(block_cache_init(32 * 4096), 0);
+    free(buf);
+    free(read_buf);
+}
+END_TEST
+
+/* block checksums: -csum adds the region on a fresh image, data
+ * round-trips, and a block corrupted behind the file system's back
+ * fails the read and is reported by the scrubber
+ */
+START_TEST(test_csum) {
+    struct block_stats st;
+    struct fs_super sb;
+    struct fs_inode in;
+    int size = 6000;
+    char *buf = test_generate(10, size);
+    char *read_buf = malloc(size);
+
+    system("python gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    fs_set_csum(1);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    printf("(test_csum) checksum region at %d, %d blocks\n", sb.csum_start, sb.csum_blocks);
+    ck_assert_int_gt(sb.csum_start, 2);
+    ck_assert_int_eq(sb.csum_blocks, 1);
+
+    ck_assert_int_eq(fs_ops.create("/sum", S_IFREG | 0777, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/sum", buf, size, 0, NULL), size);
+
+    /* re-open: checksums come back from the region */
+    fs_set_csum(0);
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.read("/sum", read_buf, size, 0, NULL), size);
+    ck_assert_int_eq(memcmp(buf, read_buf, size), 0);
+
+    /* flip a byte in the file's second block */
+    FILE *fp = fopen("test2.img", "r+b");
+    ck_assert(fp != NULL);
+    for (int i = 3; i < 400; i++) {
+        ck_assert_int_eq(block_read(&in, i, 1), 0);
+        if (S_ISREG(in.mode) && in.size == size)
+            break;
+    }
+    fseek(fp, (long)in.ptrs[1] * 4096 + 100, SEEK_SET);
+    fputc('!', fp);
+    fclose(fp);
+
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.read("/sum", read_buf, size, 0, NULL), -EIO);
+    block_get_stats(&st);
+    ck_assert_int_gt(st.csum_errors, 0);
+
+    block_reset_stats();
+    ck_assert_int_eq(block_scrub(1L << 30), 0);
+    for (int i = 0; i < 500; i++) {
+        block_get_stats(&st);
+        if (st.scrubbed >= 400)
+            break;
+        usleep(10000);
+    }
+    ck_assert_int_eq(block_scrub(0), 0);
+    printf("(test_csum) scrubbed %lu blocks, %lu errors\n", st.scrubbed, st.csum_errors);
+    ck_assert_int_ge(st.scrubbed, 400);
+    ck_assert_int_ge(st.csum_errors, 1);
+
+    free(buf);
+    free(read_buf);
+}
+END_TEST
+
+/* online discard: unlinking a file discards its blocks, which then
+ * read back as zeroes
+ */
+START_TEST(test_discard) {
+    struct block_stats st;
+    struct fs_inode in;
+    char data[4096], zero[4096];
+    int size = 10 * 4096;
+    char *buf = test_generate(11, size);
+
+    system("python gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    block_set_discard(1);
+
+    ck_assert_int_eq(fs_ops.create("/trim", S_IFREG | 0777, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/trim", buf, size, 0, NULL), size);
+    int inum = -1;
+    for (int i = 3; i < 400 && inum < 0; i++) {
+        ck_assert_int_eq(block_read(&in, i, 1), 0);
+        if (S_ISREG(in.mode) && in.size == size)
+            inum = i;
+    }
+    ck_assert_int_gt(inum, 0);
+
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.unlink("/trim"), 0);
+    block_get_stats(&st);
+    printf("(test_discard) %lu blocks discarded\n", st.discards);
+    if (st.discards > 0) {
+        ck_assert_int_eq(st.discards, 11);
+        memset(zero, 0, sizeof(zero));
+        for (int i = 0; i < 10; i++) {
+            ck_assert_int_eq(block_read(data, in.ptrs[i], 1), 0);
+            ck_assert_int_eq(memcmp(data, zero, sizeof(zero)), 0);
+        }
+    }
+
+    block_set_discard(0);
+    free(buf);
+}
+END_TEST
+
+/* inode cache: a warm getattr reads no blocks at all (the directory
+ * blocks on the path are skipped by the dentry cache), and inode
+ * changes made in write-back mode reach the image when it is flushed
+ */
+START_TEST(test_icache) {
+    struct block_stats st;
+    struct stat sb;
+
+    system("python gen-disk.py -q disk1.in test.img");
+    block_init("test.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_cache_init(0), 0);
+
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    block_get_stats(&st);
+    printf("(test_icache) blocks read by a warm getattr: %lu\n", st.reads);
+    ck_assert_int_eq(st.reads, 0);
+    ck_assert_int_eq(sb.st_size, 12288);
+
+    ck_assert_int_eq(block_cache_init(32 * 4096), 0);
+    ck_assert_int_eq(block_durability(BLOCK_LAZY, 0), 0);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.chmod("/dir3/subdir/file.12k", 0600), 0);
+    ck_assert_int_eq(fs_ops.utime("/dir3/subdir/file.12k",
+                                  &(struct utimbuf){.actime = 7, .modtime = 9}), 0);
+    block_get_stats(&st);
+    ck_assert_int_eq(st.writes, 0);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    ck_assert_int_eq(sb.st_mode, S_IFREG | 0600);
+    ck_assert_int_eq(sb.st_mtime, 9);
+
+    ck_assert_int_eq(fs_ops.flush("/dir3/subdir/file.12k", NULL), 0);
+    block_get_stats(&st);
+    ck_assert_int_eq(st.writes, 1);     /* both changes, one inode write */
+
+    ck_assert_int_eq(block_durability(BLOCK_SYNC, 0), 0);
+    block_init("test.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    ck_assert_int_eq(sb.st_mode, S_IFREG | 0600);
+    ck_assert_int_eq(sb.st_mtime, 9);
+    ck_assert_int_eq(sb.st_ctime, 7);
+}
+END_TEST
+
+/* negative lookups: repeated probes for a missing name are answered
+ * from the dentry cache, and create, mkdir and rename make the name
+ * visible again
+ */
+START_TEST(test_negative) {
+    struct block_stats st;
+    struct dcache_stats ds;
+    struct stat sb;
+
+    system("python gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_cache_init(0), 0);
+
+    ck_assert_int_eq(fs_ops.getattr("/probe.h", &sb), -ENOENT);
+    block_reset_stats();
+    for (int i = 0; i < 100; i++) {
+        ck_assert_int_eq(fs_ops.getattr("/probe.h", &sb), -ENOENT);
+        ck_assert_int_eq(fs_ops.getattr("/nodir/probe.h", &sb), -ENOENT);
+    }
+    block_get_stats(&st);
+    dcache_get_stats(&ds);
+    printf("(test_negative) negative hits %lu, directory scans %lu, reads %lu\n",
+           ds.neg_hits, ds.misses, st.reads);
+    ck_assert_int_eq(st.reads, 1);      /* the first probe of /nodir */
+    ck_assert_int_ge(ds.neg_hits, 199);
+
+    ck_assert_int_eq(fs_ops.create("/probe.h", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.getattr("/probe.h", &sb), 0);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.create("/probe.h", S_IFREG | 0666, NULL), -EEXIST);
+    block_get_stats(&st);
+    ck_assert_int_eq(st.reads, 0);      /* known to exist, no scan */
+
+    ck_assert_int_eq(fs_ops.mkdir("/nodir", 0777), 0);
+    ck_assert_int_eq(fs_ops.getattr("/nodir", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/nodir/probe.h", &sb), -ENOENT);
+
+    ck_assert_int_eq(fs_ops.getattr("/renamed.h", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.rename("/probe.h", "/renamed.h"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/renamed.h", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/probe.h", &sb), -ENOENT);
+
+    ck_assert_int_eq(fs_ops.unlink("/renamed.h"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/renamed.h", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.rmdir("/nodir"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/nodir", &sb), -ENOENT);
+
+    ck_assert_int_eq(block_cache_init(32 * 4096), 0);
+}
+END_TEST
+
+/* hashed directories: thousands of names in one directory, found
+ * again from disk after the caches are dropped, then removed
+ */
+START_TEST(test_bigdir) {
+    struct statvfs sv;
+    struct stat sb;
+    char name[32];
+    int n = 3000, count = 0;
+
+    ck_assert_int_eq(block_init_ram(NULL, 8192, 0), 1);
+    ck_assert_int_eq(fs_mkfs(8192), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    unsigned long bfree = sv.f_bfree;
+
+    ck_assert_int_eq(fs_ops.mkdir("/big", 0777), 0);
+    for (int i = 0; i < n; i++) {
+        sprintf(name, "/big/file-%d", i);
+        ck_assert_int_eq(fs_ops.create(name, S_IFREG | 0666, NULL), 0);
+    }
+    ck_assert_int_eq(fs_ops.create("/big/file-17", S_IFREG | 0666, NULL), -EEXIST);
+
+    fs_ops.init(NULL);          /* cold caches */
+    ck_assert_int_eq(fs_ops.getattr("/big", &sb), 0);
+    printf("(test_bigdir) %d entries in %ld directory blocks\n", n,
+           (long)sb.st_size / 4096);
+    ck_assert_int_ge(sb.st_size / 4096, n / 128);
+    for (int i = 0; i < n; i++) {
+        sprintf(name, "/big/file-%d", i);
+        ck_assert_int_eq(fs_ops.getattr(name, &sb), 0);
+    }
+    ck_assert_int_eq(fs_ops.readdir("/big", &count, count_filler, 0, NULL), 0);
+    ck_assert_int_eq(count, n);
+
+    for (int i = 0; i < n; i += 2) {
+        sprintf(name, "/big/file-%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rename("/big/file-1", "/big/renamed"), 0);
+    ck_assert_int_eq(fs_ops.rename("/big/file-3", "/big/file-5"), -EEXIST);
+
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/big/file-0", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/big/file-1", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/big/file-3", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/big/renamed", &sb), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/big"), -ENOTEMPTY);
+
+    for (int i = 3; i < n; i += 2) {
+        sprintf(name, "/big/file-%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.unlink("/big/renamed"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/big"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree);
+}
+END_TEST
+
+/* extent-mapped files (compact format): a file written in large
+ * appends is a few extents kept in its inode, bigger than block
+ * pointers could map, while two files written a block at a time in
+ * turn have an extent per block, which spill into extent blocks. All
+ * of it reads back after a remount, and truncate and unlink give every
+ * block back
+ */
+START_TEST(test_extents) {
+    struct statvfs sv;
+    int big = 8 * 1024 * 1024, chunk = 64 * 1024, n = 600;
+    int nleaf = DIV_ROUND_UP(n, FS_EXTENTS_PER_BLOCK);
+    int nhole = 2 * (n + nleaf) + 10;
+    char path[32];
+
+    ck_assert_int_eq(block_init_ram(NULL, 8192, 0), 1);
+    ck_assert_int_eq(fs_mkfs(8192), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    long bfree = sv.f_bfree;
+
+    char *seq = test_generate(0, big);
+    ck_assert_int_eq(fs_ops.create("/seq", S_IFREG | 0666, NULL), 0);
+    for (int off = 0; off < big; off += chunk) {
+        ck_assert_int_eq(fs_ops.write("/seq", seq + off, chunk, off, NULL), chunk);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree - big / 4096); /* no map blocks */
+
+    /* files appended to in turn get runs of their own, so to give /x
+     * and /y a map that takes extent blocks, the disk is left with
+     * nothing but one-block holes: every other one of a row of
+     * one-block files is removed once /pad has filled the rest
+     */
+    ck_assert_int_eq(fs_ops.create("/x", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.create("/y", S_IFREG | 0666, NULL), 0);
+    for (int i = 0; i < 2 * nhole; i++) {
+        sprintf(path, "/p%d", i);
+        ck_assert_int_eq(fs_ops.create(path, S_IFREG | 0666, NULL), 0);
+        ck_assert_int_eq(fs_ops.write(path, seq, 4096, 0, NULL), 4096);
+    }
+    ck_assert_int_eq(fs_ops.create("/pad", S_IFREG | 0666, NULL), 0);
+    int off = 0;
+    while (fs_ops.write("/pad", seq, chunk, off, NULL) == chunk) {
+        off += chunk;
+    }
+    while (fs_ops.write("/pad", seq, 4096, off, NULL) == 4096) {
+        off += 4096;
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, 0);
+    for (int i = 1; i < 2 * nhole; i += 2) {
+        sprintf(path, "/p%d", i);
+        ck_assert_int_eq(fs_ops.unlink(path), 0);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, nhole);
+
+    char *frag = test_generate(7, 2 * n * 4096);
+    for (int i = 0; i < n; i++) {
+        ck_assert_int_eq(fs_ops.write("/x", frag + i * 4096, 4096, i * 4096, NULL), 4096);
+        ck_assert_int_eq(fs_ops.write("/y", frag + (n + i) * 4096, 4096, i * 4096, NULL), 4096);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, nhole - 2 * (n + nleaf));
+
+    fs_ops.init(NULL);          /* cold caches */
+    char *buf = malloc(big);
+    ck_assert_int_eq(fs_ops.read("/seq", buf, big, 0, NULL), big);
+    ck_assert(memcmp(buf, seq, big) == 0);
+    ck_assert_int_eq(fs_ops.read("/x", buf, n * 4096, 0, NULL), n * 4096);
+    ck_assert(memcmp(buf, frag, n * 4096) == 0);
+    /* across the first extent block's end */
+    off = FS_EXTENTS_PER_BLOCK * 4096 - 100;
+    ck_assert_int_eq(fs_ops.read("/y", buf, 8192, off, NULL), 8192);
+    ck_assert(memcmp(buf, frag + n * 4096 + off, 8192) == 0);
+
+    ck_assert_int_eq(fs_ops.truncate("/seq", 0), 0);
+    ck_assert_int_eq(fs_ops.unlink("/x"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, nhole - (n + nleaf) + big / 4096);
+    ck_assert_int_eq(fs_ops.unlink("/y"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/seq"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, nhole + big / 4096);
+
+    free(seq);
+    free(frag);
+    free(buf);
+}
+END_TEST
+
+/* files written a block at a time in turn each stay in a few long
+ * runs, right after their last block
+ */
+START_TEST(test_contig) {
+    struct statvfs sv;
+    int n = 256;
+
+    ck_assert_int_eq(block_init_ram(NULL, 8192, 0), 1);
+    ck_assert_int_eq(fs_mkfs(8192), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    long bfree = sv.f_bfree;
+
+    char *data = test_generate(9, 2 * n * 4096);
+    ck_assert_int_eq(fs_ops.create("/a", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.create("/b", S_IFREG | 0666, NULL), 0);
+    for (int i = 0; i < n; i++) {
+        ck_assert_int_eq(fs_ops.write("/a", data + i * 4096, 4096, i * 4096, NULL), 4096);
+        ck_assert_int_eq(fs_ops.write("/b", data + (n + i) * 4096, 4096, i * 4096, NULL), 4096);
+    }
+    /* few enough extents to fit in the inode: no extent blocks */
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree - 2 * n);
+
+    /* and reading one back takes a handful of requests, not one a block */
+    struct block_stats st;
+    char *buf = malloc(n * 4096);
+    fs_ops.init(NULL);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.read("/b", buf, n * 4096, 0, NULL), n * 4096);
+    ck_assert(memcmp(buf, data + n * 4096, n * 4096) == 0);
+    block_get_stats(&st);
+    ck_assert_int_le(st.syscalls, FS_NEXTENT + 4);
+
+    free(data);
+    free(buf);
+}
+END_TEST
+
+/* an image too big for one bitmap block: blocks past the first one's
+ * 32768 are used, and the bitmap is all read back at mount
+ */
+START_TEST(test_big_bitmap) {
+    struct statvfs sv;
+    int nblks = 3 * 32768 + 100, chunk = 1024 * 1024, size = 160 * chunk;
+
+    ck_assert_int_eq(block_init_ram(NULL, nblks, 0), 1);
+    ck_assert_int_eq(fs_mkfs(nblks), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_blocks, nblks - 1 - 4);
+    long bfree = sv.f_bfree;
+
+    char *data = test_generate(11, chunk);
+    ck_assert_int_eq(fs_ops.create("/big", S_IFREG | 0666, NULL), 0);
+    for (int off = 0; off < size; off += chunk) {
+        ck_assert_int_eq(fs_ops.write("/big", data, chunk, off, NULL), chunk);
+    }
+    ck_assert_int_eq(fs_ops.create("/last", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/last", data, chunk, 0, NULL), chunk);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree - size / 4096 - chunk / 4096);
+
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree - size / 4096 - chunk / 4096);
+    char *buf = malloc(chunk);
+    ck_assert_int_eq(fs_ops.read("/last", buf, chunk, 0, NULL), chunk);
+    ck_assert(memcmp(buf, data, chunk) == 0);
+
+    /* a new file doesn't land on anything already in use */
+    ck_assert_int_eq(fs_ops.create("/more", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/more", buf, chunk, 0, NULL), chunk);
+    ck_assert_int_eq(fs_ops.read("/big", buf, chunk, size - chunk, NULL), chunk);
+    ck_assert(memcmp(buf, data, chunk) == 0);
+    ck_assert_int_eq(fs_ops.read("/last", buf, chunk, 0, NULL), chunk);
+    ck_assert(memcmp(buf, data, chunk) == 0);
+
+    ck_assert_int_eq(fs_ops.unlink("/big"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/last"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/more"), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree);
+
+    free(data);
+    free(buf);
+}
+END_TEST
+
+START_TEST(test_indirect) {
+    struct statvfs sv;
+    struct block_stats st;
+    int n = FS_NDIRECT + FS_PTRS_PER_BLOCK + 200, size = n * 4096;
+
+    fs_set_extents(0);
+    ck_assert_int_eq(block_init_ram(NULL, 8192, 0), 1);
+    ck_assert_int_eq(fs_mkfs(8192), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    long bfree = sv.f_bfree;
+
+    char *data = test_generate(3, size);
+    ck_assert_int_eq(fs_ops.create("/big", S_IFREG | 0666, NULL), 0);
+    for (int off = 0; off < size; off += 64 * 1024) {
+        int len = size - off < 64 * 1024 ? size - off : 64 * 1024;
+        ck_assert_int_eq(fs_ops.write("/big", data + off, len, off, NULL), len);
+    }
+    /* indirect, double-indirect and one block it points to */
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree - n - 3);
+
+    fs_ops.init(NULL);          /* cold caches */
+    char *buf = malloc(size);
+    ck_assert_int_eq(fs_ops.read("/big", buf, size, 0, NULL), size);
+    ck_assert(memcmp(buf, data, size) == 0);
+
+    /* the pointer blocks are cached now */
+    block_reset_stats();
+    for (int i = 0; i < 100; i++) {
+        int off = (i * 677 % n) * 4096;
+        ck_assert_int_eq(fs_ops.read("/big", buf, 4096, off, NULL), 4096);
+        ck_assert(memcmp(buf, data + off, 4096) == 0);
+    }
+    block_get_stats(&st);
+    ck_assert_int_eq(st.reads, 0);
+
+    ck_assert_int_eq(fs_ops.truncate("/big", 0), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree);
+
+    /* it grows the same way again with the freed pointer blocks gone */
+    ck_assert_int_eq(fs_ops.write("/big", data, size, 0, NULL), size);
+    ck_assert_int_eq(fs_ops.read("/big", buf, size, 0, NULL), size);
+    ck_assert(memcmp(buf, data, size) == 0);
+    ck_assert_int_eq(fs_ops.unlink("/big"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree);
+
+    fs_set_extents(1);
+    free(data);
+    free(buf);
+}
+END_TEST
+
+/* an original-format image from before inodes had flags: a file
+ * using all 1019 of its block pointers reads back whole, with no flags
+ * made up from its last pointer, and grows past them
+ */
+START_TEST(test_legacy_maxfile) {
+    int nptrs = FS_BLOCK_SIZE / 4 - 5, size = nptrs * 4096, nblks = 2048;
+    struct fs_super sb = {.magic = FS_MAGIC, .disk_size = nblks};
+    struct fs_inode in;
+    struct fs_dirent de[128];
+    unsigned char map[4096];
+    struct stat st;
+
+    ck_assert_int_eq(block_init_ram(NULL, nblks, 0), 1);
+    ck_assert_int_eq(block_write_super(&sb), 0);
+
+    /* superblock, bitmap, root inode and directory, file inode, and
+     * its blocks from 5 on - the last one, 1023, has every flag bit
+     * set if taken for flags
+     */
+    memset(map, 0, sizeof(map));
+    memset(map, 0xff, (5 + nptrs) / 8);
+    ck_assert_int_eq(block_write(map, 1, 1), 0);
+
+    memset(&in, 0, sizeof(in));
+    in.mode = S_IFDIR | 0777;
+    in.size = 4096;
+    in.ptrs[0] = 3;
+    ck_assert_int_eq(block_write(&in, 2, 1), 0);
+    memset(de, 0, sizeof(de));
+    de[0] = (struct fs_dirent){.valid = 1, .inode = 4, .name = "old"};
+    ck_assert_int_eq(block_write(de, 3, 1), 0);
+
+    char *data = test_generate(17, size + 4096);
+    memset(&in, 0, sizeof(in));
+    in.mode = S_IFREG | 0666;
+    in.size = size;
+    for (int i = 0; i < nptrs; i++) {
+        in.ptrs[i] = 5 + i;
+        ck_assert_int_eq(block_write(data + (size_t)i * 4096, 5 + i, 1), 0);
+    }
+    ck_assert_int_eq(in.ptrs[nptrs - 1], 1023);
+    ck_assert_int_eq(block_write(&in, 4, 1), 0);
+
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/old", &st), 0);
+    ck_assert_int_eq(st.st_size, size);
+    char *buf = malloc(size + 4096);
+    ck_assert_int_eq(fs_ops.read("/old", buf, size, 0, NULL), size);
+    ck_assert(memcmp(buf, data, size) == 0);
+
+    /* one more block takes the indirect blocks, which it keeps */
+    ck_assert_int_eq(fs_ops.write("/old", data + size, 4096, size, NULL), 4096);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.read("/old", buf, size + 4096, 0, NULL), size + 4096);
+    ck_assert(memcmp(buf, data, size + 4096) == 0);
+    ck_assert_int_eq(block_read(&in, 4, 1), 0);
+    ck_assert_int_eq(in.mode >> FS_FLAGS_SHIFT, FS_INDIRECT);
+    ck_assert_int_eq(in.mode & ((1 << FS_FLAGS_SHIFT) - 1), S_IFREG | 0666);
+
+    free(data);
+    free(buf);
+}
+END_TEST
+
+/* small files keep their data in the inode: no blocks, and no reads
+ * once the inode is cached. It moves out to a block when the file
+ * grows past what fits, and back in when it is truncated
+ */
+START_TEST(test_inline) {
+    struct statvfs sv;
+    struct block_stats st;
+    struct stat sb;
+    int max = FS_INLINE_COMPACT;
+    char buf[2 * FS_INLINE_COMPACT];
+    char *data = test_generate(5, 5000);
+
+    ck_assert_int_eq(block_init_ram(NULL, 1024, 0), 1);
+    ck_assert_int_eq(fs_mkfs(1024), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    long bfree = sv.f_bfree;
+
+    ck_assert_int_eq(fs_ops.create("/small", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/small", data, 10, 0, NULL), 10);
+    ck_assert_int_eq(fs_ops.write("/small", data + 10, max - 10, 10, NULL), max - 10);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree);
+
+    fs_ops.init(NULL);          /* from disk */
+    ck_assert_int_eq(fs_ops.getattr("/small", &sb), 0);
+    ck_assert_int_eq(sb.st_size, max);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.read("/small", buf, sizeof(buf), 0, NULL), max);
+    block_get_stats(&st);
+    ck_assert_int_eq(st.reads, 0);
+    ck_assert(memcmp(buf, data, max) == 0);
+
+    /* one byte too many */
+    ck_assert_int_eq(fs_ops.write("/small", data + max, 1, max, NULL), 1);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree - 1);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.read("/small", buf, sizeof(buf), 0, NULL), max + 1);
+    ck_assert(memcmp(buf, data, max + 1) == 0);
+
+    ck_assert_int_eq(fs_ops.truncate("/small", 0), 0);
+    ck_assert_int_eq(fs_ops.write("/small", data, 10, 0, NULL), 10);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree);
+    ck_assert_int_eq(fs_ops.unlink("/small"), 0);
+
+    /* the original format has room for nearly a block */
+    system("python gen-disk.py -q disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/small", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    bfree = sv.f_bfree;
+    ck_assert_int_eq(fs_ops.write("/small", data, 4000, 0, NULL), 4000);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree);
+    ck_assert_int_eq(fs_ops.write("/small", data + 4000, 1000, 4000, NULL), 1000);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, bfree - 2);
+    fs_ops.init(NULL);
+    char big[5000];
+    ck_assert_int_eq(fs_ops.read("/small", big, 5000, 0, NULL), 5000);
+    ck_assert(memcmp(big, data, 5000) == 0);
+    ck_assert_int_eq(fs_ops.unlink("/small"), 0);
+
+    free(data);
+}
+END_TEST
+
+/* statfs comes from counts in memory, without reading the disk; they
+ * are left in the superblock at unmount, and recounted at mount time
+ * if they are wrong there
+ */
+START_TEST(test_statfs_counts) {
+    struct statvfs sv0, sv;
+    struct block_stats st;
+    struct fs_super sb;
+    char *data = test_generate(9, 3 * 4096);
+
+    system("python gen-disk.py -q -c disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(fs_ops.create("/counted", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/counted", data, 3 * 4096, 0, NULL), 3 * 4096);
+
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    block_get_stats(&st);
+    ck_assert_int_eq(st.reads + st.cache_hits + st.syscalls, 0);
+    ck_assert_int_eq(sv.f_bfree, sv0.f_bfree - 3);
+    ck_assert_int_eq(sv.f_ffree, sv0.f_ffree - 1);
+
+    fs_ops.destroy(NULL);
+    block_init("test2.img");
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    ck_assert_int_eq(sb.free_blocks, sv.f_bfree);
+    ck_assert_int_eq(sb.free_inodes, sv.f_ffree);
+
+    /* as if the image hadn't been unmounted */
+    sb.free_blocks = sb.free_inodes = 0;
+    ck_assert_int_eq(block_write_super(&sb), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+    ck_assert_int_eq(sv0.f_bfree, sv.f_bfree);
+    ck_assert_int_eq(sv0.f_ffree, sv.f_ffree);
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    ck_assert_int_eq(sb.free_blocks, sv.f_bfree);
+    ck_assert_int_eq(sb.free_inodes, sv.f_ffree);
+
+    ck_assert_int_eq(fs_ops.unlink("/counted"), 0);
+    free(data);
+}
+END_TEST
+
+/* metadata journal: -journal adds the region, an operation's metadata
+ * goes out as one record, and what is still in the journal when the
+ * image is "crashed" (copied while mounted) is replayed at mount
+ */
+START_TEST(test_journal) {
+    struct block_stats st;
+    struct statvfs sv0, sv;
+    struct fs_super sb;
+    struct stat s;
+    int size = 3 * 4096 + 100;
+    char *data = test_generate(11, size);
+    char *read_buf = malloc(size);
+
+    system("python gen-disk.py -q -c disk2.in test2.img");
+    block_init("test2.img");
+    fs_set_journal(1);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    printf("(test_journal) journal at %d, %d blocks\n", sb.journal_start, sb.journal_blocks);
+    ck_assert_int_gt(sb.journal_start, 2);
+    ck_assert_int_ge(sb.journal_blocks, 64);
+
+    /* inode, bitmaps and directory block: one record */
+    ck_assert_int_eq(fs_ops.getattr("/", &s), 0);
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.create("/j1", S_IFREG | 0666, NULL), 0);
+    block_get_stats(&st);
+    printf("(test_journal) create: %lu blocks written, %lu syscalls\n", st.writes, st.syscalls - st.reads);
+    ck_assert_int_eq(st.syscalls - st.reads, 1);
+
+    ck_assert_int_eq(fs_ops.mkdir("/jd", 0777), 0);
+    ck_assert_int_eq(fs_ops.create("/jd/f", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/jd/f", data, size, 0, NULL), size);
+    ck_assert_int_eq(fs_ops.rename("/j1", "/j2"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+
+    /* the copy has the changes in the journal only */
+    system("cp test2.img crash.img");
+    block_init("crash.img");
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    int n = block_journal_init(sb.journal_start, sb.journal_blocks, 0);
+    printf("(test_journal) replayed %d records\n", n);
+    ck_assert_int_gt(n, 0);
+    fs_set_journal(0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/j1", &s), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/j2", &s), 0);
+    ck_assert_int_eq(fs_ops.getattr("/jd/f", &s), 0);
+    ck_assert_int_eq(s.st_size, size);
+    ck_assert_int_eq(fs_ops.read("/jd/f", read_buf, size, 0, NULL), size);
+    ck_assert_int_eq(memcmp(data, read_buf, size), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, sv0.f_bfree);
+    ck_assert_int_eq(sv.f_ffree, sv0.f_ffree);
+
+    /* and once checkpointed there is nothing left to replay */
+    block_exit();
+    block_init("crash.img");
+    ck_assert_int_eq(block_journal_init(sb.journal_start, sb.journal_blocks, 0), 0);
+    block_exit();
+    unlink("crash.img");
+    free(data);
+    free(read_buf);
+}
+END_TEST
+
+/* blocks an unlink frees aren't reused until its journal record is
+ * written: on a full disk a write after it finds no room, and the
+ * image "crashed" before then still has the file, with its data. The
+ * journal operation is held open (block_op_begin) so the checkpointer
+ * can't commit it meanwhile
+ */
+START_TEST(test_journal_reuse) {
+    struct statvfs sv0, sv;
+    struct fuse_file_info fi = {0};
+    struct fs_super sb;
+    struct stat s;
+    struct txn tx, t2;
+    int size = 8 * 4096;
+    char *data = test_generate(12, size);
+    char *other = test_generate(13, size);
+    char *read_buf = malloc(size);
+
+    system("python gen-disk.py -q -c disk2.in test2.img");
+    block_init("test2.img");
+    fs_set_journal(1);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/old", S_IFREG | 0666, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/old", data, size, 0, NULL), size);
+    ck_assert_int_eq(fs_ops.create("/fill", S_IFREG | 0666, NULL), 0);
+    int rv, off = 0;
+    while ((rv = fs_ops.write("/fill", other, 4096, off, NULL)) == 4096)
+        off += 4096;
+    ck_assert_int_eq(rv, -ENOSPC);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+
+    block_op_begin();
+    txn_begin(&tx);
+    ck_assert_int_eq(fs_unlink(&tx, "/old"), 0);
+    ck_assert_int_eq(txn_commit(&tx), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, sv0.f_bfree);
+
+    txn_begin(&t2);
+    ck_assert_int_eq(fs_create(&t2, "/new", S_IFREG | 0666, &fi), 0);
+    ck_assert_int_eq(fs_write(&t2, "/new", other, size, 0, &fi), -ENOSPC);
+    ck_assert_int_eq(txn_commit(&t2), 0);
+
+    system("cp test2.img crash.img");
+    ck_assert_int_eq(block_op_end(), 0);
+    txn_end(&tx, 1);
+    txn_end(&t2, 1);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, sv0.f_bfree + size / 4096);
+
+    block_init("crash.img");
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    block_journal_init(sb.journal_start, sb.journal_blocks, 0);
+    fs_set_journal(0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/new", &s), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/old", &s), 0);
+    ck_assert_int_eq(fs_ops.read("/old", read_buf, size, 0, NULL), size);
+    ck_assert_int_eq(memcmp(data, read_buf, size), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv.f_bfree, sv0.f_bfree);
+
+    block_exit();
+    unlink("crash.img");
+    free(data);
+    free(other);
+    free(read_buf);
+}
+END_TEST
+
+/* creates in one directory from several threads at once: every one
+ * of them is there afterwards, each name once, and a name two threads
+ * race for is created by exactly one of them
+ */
+#define CC_THREADS 8
+#define CC_FILES   400
+
+static int cc_created[CC_THREADS], cc_failed[CC_THREADS];
+
+static void *cc_worker(void *arg) {
+    int t = (intptr_t)arg;
+    char name[32];
+
+    for (int i = 0; i < CC_FILES; i++) {
+        sprintf(name, "/cc/t%d-%d", t, i);
+        if (fs_ops.create(name, S_IFREG | 0666, NULL) != 0) {
+            cc_failed[t]++;
+        }
+        sprintf(name, "/cc/shared-%d", i);
+        if (fs_ops.create(name, S_IFREG | 0666, NULL) == 0) {
+            cc_created[t]++;
+        }
+    }
+    return NULL;
+}
+
+START_TEST(test_concurrent_create) {
+    pthread_t th[CC_THREADS];
+    struct statvfs sv0, sv;
+    struct stat sb;
+    char name[32];
+    int count = 0, shared = 0;
+
+    ck_assert_int_eq(block_init_ram(NULL, 16384, 0), 1);
+    ck_assert_int_eq(fs_mkfs(16384), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.mkdir("/cc", 0777), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &sv0), 0);
+
+    for (int t = 0; t < CC_THREADS; t++) {
+        ck_assert_int_eq(pthread_create(&th[t], NULL, cc_worker, (void *)(intptr_t)t), 0);
+    }
+    for (int t = 0; t < CC_THREADS; t++) {
+        pthread_join(th[t], NULL);
+        ck_assert_int_eq(cc_failed[t], 0);
+        shared += cc_created[t];
+    }
+    ck_assert_int_eq(shared, CC_FILES);
+
+    int n = CC_THREADS * CC_FILES + CC_FILES;
+    ck_assert_int_eq(fs_ops.statfs("/", &sv), 0);
+    ck_assert_int_eq(sv0.f_ffree - sv.f_ffree, n);
+
+    fs_ops.init(NULL);          /* cold caches */
+    ck_assert_int_eq(fs_ops.readdir("/cc", &count, count_filler, 0, NULL), 0);
+    ck_assert_int_eq(count, n);
+    for (int t = 0; t < CC_THREADS; t++) {
+        for (int i = 0; i < CC_FILES; i++) {
+            sprintf(name, "/cc/t%d-%d", t, i);
+            ck_assert_int_eq(fs_ops.getattr(name, &sb), 0);
+        }
+    }
+}
+END_TEST
+
 /* test fs_truncate by creating files of different sizes
  * and truncating them to zero. check that the
  * space has been freed and that the file size is zero
  */
+/* an operation writes each metadata block it changes once: a write
+ * that allocates many blocks, or a truncate that frees them, writes
+ * the bitmap block and the inode once each
+ */
+START_TEST(test_txn_writes) {
+    struct block_stats st;
+    int nblks = 300, size = nblks * 4096;
+    char *data = test_generate(12, size);
+
+    system("python gen-disk.py -q -c disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.create("/txn", S_IFREG | 0666, NULL), 0);
+
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.write("/txn", data, size, 0, NULL), size);
+    block_get_stats(&st);
+    printf("(test_txn_writes) write: %lu blocks written, %lu syscalls\n", st.writes, st.syscalls - st.reads);
+    ck_assert_int_eq(st.writes, nblks + 2); // the data, one bitmap block, the inode
+
+    block_reset_stats();
+    ck_assert_int_eq(fs_ops.truncate("/txn", 0), 0);
+    block_get_stats(&st);
+    printf("(test_txn_writes) truncate: %lu blocks written, %lu syscalls\n", st.writes, st.syscalls - st.reads);
+    ck_assert_int_eq(st.writes, 2); // the inode and the bitmap block
+
+    ck_assert_int_eq(fs_ops.unlink("/txn"), 0);
+    free(data);
+}
+END_TEST
+
+/* bitmap changes are per operation: committing one writes its own
+ * bits and not another's, and bits it cleared go back to the
+ * allocator (each once) only when it ends
+ */
+static int bits_freed[2];
+
+static void count_free(int i, int n) {
+    bits_freed[0] = i;
+    bits_freed[1] += n;
+}
+
+START_TEST(test_txn_bits) {
+    static struct txn_map map;
+    unsigned char bits[4096] = {0}, buf[4096];
+    struct txn a, b;
+
+    system("python gen-disk.py -q -c disk2.in test2.img");
+    block_init("test2.img");
+    fs_ops.init(NULL);
+    int lba = balloc(0);
+    ck_assert_int_gt(lba, 0);
+    bits[0] = 0xe0;
+    ck_assert_int_eq(txn_map_init(&map, lba, 1, bits, count_free), 0);
+
+    txn_begin(&a);
+    txn_begin(&b);
+    ck_assert_int_eq(txn_bits(&a, &map, 1, 1, 1), 0);
+    ck_assert_int_eq(txn_bits(&b, &map, 2, 1, 1), 0);
+    ck_assert_int_eq(txn_bits(&b, &map, 5, 2, 0), 0);
+    ck_assert_int_eq(txn_bits(&b, &map, 6, 2, 0), 0);
+    struct block_iov iov = {.lba = lba, .buf = bits, .nblks = 1};
+    ck_assert_int_eq(txn_add(&b, &iov, 1), -EINVAL);
+
+    ck_assert_int_eq(txn_commit(&a), 0);
+    txn_end(&a, 1);
+    ck_assert_int_eq(block_read(buf, lba, 1), 0);
+    ck_assert_int_eq(buf[0], 0xe2);
+    ck_assert_int_eq(bits_freed[1], 0);
+
+    ck_assert_int_eq(txn_commit(&b), 0);
+    ck_assert_int_eq(block_read(buf, lba, 1), 0);
+    ck_assert_int_eq(buf[0], 0x06);
+    ck_assert_int_eq(bits_freed[1], 0);
+    txn_end(&b, 1);
+    ck_assert_int_eq(bits_freed[0], 5);
+    ck_assert_int_eq(bits_freed[1], 3);
+
+    ck_assert_int_eq(txn_map_init(&map, 0, 0, NULL, count_free), 0);
+    balloc_free(lba, 1);
+}
+END_TEST
+
 START_TEST(test_truncate) {
     system("python gen-disk.py -q disk2.in test2.img");
     block_init("test2.img");
@@ -672,6 +1796,7 @@ int main(int argc, char **argv)
 {
     system("python gen-disk.py -q disk2.in test2.img");
     block_init("test2.img");
+    block_cache_init(32 * 4096);   /* small enough to force evictions */
     fs_ops.init(NULL);
     
     Suite *s = suite_create("fs5600");
@@ -689,6 +1814,26 @@ int main(int argc, char **argv)
     tcase_add_test(tc, test_write_overwrite);
     tcase_add_test(tc, test_write_unlink_block);
     tcase_add_test(tc, test_write_error);
+    tcase_add_test(tc, test_writeback);
+    tcase_add_test(tc, test_ramdisk);
+    tcase_add_test(tc, test_readahead);
+    tcase_add_test(tc, test_csum);
+    tcase_add_test(tc, test_discard);
+    tcase_add_test(tc, test_icache);
+    tcase_add_test(tc, test_negative);
+    tcase_add_test(tc, test_bigdir);
+    tcase_add_test(tc, test_extents);
+    tcase_add_test(tc, test_contig);
+    tcase_add_test(tc, test_big_bitmap);
+    tcase_add_test(tc, test_indirect);
+    tcase_add_test(tc, test_legacy_maxfile);
+    tcase_add_test(tc, test_inline);
+    tcase_add_test(tc, test_statfs_counts);
+    tcase_add_test(tc, test_journal);
+    tcase_add_test(tc, test_journal_reuse);
+    tcase_add_test(tc, test_txn_writes);
+    tcase_add_test(tc, test_txn_bits);
+    tcase_add_test(tc, test_concurrent_create);
     tcase_add_test(tc, test_truncate);
 
     suite_add_tcase(s, tc);